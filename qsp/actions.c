@@ -171,6 +171,7 @@ void qspStatementSinglelineAddAct(QSPLineOfCode *line, int statPos, int endPos)
     code.LineNum = line->LineNum;
     code.LinesToElse = code.LinesToEnd = 0;
     code.IsMultiline = QSP_FALSE;
+    code.LabelsIndex = 0;
     code.StatsCount = endPos - statPos;
     qspCopyPrepStatements(&code.Stats, line->Stats, statPos, endPos, (int)(firstPos - line->Str.Str));
     if (argsCount == 2)
@@ -273,7 +273,7 @@ QSPString qspCallInputBox(QSPString text)
         QSP_CHAR *buffer;
         qspPrepareCallback(&state, QSP_TRUE);
 
-        buffer = (QSP_CHAR *)malloc((maxLen + 1) * sizeof(QSP_CHAR));
+        buffer = qspAllocateText(maxLen + 1);
         *buffer = 0;
         qspCallbacks[QSP_CALL_INPUTBOX](text, buffer, maxLen);
         buffer[maxLen] = 0;
@@ -300,7 +300,7 @@ QSPString qspCallVersion(QSPString param)
         QSP_CHAR *buffer;
         qspPrepareCallback(&state, QSP_FALSE);
 
-        buffer = (QSP_CHAR *)malloc((maxLen + 1) * sizeof(QSP_CHAR));
+        buffer = qspAllocateText(maxLen + 1);
         *buffer = 0;
         qspCallbacks[QSP_CALL_VERSION](param, buffer, maxLen);
         buffer[maxLen] = 0;
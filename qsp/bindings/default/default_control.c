@@ -11,6 +11,7 @@
 
 #include "../../actions.h"
 #include "../../callbacks.h"
+#include "../../codetools.h"
 #include "../../common.h"
 #include "../../errors.h"
 #include "../../game.h"
@@ -294,7 +295,8 @@ QSP_BOOL QSPGetVarValue(QSPString name, int ind, QSPVariant *res)
     QSPVar *var = qspVarReference(name, QSP_FALSE);
     if (var && ind >= 0 && ind < var->ValsCount)
     {
-        *res = var->Values[ind];
+        QSPVariant *val = qspGetVarItem(var, ind);
+        *res = (val ? *val : qspGetEmptyVariant(QSP_TYPE_UNDEF)); /* items of sparse arrays might be missing */
         return QSP_TRUE;
     }
 
@@ -308,7 +310,7 @@ QSP_BOOL QSPConvertValueToString(QSPVariant value, QSP_CHAR *buf, int bufSize)
     QSPString res = qspGetVariantAsString(&value);
     resLen = qspStrLen(res);
     if (resLen >= bufSize) resLen = bufSize - 1;
-    memcpy(buf, res.Str, resLen * sizeof(QSP_CHAR));
+    if (resLen > 0) memcpy(buf, res.Str, resLen * sizeof(QSP_CHAR)); /* the null string has no characters */
     buf[resLen] = 0;
     qspFreeString(&res);
     return QSP_TRUE;
@@ -316,10 +318,10 @@ QSP_BOOL QSPConvertValueToString(QSPVariant value, QSP_CHAR *buf, int bufSize)
 /* Get numeric value of the specified array item */
 QSP_BOOL QSPGetNumVarValue(QSPString name, int ind, QSP_BIGINT *res)
 {
+    QSPVariant *val;
     QSPVar *var = qspVarReference(name, QSP_FALSE);
-    if (var && ind >= 0 && ind < var->ValsCount)
+    if (var && (val = qspGetVarItem(var, ind)))
     {
-        QSPVariant *val = var->Values + ind;
         if (QSP_ISNUM(val->Type))
         {
             *res = QSP_PNUM(val);
@@ -336,7 +338,13 @@ QSP_BOOL QSPGetStrVarValue(QSPString name, int ind, QSPString *res)
     QSPVar *var = qspVarReference(name, QSP_FALSE);
     if (var && ind >= 0 && ind < var->ValsCount)
     {
-        QSPVariant *val = var->Values + ind;
+        QSPVariant *val = qspGetVarItem(var, ind);
+        if (!val)
+        {
+            /* Items of sparse arrays might be missing */
+            *res = qspNullString;
+            return QSP_TRUE;
+        }
         if (QSP_ISSTR(val->Type))
         {
             *res = QSP_PSTR(val);
@@ -371,7 +379,7 @@ QSP_BOOL QSPCalculateStrExpression(QSPString s, QSP_CHAR *buf, int bufSize, QSP_
     qspConvertVariantTo(&value, QSP_TYPE_STR);
     resLen = qspStrLen(QSP_STR(value));
     if (resLen >= bufSize) resLen = bufSize - 1;
-    memcpy(buf, QSP_STR(value).Str, resLen * sizeof(QSP_CHAR));
+    if (resLen > 0) memcpy(buf, QSP_STR(value).Str, resLen * sizeof(QSP_CHAR)); /* the null string has no characters */
     buf[resLen] = 0;
     qspFreeVariant(&value);
     if (toRefreshUI) qspCallRefreshInt(QSP_FALSE);
@@ -438,6 +446,32 @@ QSPString QSPGetErrorDesc(int errorNum)
     return qspGetErrorDesc(errorNum);
 }
 /* ------------------------------------------------------------ */
+/* Expressions cache */
+
+/* Get statistics of the compiled expressions cache */
+QSPExpCacheStats QSPGetExpCacheStats(void)
+{
+    return qspGetMathExpsStats();
+}
+/* Set memory budget of the compiled expressions cache in bytes */
+void QSPSetExpCacheSize(int maxSize)
+{
+    qspSetMathExpsCacheSize(maxSize);
+}
+/* ------------------------------------------------------------ */
+/* Code cache */
+
+/* Get statistics of the cache of preprocessed code (DYNAMIC, DYNEVAL, executed strings) */
+QSPCodeCacheStats QSPGetCodeCacheStats(void)
+{
+    return qspGetCachedCodeStats();
+}
+/* Set memory budget of the code cache in bytes */
+void QSPSetCodeCacheSize(int maxSize)
+{
+    qspSetCachedCodeSize(maxSize);
+}
+/* ------------------------------------------------------------ */
 /* Game controls */
 
 /* Load game from data */
@@ -120,6 +120,12 @@
     /* Errors */
     QSP_EXTERN QSPErrorInfo QSPGetLastErrorData(void);
     QSP_EXTERN QSPString QSPGetErrorDesc(int errorNum);
+    /* Expressions cache */
+    QSP_EXTERN QSPExpCacheStats QSPGetExpCacheStats(void);
+    QSP_EXTERN void QSPSetExpCacheSize(int maxSize);
+    /* Code cache */
+    QSP_EXTERN QSPCodeCacheStats QSPGetCodeCacheStats(void);
+    QSP_EXTERN void QSPSetCodeCacheSize(int maxSize);
     /* Game */
     QSP_EXTERN QSP_BOOL QSPLoadGameWorldFromData(const void *data, int dataSize, QSP_BOOL isNewGame);
     QSP_EXTERN QSP_BOOL QSPSaveGameAsData(void *buf, int *bufSize, QSP_BOOL toRefreshUI);
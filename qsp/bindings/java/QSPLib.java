@@ -94,6 +94,26 @@ public abstract class QSPLib {
         public String intLine; /* line of the actual code */
     }
 
+    public class ExpCacheStats {
+        public int expsCount; /* number of cached expressions */
+        public int memoryUsed; /* estimated size of the cache in bytes */
+        public int memoryLimit; /* memory budget of the cache in bytes */
+        public int hitsCount;
+        public int missesCount;
+        public int evictionsCount;
+        public int compileTime; /* total time spent compiling expressions in milliseconds */
+        public int foldedOpsCount; /* items removed from compiled expressions by constant folding */
+    }
+
+    public class CodeCacheStats {
+        public int blocksCount; /* number of cached code blocks */
+        public int memoryUsed; /* estimated size of the cache in bytes */
+        public int memoryLimit; /* memory budget of the cache in bytes */
+        public int hitsCount;
+        public int missesCount;
+        public int evictionsCount;
+    }
+
     static {
         System.loadLibrary("qsp");
         // System.load("libqsp.so");
@@ -135,6 +155,10 @@ public abstract class QSPLib {
     public native boolean execUserInput(boolean toRefreshUI);
     public native ErrorInfo getLastErrorData();
     public native String getErrorDesc(int errorNum);
+    public native ExpCacheStats getExpCacheStats();
+    public native void setExpCacheSize(int maxSize);
+    public native CodeCacheStats getCodeCacheStats();
+    public native void setCodeCacheSize(int maxSize);
     public native boolean loadGameWorldFromData(byte[] data, boolean isNewGame);
     public native byte[] saveGameAsData(boolean toRefreshUI);
     public native boolean openSavedGameFromData(byte[] data, boolean toRefreshUI);
@@ -247,6 +247,38 @@ JNIEXPORT jobject JNICALL Java_com_libqsp_jni_QSPLib_getLastErrorData
 JNIEXPORT jstring JNICALL Java_com_libqsp_jni_QSPLib_getErrorDesc
   (JNIEnv *, jobject, jint);
 
+/*
+ * Class:     com_libqsp_jni_QSPLib
+ * Method:    getExpCacheStats
+ * Signature: ()Lcom/libqsp/jni/QSPLib/ExpCacheStats;
+ */
+JNIEXPORT jobject JNICALL Java_com_libqsp_jni_QSPLib_getExpCacheStats
+  (JNIEnv *, jobject);
+
+/*
+ * Class:     com_libqsp_jni_QSPLib
+ * Method:    setExpCacheSize
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_setExpCacheSize
+  (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_libqsp_jni_QSPLib
+ * Method:    getCodeCacheStats
+ * Signature: ()Lcom/libqsp/jni/QSPLib/CodeCacheStats;
+ */
+JNIEXPORT jobject JNICALL Java_com_libqsp_jni_QSPLib_getCodeCacheStats
+  (JNIEnv *, jobject);
+
+/*
+ * Class:     com_libqsp_jni_QSPLib
+ * Method:    setCodeCacheSize
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_setCodeCacheSize
+  (JNIEnv *, jobject, jint);
+
 /*
  * Class:     com_libqsp_jni_QSPLib
  * Method:    loadGameWorldFromData
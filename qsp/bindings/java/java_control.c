@@ -11,6 +11,7 @@
 
 #include "../../actions.h"
 #include "../../callbacks.h"
+#include "../../codetools.h"
 #include "../../common.h"
 #include "../../errors.h"
 #include "../../game.h"
@@ -33,6 +34,8 @@ jclass qspListItemClass;
 jclass qspObjectItemClass;
 jclass qspExecutionStateClass;
 jclass qspErrorInfoClass;
+jclass qspExpCacheStatsClass;
+jclass qspCodeCacheStatsClass;
 
 jstring qspToJavaString(JNIEnv *env, QSPString str)
 {
@@ -297,10 +300,10 @@ JNIEXPORT jlong JNICALL Java_com_libqsp_jni_QSPLib_getNumVarValue(JNIEnv *env, j
     QSPString varName = qspFromJavaString(env, name);
     QSPVar *var = qspVarReference(varName, QSP_FALSE);
     qspFreeString(&varName);
-    if (var && ind >= 0 && ind < var->ValsCount)
+    if (var)
     {
-        QSPVariant *val = var->Values + ind;
-        if (QSP_ISNUM(val->Type)) return QSP_PNUM(val);
+        QSPVariant *val = qspGetVarItem(var, ind);
+        if (val && QSP_ISNUM(val->Type)) return QSP_PNUM(val);
     }
     return 0;
 }
@@ -310,10 +313,10 @@ JNIEXPORT jstring JNICALL Java_com_libqsp_jni_QSPLib_getStrVarValue(JNIEnv *env,
     QSPString varName = qspFromJavaString(env, name);
     QSPVar *var = qspVarReference(varName, QSP_FALSE);
     qspFreeString(&varName);
-    if (var && ind >= 0 && ind < var->ValsCount)
+    if (var)
     {
-        QSPVariant *val = var->Values + ind;
-        if (QSP_ISSTR(val->Type)) return qspToJavaString(env, QSP_PSTR(val));
+        QSPVariant *val = qspGetVarItem(var, ind); /* items of sparse arrays might be missing */
+        if (val && QSP_ISSTR(val->Type)) return qspToJavaString(env, QSP_PSTR(val));
     }
     return qspToJavaString(env, qspNullString);
 }
@@ -442,6 +445,82 @@ JNIEXPORT jstring JNICALL Java_com_libqsp_jni_QSPLib_getErrorDesc(JNIEnv *env, j
     return qspToJavaString(env, qspGetErrorDesc(errorNum));
 }
 /* ------------------------------------------------------------ */
+/* Expressions cache */
+
+/* Get statistics of the compiled expressions cache */
+JNIEXPORT jobject JNICALL Java_com_libqsp_jni_QSPLib_getExpCacheStats(JNIEnv *env, jobject api)
+{
+    jfieldID fieldId;
+    QSPExpCacheStats stats = qspGetMathExpsStats();
+    jobject jniStats = (*env)->AllocObject(env, qspExpCacheStatsClass);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "expsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.ExpsCount);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "memoryUsed", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MemoryUsed);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "memoryLimit", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MemoryLimit);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "hitsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.HitsCount);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "missesCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MissesCount);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "evictionsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.EvictionsCount);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "compileTime", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.CompileTime);
+
+    fieldId = (*env)->GetFieldID(env, qspExpCacheStatsClass , "foldedOpsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.FoldedOpsCount);
+
+    return jniStats;
+}
+/* Set memory budget of the compiled expressions cache in bytes */
+JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_setExpCacheSize(JNIEnv *env, jobject api, jint maxSize)
+{
+    qspSetMathExpsCacheSize(maxSize);
+}
+/* ------------------------------------------------------------ */
+/* Code cache */
+
+/* Get statistics of the cache of preprocessed code (DYNAMIC, DYNEVAL, executed strings) */
+JNIEXPORT jobject JNICALL Java_com_libqsp_jni_QSPLib_getCodeCacheStats(JNIEnv *env, jobject api)
+{
+    jfieldID fieldId;
+    QSPCodeCacheStats stats = qspGetCachedCodeStats();
+    jobject jniStats = (*env)->AllocObject(env, qspCodeCacheStatsClass);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "blocksCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.BlocksCount);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "memoryUsed", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MemoryUsed);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "memoryLimit", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MemoryLimit);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "hitsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.HitsCount);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "missesCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.MissesCount);
+
+    fieldId = (*env)->GetFieldID(env, qspCodeCacheStatsClass , "evictionsCount", "I");
+    (*env)->SetIntField(env, jniStats, fieldId, stats.EvictionsCount);
+
+    return jniStats;
+}
+/* Set memory budget of the code cache in bytes */
+JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_setCodeCacheSize(JNIEnv *env, jobject api, jint maxSize)
+{
+    qspSetCachedCodeSize(maxSize);
+}
+/* ------------------------------------------------------------ */
 /* Game controls */
 
 /* Load game from data */
@@ -534,6 +613,12 @@ JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_init(JNIEnv *env, jobject api)
     clazz = (*env)->FindClass(env, "com/libqsp/jni/QSPLib$ErrorInfo");
     qspErrorInfoClass = (jclass)(*env)->NewGlobalRef(env, clazz);
 
+    clazz = (*env)->FindClass(env, "com/libqsp/jni/QSPLib$ExpCacheStats");
+    qspExpCacheStatsClass = (jclass)(*env)->NewGlobalRef(env, clazz);
+
+    clazz = (*env)->FindClass(env, "com/libqsp/jni/QSPLib$CodeCacheStats");
+    qspCodeCacheStatsClass = (jclass)(*env)->NewGlobalRef(env, clazz);
+
     /* Get references to callbacks */
     qspSetCallback(QSP_CALL_DEBUG, (*env)->GetMethodID(env, qspApiClass, "onDebug", "(Ljava/lang/String;)V"));
     qspSetCallback(QSP_CALL_ISPLAYINGFILE, (*env)->GetMethodID(env, qspApiClass, "onIsPlayingFile", "(Ljava/lang/String;)Z"));
@@ -568,6 +653,8 @@ JNIEXPORT void JNICALL Java_com_libqsp_jni_QSPLib_terminate(JNIEnv *env, jobject
     (*env)->DeleteGlobalRef(env, qspObjectItemClass);
     (*env)->DeleteGlobalRef(env, qspExecutionStateClass);
     (*env)->DeleteGlobalRef(env, qspErrorInfoClass);
+    (*env)->DeleteGlobalRef(env, qspExpCacheStatsClass);
+    (*env)->DeleteGlobalRef(env, qspCodeCacheStatsClass);
 }
 
 #endif
@@ -52,6 +52,8 @@
     extern jclass qspObjectItemClass;
     extern jclass qspExecutionStateClass;
     extern jclass qspErrorInfoClass;
+    extern jclass qspExpCacheStatsClass;
+    extern jclass qspCodeCacheStatsClass;
 
     typedef struct
     {
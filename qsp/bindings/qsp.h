@@ -183,6 +183,28 @@
         QSPString IntLine; /* line of the actual code */
     } QSPErrorInfo;
 
+    typedef struct
+    {
+        int ExpsCount; /* number of cached expressions */
+        int MemoryUsed; /* estimated size of the cache in bytes */
+        int MemoryLimit; /* memory budget of the cache in bytes */
+        int HitsCount;
+        int MissesCount;
+        int EvictionsCount;
+        int CompileTime; /* total time spent compiling expressions in milliseconds */
+        int FoldedOpsCount; /* items removed from compiled expressions by constant folding */
+    } QSPExpCacheStats;
+
+    typedef struct
+    {
+        int BlocksCount; /* number of cached code blocks */
+        int MemoryUsed; /* estimated size of the cache in bytes */
+        int MemoryLimit; /* memory budget of the cache in bytes */
+        int HitsCount;
+        int MissesCount;
+        int EvictionsCount;
+    } QSPCodeCacheStats;
+
     typedef struct
     {
         int LineNum;
@@ -8,6 +8,14 @@
 #include "codetools.h"
 #include "statements.h"
 #include "text.h"
+#include "variables.h"
+
+QSPCachedCode **qspCachedCode = 0;
+int qspCachedCodeBucketsCount = 0;
+QSPCachedCode *qspFirstUsedCode = 0; /* the most recently used code block */
+QSPCachedCode *qspLastUsedCode = 0; /* the least recently used code block */
+QSPCodeCacheStats qspCachedCodeStats;
+unsigned int qspPrepCompilationsCount = 0; /* grows whenever prepared code compiles its parts while running */
 
 INLINE int qspStatStringCompare(const void *name, const void *compareTo);
 INLINE QSP_TINYINT qspGetStatCode(QSPString s, QSP_CHAR **pos);
@@ -17,9 +25,20 @@ INLINE QSP_TINYINT qspAppendRegularArgs(QSPCachedArg **args, QSP_TINYINT argsCou
 INLINE QSP_TINYINT qspInitUserCallArgs(QSPCachedArg **args, QSP_TINYINT QSP_UNUSED(statCode), QSPString s, QSP_CHAR *origStart, QSP_TINYINT *errorCode);
 INLINE QSP_TINYINT qspInitSingleArg(QSPCachedArg **args, QSP_TINYINT statCode, QSPString s, QSP_CHAR *origStart, QSP_TINYINT *errorCode);
 INLINE QSP_TINYINT qspInitRegularArgs(QSPCachedArg **args, QSP_TINYINT statCode, QSPString s, QSP_CHAR *origStart, QSP_TINYINT *errorCode);
+INLINE void qspInitStatTargets(QSPCachedStat *stat, QSP_CHAR *origStart);
+INLINE void qspInitStatJumpLabel(QSPCachedStat *stat, QSP_CHAR *origStart);
+INLINE void qspInitLabelsIndex(QSPLineOfCode *lines, int count);
+INLINE void qspInitElseStats(QSPLineOfCode *line);
 INLINE QSP_CHAR *qspSkipQuotedString(QSP_CHAR *pos, QSP_CHAR *endPos);
 INLINE QSP_BOOL qspAppendLineToResult(QSPString str, int lineNum, QSPBufString *strBuf, QSPLineOfCode *line);
 INLINE void qspAppendLastLineToResult(QSPString str, int lineNum, QSPBufString *strBuf, QSPLineOfCode *line);
+INLINE int qspGetCachedArgSize(QSPCachedArg *arg);
+INLINE int qspGetPrepStatsSize(QSPCachedStat *stats, int count);
+INLINE int qspGetPrepLinesSize(QSPLineOfCode *lines, int count);
+INLINE int qspGetCachedCodeSize(QSPCachedCode *code);
+INLINE void qspResizeCachedCodeBuckets(int bucketsCount);
+INLINE void qspFreeCachedCode(QSPCachedCode *code);
+INLINE void qspTrimCachedCode(int sizeToAdd);
 
 INLINE int qspStatStringCompare(const void *name, const void *compareTo)
 {
@@ -59,6 +78,7 @@ INLINE QSP_TINYINT qspGetStatCode(QSPString s, QSP_CHAR **pos)
 
 INLINE QSP_TINYINT qspInitStatArgs(QSPCachedArg **args, QSP_TINYINT statCode, QSPString s, QSP_CHAR *origStart, QSP_TINYINT *errorCode)
 {
+    QSP_TINYINT i, argsCount;
     *args = 0;
     *errorCode = 0;
     switch (statCode)
@@ -72,16 +92,27 @@ INLINE QSP_TINYINT qspInitStatArgs(QSPCachedArg **args, QSP_TINYINT statCode, QS
             return 0;
         case qspStatSet:
         case qspStatLocal:
-            return qspInitSetArgs(args, statCode, s, origStart, errorCode);
+            argsCount = qspInitSetArgs(args, statCode, s, origStart, errorCode);
+            break;
         case qspStatUserCall:
-            return qspInitUserCallArgs(args, statCode, s, origStart, errorCode);
+            argsCount = qspInitUserCallArgs(args, statCode, s, origStart, errorCode);
+            break;
         case qspStatImplicitStatement:
         case qspStatIf:
         case qspStatElseIf:
-            return qspInitSingleArg(args, statCode, s, origStart, errorCode);
+            argsCount = qspInitSingleArg(args, statCode, s, origStart, errorCode);
+            break;
         default:
-            return qspInitRegularArgs(args, statCode, s, origStart, errorCode);
+            argsCount = qspInitRegularArgs(args, statCode, s, origStart, errorCode);
+            break;
     }
+    /* Expressions get compiled on demand */
+    for (i = 0; i < argsCount; ++i)
+    {
+        (*args)[i].IsEvaluated = QSP_FALSE;
+        (*args)[i].Exp = 0;
+    }
+    return argsCount;
 }
 
 INLINE QSP_TINYINT qspInitSetArgs(QSPCachedArg **args, QSP_TINYINT QSP_UNUSED(statCode), QSPString s, QSP_CHAR *origStart, QSP_TINYINT *errorCode)
@@ -245,6 +276,183 @@ INLINE QSP_TINYINT qspInitRegularArgs(QSPCachedArg **args, QSP_TINYINT statCode,
     return qspAppendRegularArgs(args, 0, qspStats[statCode].MinArgsCount, qspStats[statCode].MaxArgsCount, s, origStart, errorCode);
 }
 
+INLINE void qspInitStatTargets(QSPCachedStat *stat, QSP_CHAR *origStart)
+{
+    /* Parse assigned variables once, so the statements don't touch their text at runtime */
+    QSP_CHAR *pos, *nameEnd;
+    QSPString names, target, rest;
+    QSPAssignTarget targets[QSP_MAXSETVARS], *curTarget;
+    QSP_TINYINT targetsCount = 0;
+    stat->TargetsCount = 0;
+    stat->Targets = 0;
+    switch (stat->Stat)
+    {
+    case qspStatSet:
+    case qspStatLocal:
+        if (stat->ErrorCode || !stat->ArgsCount) return;
+        names = qspStringFromPair(origStart + stat->Args[0].StartPos, origStart + stat->Args[0].EndPos);
+        while (1)
+        {
+            /* Names get split the same way at runtime, we skip it in case of errors */
+            if (targetsCount >= QSP_MAXSETVARS) return;
+            pos = qspDelimPos(names, QSP_COMMA_CHAR);
+            target = qspDelSpc(pos ? qspStringFromPair(names.Str, pos) : names);
+            if (qspIsEmpty(target)) return;
+            curTarget = targets + targetsCount++;
+            curTarget->StartPos = (int)(target.Str - origStart);
+            curTarget->EndPos = (int)(target.End - origStart);
+            curTarget->Index.StartPos = curTarget->Index.EndPos = 0;
+            nameEnd = qspStrCharClass(target, QSP_CHAR_DELIM);
+            if (nameEnd)
+            {
+                curTarget->NameEndPos = (int)(nameEnd - origStart);
+                curTarget->Type = qspTargetRaw;
+                rest = qspStringFromPair(nameEnd, target.End);
+                qspSkipSpaces(&rest);
+                if (!qspIsEmpty(rest) && *rest.Str == QSP_LSBRACK_CHAR)
+                {
+                    QSP_CHAR *rPos = qspDelimPos(rest, QSP_RSBRACK_CHAR);
+                    if (rPos)
+                    {
+                        rest.Str += QSP_CHAR_LEN;
+                        qspSkipSpaces(&rest);
+                        if (rest.Str == rPos)
+                            curTarget->Type = qspTargetNewItem;
+                        else
+                        {
+                            curTarget->Type = qspTargetItem;
+                            curTarget->Index.StartPos = (int)(rest.Str - origStart);
+                            curTarget->Index.EndPos = (int)(rPos - origStart);
+                        }
+                    }
+                }
+                target.End = nameEnd;
+            }
+            else
+            {
+                curTarget->NameEndPos = curTarget->EndPos;
+                curTarget->Type = qspTargetVar;
+            }
+            curTarget->NameId = qspGetVarNameId(target);
+            curTarget->Index.IsEvaluated = QSP_FALSE;
+            curTarget->Index.Exp = 0;
+            if (!pos) break;
+            names.Str = pos + QSP_CHAR_LEN;
+        }
+        stat->Targets = (QSPAssignTarget *)malloc(targetsCount * sizeof(QSPAssignTarget));
+        memcpy(stat->Targets, targets, targetsCount * sizeof(QSPAssignTarget));
+        stat->TargetsCount = targetsCount;
+        break;
+    }
+}
+
+INLINE void qspInitStatJumpLabel(QSPCachedStat *stat, QSP_CHAR *origStart)
+{
+    /* A string literal without subexpressions always gives the same label, so we prepare it here */
+    QSP_CHAR quote, *pos;
+    QSPString arg;
+    stat->JumpLabel = qspNullString;
+    if (stat->Stat != qspStatJump || stat->ErrorCode || stat->ArgsCount != 1) return;
+    arg = qspDelSpc(qspStringFromPair(origStart + stat->Args[0].StartPos, origStart + stat->Args[0].EndPos));
+    if (qspStrLen(arg) < 2 || !qspIsInClass(*arg.Str, QSP_CHAR_QUOT)) return;
+    quote = *arg.Str;
+    if (*(arg.End - 1) != quote) return;
+    arg = qspStringFromPair(arg.Str + QSP_CHAR_LEN, arg.End - QSP_CHAR_LEN);
+    for (pos = arg.Str; pos < arg.End; ++pos)
+        if (*pos == quote) return; /* escaped quotes or an expression */
+    if (qspStrStr(arg, QSP_STATIC_STR(QSP_LSUBEX))) return;
+    stat->JumpLabel = qspCopyToNewText(qspDelSpc(arg));
+    qspUpperStr(&stat->JumpLabel);
+}
+
+INLINE void qspInitLabelsIndex(QSPLineOfCode *lines, int count)
+{
+    /* Lines get added in ascending order, so duplicated labels keep the order of the lines along the probe sequence */
+    int i, slotInd, slotsCount, labelsCount = 0;
+    unsigned int hash;
+    QSPLabelsIndex *index;
+    if (!count) return;
+    lines->LabelsIndex = 0;
+    for (i = 0; i < count; ++i)
+        if (lines[i].Label.Str) ++labelsCount;
+    if (!labelsCount) return;
+    slotsCount = 4;
+    while (slotsCount < labelsCount * 2) slotsCount <<= 1;
+    index = (QSPLabelsIndex *)malloc(sizeof(QSPLabelsIndex) + slotsCount * sizeof(QSPLabelSlot));
+    index->Slots = (QSPLabelSlot *)(index + 1);
+    index->Mask = slotsCount - 1;
+    for (i = 0; i < slotsCount; ++i)
+        index->Slots[i].LineInd = -1;
+    for (i = 0; i < count; ++i)
+    {
+        if (lines[i].Label.Str)
+        {
+            hash = qspGetNameHash(lines[i].Label);
+            slotInd = hash & index->Mask;
+            while (index->Slots[slotInd].LineInd >= 0)
+                slotInd = (slotInd + 1) & index->Mask;
+            index->Slots[slotInd].LineInd = i;
+            index->Slots[slotInd].Hash = hash;
+        }
+    }
+    lines->LabelsIndex = index;
+}
+
+INLINE void qspInitElseStats(QSPLineOfCode *line)
+{
+    /* Bounds of nested single-line blocks don't change the result, so we search up to the end of the line */
+    int i, j, c;
+    QSPCachedStat *stats = line->Stats;
+    for (i = 0; i < line->StatsCount; ++i)
+    {
+        stats[i].ElseStat = 0;
+        switch (stats[i].Stat)
+        {
+        case qspStatIf:
+        case qspStatElseIf:
+            c = 1;
+            for (j = i + 1; j < line->StatsCount; ++j)
+            {
+                switch (stats[j].Stat)
+                {
+                case qspStatIf:
+                    QSP_INC_POSITIVE(c);
+                    break;
+                case qspStatElse:
+                case qspStatElseIf:
+                    QSP_DEC_POSITIVE(c);
+                    break;
+                }
+                if (!c)
+                {
+                    stats[i].ElseStat = j;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+}
+
+int qspSearchLabel(QSPLineOfCode *lines, int start, int end, QSPString label)
+{
+    QSPLabelsIndex *index = lines->LabelsIndex;
+    if (index)
+    {
+        QSPLabelSlot *slot;
+        unsigned int hash = qspGetNameHash(label);
+        int slotInd = hash & index->Mask;
+        while ((slot = index->Slots + slotInd)->LineInd >= 0)
+        {
+            /* The first suitable line is the closest one to the start */
+            if (slot->Hash == hash && slot->LineInd >= start && qspStrsEqual(lines[slot->LineInd].Label, label))
+                return (slot->LineInd < end ? slot->LineInd : -1);
+            slotInd = (slotInd + 1) & index->Mask;
+        }
+    }
+    return -1;
+}
+
 QSPString qspGetLineLabel(QSPString str)
 {
     qspSkipSpaces(&str);
@@ -276,6 +484,7 @@ void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum)
     line->IsMultiline = QSP_FALSE;
     line->StatsCount = 0;
     line->Stats = 0;
+    line->LabelsIndex = 0;
     qspSkipSpaces(&str);
     if (qspIsEmpty(str)) return;
     statInd = 0;
@@ -351,6 +560,9 @@ void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum)
             line->Stats[statInd].ParamPos = (int)(str.Str - line->Str.Str);
             line->Stats[statInd].EndPos = (int)(statDelimPos - line->Str.Str);
             line->Stats[statInd].ArgsCount = qspInitStatArgs(&line->Stats[statInd].Args, statCode, qspStringFromPair(str.Str, statDelimPos), line->Str.Str, &line->Stats[statInd].ErrorCode);
+            qspInitStatTargets(line->Stats + statInd, line->Str.Str);
+            qspInitStatJumpLabel(line->Stats + statInd, line->Str.Str);
+            line->Stats[statInd].LoopHeader = 0;
             ++statInd;
             str.Str = nextPos;
             qspSkipSpaces(&str);
@@ -438,6 +650,8 @@ void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum)
         line->Stats[0].ArgsCount = line->Stats[1].ArgsCount;
         line->Stats[0].Args = line->Stats[1].Args;
         line->Stats[0].ErrorCode = line->Stats[1].ErrorCode;
+        line->Stats[0].TargetsCount = line->Stats[1].TargetsCount;
+        line->Stats[0].Targets = line->Stats[1].Targets;
         statInd = 1; /* move current comment to index 1 */
     }
     else
@@ -463,6 +677,9 @@ void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum)
         line->Stats[statInd].EndPos = (int)(str.End - line->Str.Str);
         line->Stats[statInd].ArgsCount = qspInitStatArgs(&line->Stats[statInd].Args, statCode, str, line->Str.Str, &line->Stats[statInd].ErrorCode);
     }
+    qspInitStatTargets(line->Stats + statInd, line->Str.Str);
+    qspInitStatJumpLabel(line->Stats + statInd, line->Str.Str);
+    line->Stats[statInd].LoopHeader = 0;
     switch (line->Stats[0].Stat)
     {
     case qspStatAct:
@@ -488,6 +705,7 @@ void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum)
         line->LinesToEnd = line->LinesToElse = 1;
         break;
     }
+    qspInitElseStats(line);
     line->Label = qspGetLineLabel(line->Str);
 }
 
@@ -495,12 +713,48 @@ void qspFreeLineOfCode(QSPLineOfCode *line)
 {
     /* We don't release the line text here */
     qspFreeString(&line->Label);
+    if (line->LabelsIndex) free(line->LabelsIndex);
     if (line->Stats)
     {
         int i;
         QSPCachedStat *stat = line->Stats;
         for (i = 0; i < line->StatsCount; ++i, ++stat)
-            if (stat->Args) free(stat->Args);
+        {
+            if (stat->Args)
+            {
+                QSP_TINYINT j;
+                for (j = 0; j < stat->ArgsCount; ++j)
+                {
+                    if (stat->Args[j].Exp)
+                    {
+                        qspFreeMathExpression(stat->Args[j].Exp);
+                        free(stat->Args[j].Exp);
+                    }
+                }
+                free(stat->Args);
+            }
+            if (stat->Targets)
+            {
+                QSP_TINYINT j;
+                for (j = 0; j < stat->TargetsCount; ++j)
+                {
+                    if (stat->Targets[j].Index.Exp)
+                    {
+                        qspFreeMathExpression(stat->Targets[j].Index.Exp);
+                        free(stat->Targets[j].Index.Exp);
+                    }
+                }
+                free(stat->Targets);
+            }
+            qspFreeString(&stat->JumpLabel);
+            if (stat->LoopHeader)
+            {
+                qspFreeLineOfCode(&stat->LoopHeader->InitLine);
+                qspFreeLineOfCode(&stat->LoopHeader->StepLine);
+                qspFreeMathExpression(&stat->LoopHeader->Condition);
+                free(stat->LoopHeader);
+            }
+        }
         free(line->Stats);
     }
 }
@@ -526,6 +780,7 @@ void qspCopyPrepStatements(QSPCachedStat **dest, QSPCachedStat *src, int start,
     if (src && statsCount)
     {
         QSP_TINYINT i, argsCount;
+        int firstStat = start;
         QSPCachedStat *stat;
         *dest = (QSPCachedStat *)malloc(statsCount * sizeof(QSPCachedStat));
         stat = *dest;
@@ -535,6 +790,7 @@ void qspCopyPrepStatements(QSPCachedStat **dest, QSPCachedStat *src, int start,
             stat->ParamPos = src[start].ParamPos - codeOffset;
             stat->EndPos = src[start].EndPos - codeOffset;
             stat->ErrorCode = src[start].ErrorCode;
+            stat->ElseStat = (src[start].ElseStat && src[start].ElseStat < end ? src[start].ElseStat - firstStat : 0);
             argsCount = stat->ArgsCount = src[start].ArgsCount;
             if (argsCount)
             {
@@ -543,10 +799,37 @@ void qspCopyPrepStatements(QSPCachedStat **dest, QSPCachedStat *src, int start,
                 {
                     stat->Args[i].StartPos = src[start].Args[i].StartPos - codeOffset;
                     stat->Args[i].EndPos = src[start].Args[i].EndPos - codeOffset;
+                    /* Compiled expressions aren't shared, the copy compiles its own ones */
+                    stat->Args[i].IsEvaluated = QSP_FALSE;
+                    stat->Args[i].Exp = 0;
                 }
             }
             else
                 stat->Args = 0;
+            if (src[start].Targets)
+            {
+                QSPAssignTarget *target;
+                stat->TargetsCount = src[start].TargetsCount;
+                stat->Targets = (QSPAssignTarget *)malloc(stat->TargetsCount * sizeof(QSPAssignTarget));
+                memcpy(stat->Targets, src[start].Targets, stat->TargetsCount * sizeof(QSPAssignTarget));
+                for (i = 0, target = stat->Targets; i < stat->TargetsCount; ++i, ++target)
+                {
+                    target->StartPos -= codeOffset;
+                    target->NameEndPos -= codeOffset;
+                    target->EndPos -= codeOffset;
+                    target->Index.StartPos -= codeOffset;
+                    target->Index.EndPos -= codeOffset;
+                    target->Index.IsEvaluated = QSP_FALSE;
+                    target->Index.Exp = 0;
+                }
+            }
+            else
+            {
+                stat->TargetsCount = 0;
+                stat->Targets = 0;
+            }
+            stat->JumpLabel = qspCopyToNewText(src[start].JumpLabel);
+            stat->LoopHeader = 0; /* the copy parses its own header */
             ++stat;
             ++start;
         }
@@ -573,14 +856,40 @@ void qspCopyPrepLines(QSPLineOfCode **dest, QSPLineOfCode *src, int start, int e
             line->Label = qspCopyToNewText(src[start].Label);
             line->StatsCount = src[start].StatsCount;
             qspCopyPrepStatements(&line->Stats, src[start].Stats, 0, src[start].StatsCount, 0);
+            line->LabelsIndex = 0;
             ++line;
             ++start;
         }
+        qspResolveCodeFlow(*dest, linesCount);
+        qspInitLabelsIndex(*dest, linesCount);
     }
     else
         *dest = 0;
 }
 
+QSPVariant qspCalculateArgValue(QSPString s, QSPCachedArg *arg)
+{
+    if (!arg->Exp)
+    {
+        QSPString expStr = qspStringFromPair(s.Str + arg->StartPos, s.Str + arg->EndPos);
+        if (!arg->IsEvaluated)
+        {
+            /* Code that runs once (e.g. dynamic code) doesn't pay for the compilation here */
+            arg->IsEvaluated = QSP_TRUE;
+            return qspCalculateExprValue(expStr);
+        }
+        arg->Exp = (QSPMathExpression *)malloc(sizeof(QSPMathExpression));
+        if (!qspCompileMathExpression(expStr, arg->Exp))
+        {
+            free(arg->Exp);
+            arg->Exp = 0;
+            return qspGetEmptyVariant(QSP_TYPE_UNDEF);
+        }
+        ++qspPrepCompilationsCount;
+    }
+    return qspCalculateValue(arg->Exp);
+}
+
 QSPString qspJoinPrepLines(QSPLineOfCode *s, int count, QSPString delim)
 {
     int i;
@@ -884,6 +1193,229 @@ int qspPreprocessData(QSPString data, QSPLineOfCode **strs)
     qspFreeBufString(&strBuf);
     ++linesCount;
 
+    qspResolveCodeFlow(lines, linesCount);
+    qspInitLabelsIndex(lines, linesCount);
     *strs = lines;
     return linesCount;
 }
+
+INLINE int qspGetCachedArgSize(QSPCachedArg *arg)
+{
+    if (arg->Exp)
+        return (int)(sizeof(QSPMathExpression) + arg->Exp->Capacity * sizeof(QSPMathCompiledOp));
+    return 0;
+}
+
+INLINE int qspGetPrepStatsSize(QSPCachedStat *stats, int count)
+{
+    int i, size = count * sizeof(QSPCachedStat);
+    for (; count > 0; --count, ++stats)
+    {
+        size += stats->ArgsCount * sizeof(QSPCachedArg) + stats->TargetsCount * sizeof(QSPAssignTarget);
+        size += qspStrLen(stats->JumpLabel) * sizeof(QSP_CHAR);
+        for (i = 0; i < stats->ArgsCount; ++i)
+            size += qspGetCachedArgSize(stats->Args + i);
+        for (i = 0; i < stats->TargetsCount; ++i)
+            size += qspGetCachedArgSize(&stats->Targets[i].Index);
+        if (stats->LoopHeader)
+        {
+            QSPLoopHeader *header = stats->LoopHeader;
+            size += (int)(sizeof(QSPLoopHeader) + header->Condition.Capacity * sizeof(QSPMathCompiledOp));
+            size += qspGetPrepStatsSize(header->InitLine.Stats, header->InitLine.StatsCount);
+            size += qspGetPrepStatsSize(header->StepLine.Stats, header->StepLine.StatsCount);
+        }
+    }
+    return size;
+}
+
+INLINE int qspGetPrepLinesSize(QSPLineOfCode *lines, int count)
+{
+    int size = count * sizeof(QSPLineOfCode);
+    for (; count > 0; --count, ++lines)
+    {
+        size += (qspStrLen(lines->Str) + qspStrLen(lines->Label)) * sizeof(QSP_CHAR);
+        size += qspGetPrepStatsSize(lines->Stats, lines->StatsCount);
+        if (lines->LabelsIndex)
+            size += sizeof(QSPLabelsIndex) + (lines->LabelsIndex->Mask + 1) * sizeof(QSPLabelSlot);
+    }
+    return size;
+}
+
+INLINE int qspGetCachedCodeSize(QSPCachedCode *code)
+{
+    return (int)(sizeof(QSPCachedCode) + qspStrLen(code->Text) * sizeof(QSP_CHAR)) + qspGetPrepLinesSize(code->Lines, code->LinesCount);
+}
+
+void qspClearAllCachedCode(QSP_BOOL toInit)
+{
+    if (toInit)
+    {
+        qspCachedCode = 0;
+        qspCachedCodeBucketsCount = 0;
+        qspFirstUsedCode = qspLastUsedCode = 0;
+        qspCachedCodeStats.BlocksCount = 0;
+        qspCachedCodeStats.MemoryUsed = 0;
+        qspCachedCodeStats.MemoryLimit = QSP_CACHEDCODESIZE;
+        qspCachedCodeStats.HitsCount = 0;
+        qspCachedCodeStats.MissesCount = 0;
+        qspCachedCodeStats.EvictionsCount = 0;
+    }
+    else
+    {
+        /* Code that is being executed is kept */
+        QSPCachedCode *prevCode, *code = qspLastUsedCode;
+        while (code)
+        {
+            prevCode = code->PrevUsed;
+            if (!code->UseCount) qspFreeCachedCode(code);
+            code = prevCode;
+        }
+        if (!qspFirstUsedCode && qspCachedCode)
+        {
+            free(qspCachedCode);
+            qspCachedCode = 0;
+            qspCachedCodeBucketsCount = 0;
+        }
+    }
+}
+
+QSPCodeCacheStats qspGetCachedCodeStats(void)
+{
+    return qspCachedCodeStats;
+}
+
+void qspSetCachedCodeSize(int maxSize)
+{
+    qspCachedCodeStats.MemoryLimit = (maxSize > 0 ? maxSize : 0);
+    qspTrimCachedCode(0);
+}
+
+INLINE void qspResizeCachedCodeBuckets(int bucketsCount)
+{
+    int i;
+    QSPCachedCode *code, **bucket;
+    if (qspCachedCode) free(qspCachedCode);
+    qspCachedCode = (QSPCachedCode **)malloc(bucketsCount * sizeof(QSPCachedCode *));
+    qspCachedCodeBucketsCount = bucketsCount;
+    for (i = 0; i < bucketsCount; ++i)
+        qspCachedCode[i] = 0;
+    /* Every entry is in the list of used code blocks */
+    for (code = qspFirstUsedCode; code; code = code->NextUsed)
+    {
+        bucket = qspCachedCode + code->Hash % bucketsCount;
+        code->NextInBucket = *bucket;
+        *bucket = code;
+    }
+}
+
+INLINE void qspFreeCachedCode(QSPCachedCode *code)
+{
+    QSPCachedCode **link = qspCachedCode + code->Hash % qspCachedCodeBucketsCount;
+    while (*link != code) link = &(*link)->NextInBucket;
+    *link = code->NextInBucket;
+    if (code->PrevUsed)
+        code->PrevUsed->NextUsed = code->NextUsed;
+    else
+        qspFirstUsedCode = code->NextUsed;
+    if (code->NextUsed)
+        code->NextUsed->PrevUsed = code->PrevUsed;
+    else
+        qspLastUsedCode = code->PrevUsed;
+    qspCachedCodeStats.MemoryUsed -= code->Size;
+    --qspCachedCodeStats.BlocksCount;
+    qspFreeString(&code->Text);
+    qspFreePrepLines(code->Lines, code->LinesCount);
+    free(code);
+}
+
+INLINE void qspTrimCachedCode(int sizeToAdd)
+{
+    /* Evict the least recently used code blocks until we fit the budget */
+    QSPCachedCode *prevCode, *code = qspLastUsedCode;
+    while (code && qspCachedCodeStats.MemoryUsed + sizeToAdd > qspCachedCodeStats.MemoryLimit)
+    {
+        prevCode = code->PrevUsed;
+        if (!code->UseCount)
+        {
+            qspFreeCachedCode(code);
+            ++qspCachedCodeStats.EvictionsCount;
+        }
+        code = prevCode;
+    }
+}
+
+QSPCachedCode *qspGetCachedCode(QSPString codeStr)
+{
+    /* Returns the preprocessed code, it has to be released with qspReleaseCachedCode */
+    QSPCachedCode *code, **bucket;
+    unsigned int hash = qspStrHash(codeStr);
+    /* Search for existing item */
+    if (qspCachedCode)
+    {
+        for (code = qspCachedCode[hash % qspCachedCodeBucketsCount]; code; code = code->NextInBucket)
+        {
+            if (code->Hash == hash && qspStrsEqual(code->Text, codeStr))
+            {
+                ++qspCachedCodeStats.HitsCount;
+                if (code->PrevUsed)
+                {
+                    /* Move it to the beginning of the list */
+                    code->PrevUsed->NextUsed = code->NextUsed;
+                    if (code->NextUsed)
+                        code->NextUsed->PrevUsed = code->PrevUsed;
+                    else
+                        qspLastUsedCode = code->PrevUsed;
+                    code->PrevUsed = 0;
+                    code->NextUsed = qspFirstUsedCode;
+                    qspFirstUsedCode->PrevUsed = code;
+                    qspFirstUsedCode = code;
+                }
+                if (!code->UseCount++)
+                    code->CompilationsCount = qspPrepCompilationsCount;
+                return code;
+            }
+        }
+    }
+    /* Preprocess the new code */
+    ++qspCachedCodeStats.MissesCount;
+    code = (QSPCachedCode *)malloc(sizeof(QSPCachedCode));
+    code->Text = qspCopyToNewText(codeStr);
+    code->LinesCount = qspPreprocessData(codeStr, &code->Lines);
+    code->Hash = hash;
+    code->Size = qspGetCachedCodeSize(code);
+    code->UseCount = 1;
+    code->CompilationsCount = qspPrepCompilationsCount;
+    /* Make room for the new entry */
+    qspTrimCachedCode(code->Size);
+    if (qspCachedCodeStats.BlocksCount >= qspCachedCodeBucketsCount)
+        qspResizeCachedCodeBuckets(qspCachedCodeBucketsCount ? qspCachedCodeBucketsCount * 2 : QSP_CACHEDCODEBUCKETS);
+    bucket = qspCachedCode + hash % qspCachedCodeBucketsCount;
+    code->NextInBucket = *bucket;
+    *bucket = code;
+    code->PrevUsed = 0;
+    code->NextUsed = qspFirstUsedCode;
+    if (qspFirstUsedCode)
+        qspFirstUsedCode->PrevUsed = code;
+    else
+        qspLastUsedCode = code;
+    qspFirstUsedCode = code;
+    qspCachedCodeStats.MemoryUsed += code->Size;
+    ++qspCachedCodeStats.BlocksCount;
+    return code;
+}
+
+void qspReleaseCachedCode(QSPCachedCode *code)
+{
+    if (!--code->UseCount)
+    {
+        if (code->CompilationsCount != qspPrepCompilationsCount)
+        {
+            /* Compiled parts of the code got added while it was running, so we measure it again */
+            int size = qspGetCachedCodeSize(code);
+            qspCachedCodeStats.MemoryUsed += size - code->Size;
+            code->Size = size;
+        }
+        if (qspCachedCodeStats.MemoryUsed > qspCachedCodeStats.MemoryLimit)
+            qspTrimCachedCode(0);
+    }
+}
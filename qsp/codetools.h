@@ -6,19 +6,42 @@
  */
 
 #include "declarations.h"
+#include "mathops.h"
 
 #ifndef QSP_CODETOOLSDEFINES
     #define QSP_CODETOOLSDEFINES
 
     #define QSP_EOLEXT QSP_FMT("_")
     #define QSP_PREEOLEXT QSP_FMT(" ")
+    #define QSP_CACHEDCODEBUCKETS 64 /* initial number of buckets, it grows with the number of code blocks */
+    #define QSP_CACHEDCODESIZE (2 * 1024 * 1024) /* default memory budget of the code cache */
 
     typedef struct
     {
         int StartPos;
         int EndPos;
+        QSP_BOOL IsEvaluated;
+        QSPMathExpression *Exp; /* compiled when the argument gets evaluated again, owned by the line of code */
     } QSPCachedArg;
 
+    enum
+    {
+        qspTargetVar, /* variable without index */
+        qspTargetNewItem, /* empty brackets */
+        qspTargetItem, /* index expression in brackets */
+        qspTargetRaw /* the text gets parsed at runtime, so errors get reported as usual */
+    };
+
+    typedef struct
+    {
+        int StartPos;
+        int NameEndPos;
+        int EndPos;
+        int NameId; /* interned name, -1 for incorrect names */
+        QSP_TINYINT Type;
+        QSPCachedArg Index; /* compiled like arguments of statements */
+    } QSPAssignTarget;
+
     typedef struct
     {
         QSP_TINYINT Stat;
@@ -27,8 +50,25 @@
         int EndPos;
         QSP_TINYINT ArgsCount;
         QSPCachedArg *Args;
+        int ElseStat; /* the matching ELSE/ELSEIF of single-line IF/ELSEIF within the line, 0 if there's none */
+        QSP_TINYINT TargetsCount;
+        QSPAssignTarget *Targets; /* pre-parsed variables assigned by SET & LOCAL */
+        QSPString JumpLabel; /* upper-cased target of JUMP specified by a string literal */
+        struct QSPLoopHeader_s *LoopHeader; /* parsed at the first execution of LOOP */
     } QSPCachedStat;
 
+    typedef struct
+    {
+        int LineInd; /* -1 for empty slots */
+        unsigned int Hash;
+    } QSPLabelSlot;
+
+    typedef struct
+    {
+        QSPLabelSlot *Slots; /* open addressing table of labeled lines in ascending order */
+        int Mask; /* number of slots minus 1, the number of slots is a power of 2 */
+    } QSPLabelsIndex;
+
     typedef struct
     {
         QSPString Str;
@@ -39,19 +79,51 @@
         QSPCachedStat *Stats;
         int StatsCount;
         QSP_TINYINT IsMultiline;
+        QSPLabelsIndex *LabelsIndex; /* the first line of a block keeps the index of all labels of the block */
     } QSPLineOfCode;
 
+    typedef struct QSPLoopHeader_s
+    {
+        QSPLineOfCode InitLine; /* refers to the text of the owning line */
+        QSPLineOfCode StepLine; /* refers to the text of the owning line */
+        QSPMathExpression Condition;
+        QSP_TINYINT HasLocals; /* -1 till the body gets checked for LOCAL statements */
+    } QSPLoopHeader;
+
+    typedef struct QSPCachedCode_s
+    {
+        QSPString Text;
+        QSPLineOfCode *Lines; /* arguments of the statements keep their compiled expressions */
+        int LinesCount;
+        unsigned int Hash;
+        int Size; /* estimated memory footprint of the entry */
+        int UseCount; /* number of executions in progress, such entries can't be evicted */
+        unsigned int CompilationsCount; /* qspPrepCompilationsCount when the entry got acquired */
+        struct QSPCachedCode_s *NextInBucket;
+        struct QSPCachedCode_s *PrevUsed; /* more recently used entry */
+        struct QSPCachedCode_s *NextUsed; /* less recently used entry */
+    } QSPCachedCode;
+
+    extern unsigned int qspPrepCompilationsCount;
+
     /* External functions */
+    int qspSearchLabel(QSPLineOfCode *lines, int start, int end, QSPString label);
     QSPString qspGetLineLabel(QSPString str);
     void qspInitLineOfCode(QSPLineOfCode *line, QSPString str, int lineNum);
     void qspFreeLineOfCode(QSPLineOfCode *line);
     void qspFreePrepLines(QSPLineOfCode *strs, int count);
     void qspCopyPrepStatements(QSPCachedStat **dest, QSPCachedStat *src, int start, int end, int codeOffset);
     void qspCopyPrepLines(QSPLineOfCode **dest, QSPLineOfCode *src, int start, int end);
+    QSPVariant qspCalculateArgValue(QSPString s, QSPCachedArg *arg);
     QSPString qspJoinPrepLines(QSPLineOfCode *s, int count, QSPString delim);
     QSP_CHAR *qspDelimPos(QSPString txt, QSP_CHAR ch);
     QSP_CHAR *qspKeywordPos(QSPString txt, QSPString str, QSP_BOOL isIsolated);
     void qspPrepareStringToExecution(QSPString *str);
     int qspPreprocessData(QSPString data, QSPLineOfCode **strs);
+    void qspClearAllCachedCode(QSP_BOOL toInit);
+    QSPCodeCacheStats qspGetCachedCodeStats(void);
+    void qspSetCachedCodeSize(int maxSize);
+    QSPCachedCode *qspGetCachedCode(QSPString codeStr);
+    void qspReleaseCachedCode(QSPCachedCode *code);
 
 #endif
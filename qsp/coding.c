@@ -210,7 +210,7 @@ QSPString qspStringFromFileData(void *data, int dataSize, QSP_BOOL isUCS2)
     QSP_CHAR *ret;
     int curLen, len = (isUCS2 ? dataSize / 2 : dataSize);
     if (!len) return qspNullString;
-    ret = (QSP_CHAR *)malloc(len * sizeof(QSP_CHAR));
+    ret = qspAllocateText(len);
     curLen = len;
     if (isUCS2)
     {
@@ -232,7 +232,7 @@ QSPString qspEncodeString(QSPString str, QSP_BOOL isUCS2)
     QSP_CHAR *origBuf, *buf;
     int curLen, len = qspStrLen(str);
     if (!len) return qspNullString;
-    buf = (QSP_CHAR *)malloc(len * sizeof(QSP_CHAR));
+    buf = qspAllocateText(len);
     origBuf = str.Str;
     curLen = len;
     if (isUCS2)
@@ -269,7 +269,7 @@ QSPString qspDecodeString(QSPString str, QSP_BOOL isUCS2)
     QSP_CHAR *origBuf, *buf;
     int curLen, len = qspStrLen(str);
     if (!len) return qspNullString;
-    buf = (QSP_CHAR *)malloc(len * sizeof(QSP_CHAR));
+    buf = qspAllocateText(len);
     origBuf = str.Str;
     curLen = len;
     if (isUCS2)
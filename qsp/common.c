@@ -8,6 +8,7 @@
 #include "common.h"
 #include "actions.h"
 #include "callbacks.h"
+#include "codetools.h"
 #include "errors.h"
 #include "game.h"
 #include "locations.h"
@@ -62,9 +63,10 @@ void qspInitRuntime(void)
 
     qspSetSeed(0);
     qspInitVarTypes();
+    qspInitVarNames();
     qspInitSymbolClasses();
     qspInitStackAllocator();
-    qspInitVarsScope(&qspGlobalVars, QSP_VARSGLOBALBUCKETS);
+    qspInitVarsScope(&qspGlobalVars, QSP_VARSGLOBALCAPACITY);
     qspPrepareExecution(QSP_TRUE);
     qspMemClear(QSP_TRUE);
     qspInitCallbacks();
@@ -79,8 +81,10 @@ void qspTerminateRuntime(void)
     qspResizeWorld(0);
     qspUpdateLocsNames();
     qspTerminateMath();
+    qspTerminateVarNames(); /* compiled code doesn't refer to interned names anymore */
     qspTerminateStackAllocator();
     qspResetError(QSP_FALSE);
+    qspTerminateTextPools(); /* only unused pools get released */
 }
 
 void qspPrepareExecution(QSP_BOOL toInit)
@@ -115,6 +119,7 @@ void qspMemClear(QSP_BOOL toInit)
     qspClearPlayList(toInit);
     qspClearAllRegExps(toInit);
     qspClearAllMathExps(toInit);
+    qspClearAllCachedCode(toInit);
     if (!toInit)
     {
         if (qspCurDesc.Len > 0)
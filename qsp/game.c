@@ -259,6 +259,7 @@ QSP_BOOL qspOpenGame(void *data, int dataSize, QSP_BOOL isNewGame)
                 {
                     curAct->Image = (isLatestFormat ? qspDecodeString(strs[ind++], isUCS) : qspNullString);
                     curAct->Desc = qspDecodeString(strs[ind++], isUCS);
+                    curAct->DescTemplate = 0;
                     str = qspDecodeString(strs[ind++], isUCS);
                     curAct->OnPressLinesCount = qspPreprocessData(str, &curAct->OnPressLines);
                     qspFreeString(&str);
@@ -289,10 +290,10 @@ QSP_BOOL qspSaveGameStatus(void *buf, int *bufSize, QSP_BOOL isUCS)
     void *gameData;
     QSPString locName;
     QSPBufString bufString;
-    QSPVar *var;
-    QSPVarsBucket *bucket;
+    QSPVar *var, **sortedVars;
+    QSPVariant *curValue, undefValue;
     QSP_BIGINT msecsCount;
-    int i, j, k, dataSize, oldLocationState = qspLocationState;
+    int i, j, k, itemsCount, dataSize, bucketsSizes[QSP_SAVEDGAMEVARSBUCKETS], oldLocationState = qspLocationState;
     /* Call ONGSAVE without local variables */
     qspExecLocByVarNameWithArgs(QSP_STATIC_STR(QSP_LOC_GAMETOBESAVED), 0, 0);
     if (qspLocationState != oldLocationState)
@@ -362,17 +363,44 @@ QSP_BOOL qspSaveGameStatus(void *buf, int *bufSize, QSP_BOOL isUCS)
         qspAppendEncodedIntVal(&bufString, qspCurObjsGroups[i].UpdatedFields, isUCS);
         qspAppendEncodedIntVal(&bufString, qspCurObjsGroups[i].ObjsCount, isUCS);
     }
-    bucket = qspGlobalVars.Buckets; /* use the global scope */
-    for (i = 0; i < QSP_VARSGLOBALBUCKETS; ++i, ++bucket)
+    /* Group global variables by buckets, we keep the order of creation inside of every bucket */
+    for (i = 0; i < QSP_SAVEDGAMEVARSBUCKETS; ++i)
+        bucketsSizes[i] = 0;
+    for (i = 0; i < qspGlobalVars.VarsCount; ++i)
+        ++bucketsSizes[qspGetNameHash(qspGlobalVars.Vars[i]->Name) % QSP_SAVEDGAMEVARSBUCKETS];
+    sortedVars = (QSPVar **)malloc((qspGlobalVars.VarsCount + 1) * sizeof(QSPVar *));
+    k = 0;
+    for (i = 0; i < QSP_SAVEDGAMEVARSBUCKETS; ++i)
+    {
+        j = bucketsSizes[i];
+        bucketsSizes[i] = k; /* the first position of the bucket */
+        k += j;
+    }
+    for (i = 0; i < qspGlobalVars.VarsCount; ++i)
+    {
+        var = qspGlobalVars.Vars[i];
+        sortedVars[bucketsSizes[qspGetNameHash(var->Name) % QSP_SAVEDGAMEVARSBUCKETS]++] = var;
+    }
+    undefValue = qspGetEmptyVariant(QSP_TYPE_UNDEF);
+    j = 0;
+    for (i = 0; i < QSP_SAVEDGAMEVARSBUCKETS; ++i)
     {
-        qspAppendEncodedIntVal(&bufString, bucket->VarsCount, isUCS);
-        var = bucket->Vars;
-        for (j = 0; j < bucket->VarsCount; ++j, ++var)
+        /* bucketsSizes contains the end position of every bucket now */
+        qspAppendEncodedIntVal(&bufString, bucketsSizes[i] - j, isUCS);
+        for (; j < bucketsSizes[i]; ++j)
         {
+            var = sortedVars[j];
             qspAppendEncodedStrVal(&bufString, var->Name, isUCS);
             qspAppendEncodedIntVal(&bufString, var->ValsCount, isUCS);
-            for (k = 0; k < var->ValsCount; ++k)
-                qspAppendEncodedVariant(&bufString, var->Values[k], isUCS);
+            k = 0;
+            while (k < var->ValsCount)
+            {
+                /* Items of sparse arrays that aren't stored are saved as undefined */
+                curValue = qspGetVarItemsRange(var, k, &itemsCount);
+                for (k += itemsCount; itemsCount > 0; --itemsCount)
+                    qspAppendEncodedVariant(&bufString, (curValue ? *curValue++ : undefValue), isUCS);
+            }
+            qspSortVarIndices(var); /* keep the order of indices stable */
             qspAppendEncodedIntVal(&bufString, var->IndsCount, isUCS);
             for (k = 0; k < var->IndsCount; ++k)
             {
@@ -381,6 +409,7 @@ QSP_BOOL qspSaveGameStatus(void *buf, int *bufSize, QSP_BOOL isUCS)
             }
         }
     }
+    free(sortedVars);
     gameData = qspStringToFileData(qspBufStringToString(bufString), isUCS, &dataSize);
     qspFreeBufString(&bufString);
     if (dataSize > *bufSize)
@@ -483,11 +512,11 @@ INLINE QSP_BOOL qspCheckGameStatus(QSPString *strs, int strsCount, QSP_BOOL isUC
         if (!qspGetIntValueAndSkipLine(strs, strsCount, &ind, isUCS, &temp)) return QSP_FALSE;
         if (temp < 0 || temp > QSP_MAXOBJECTS) return QSP_FALSE;
     }
-    for (i = 0; i < QSP_VARSGLOBALBUCKETS; ++i)
+    for (i = 0; i < QSP_SAVEDGAMEVARSBUCKETS; ++i)
     {
         /* variables count */
         if (!qspGetIntValueAndSkipLine(strs, strsCount, &ind, isUCS, &count)) return QSP_FALSE;
-        if (count < 0 || count > QSP_MAXVARSBUCKETSIZE) return QSP_FALSE;
+        if (count < 0) return QSP_FALSE;
         /* variables */
         for (j = 0; j < count; ++j)
         {
@@ -523,8 +552,8 @@ INLINE QSP_BOOL qspCheckGameStatus(QSPString *strs, int strsCount, QSP_BOOL isUC
 QSP_BOOL qspOpenGameStatus(void *data, int dataSize)
 {
     QSPVar *var;
-    QSPVarsBucket *bucket;
-    QSPString *strs, locName, gameString;
+    QSPVariant value;
+    QSPString *strs, varName, locName, gameString;
     QSP_BIGINT msecsCount;
     int i, j, k, ind, count, varsCount, valsCount, oldLocationState;
     QSP_BOOL isUCS = (dataSize >= 2 && *((unsigned char *)data + 1) == 0);
@@ -592,25 +621,27 @@ QSP_BOOL qspOpenGameStatus(void *data, int dataSize)
         qspCurObjsGroups[i].UpdatedFields = (QSP_TINYINT)qspReadEncodedIntVal(strs[ind++], isUCS);
         qspCurObjsGroups[i].ObjsCount = qspReadEncodedIntVal(strs[ind++], isUCS);
     }
-    bucket = qspGlobalVars.Buckets; /* use the global scope */
-    for (i = 0; i < QSP_VARSGLOBALBUCKETS; ++i, ++bucket)
+    for (i = 0; i < QSP_SAVEDGAMEVARSBUCKETS; ++i)
     {
         varsCount = qspReadEncodedIntVal(strs[ind++], isUCS);
         if (varsCount)
         {
-            bucket->Capacity = bucket->VarsCount = varsCount;
-            var = bucket->Vars = (QSPVar *)realloc(bucket->Vars, varsCount * sizeof(QSPVar));
-            for (j = 0; j < varsCount; ++j, ++var)
+            for (j = 0; j < varsCount; ++j)
             {
-                var->Name = qspDecodeString(strs[ind++], isUCS);
+                varName = qspDecodeString(strs[ind++], isUCS);
+                var = qspAddVarToScope(&qspGlobalVars, varName); /* use the global scope */
+                qspFreeString(&varName);
+                qspEmptyVar(var);
                 valsCount = qspReadEncodedIntVal(strs[ind++], isUCS);
-                var->ValsCapacity = var->ValsCount = valsCount;
-                var->Values = 0;
-                if (valsCount)
+                if (valsCount > 0)
                 {
-                    var->Values = (QSPVariant *)malloc(valsCount * sizeof(QSPVariant));
+                    /* The representation of the array gets chosen while we add items */
                     for (k = 0; k < valsCount; ++k)
-                        qspReadEncodedVariant(strs, count, &ind, isUCS, var->Values + k);
+                    {
+                        if (qspReadEncodedVariant(strs, count, &ind, isUCS, &value) && QSP_ISDEF(value.Type))
+                            qspMoveToNewVariant(qspAllocateVarItem(var, k), &value);
+                    }
+                    if (valsCount > var->ValsCount) qspAllocateVarItem(var, valsCount - 1);
                 }
                 valsCount = qspReadEncodedIntVal(strs[ind++], isUCS);
                 var->IndsCapacity = var->IndsCount = valsCount;
@@ -622,7 +653,9 @@ QSP_BOOL qspOpenGameStatus(void *data, int dataSize)
                     {
                         var->Indices[k].Index = qspReadEncodedIntVal(strs[ind++], isUCS);
                         var->Indices[k].Str = qspDecodeString(strs[ind++], isUCS);
+                        var->Indices[k].Hash = qspGetNameHash(var->Indices[k].Str);
                     }
+                    qspBuildVarIndicesTable(var);
                 }
             }
         }
@@ -16,6 +16,7 @@
     #define QSP_MAXINCFILES 100
     #define QSP_DEFTIMERINTERVAL 500
     #define QSP_SAVEDGAMEDATAEXTRASPACE 8192
+    #define QSP_SAVEDGAMEVARSBUCKETS 512 /* saved games keep variables grouped by hashes of their names */
 
     extern int qspQstCRC;
     extern int qspCurIncLocsCount;
@@ -19,23 +19,45 @@ QSPLocation *qspLocs = 0;
 int qspLocsCount = 0;
 QSPLocName *qspLocsNames = 0;
 int qspLocsNamesCount = 0;
+int *qspLocsNamesTable = 0; /* hash table of positions in qspLocsNames, -1 marks empty slots */
+int qspLocsNamesTableMask = 0;
+QSPCachedLocIndex qspCachedLocIndices[QSP_CACHEDLOCINDICES];
 int qspCurLoc = -1;
 int qspLocationState = 0;
 int qspFullRefreshCount = 0;
 int qspCurLocCallDepth = 0;
 
-INLINE int qspLocNamesCompare(const void *locName1, const void *locName2);
-INLINE int qspLocNameCompare(const void *name, const void *compareTo);
+INLINE unsigned int qspGetLocNameHash(QSPString name);
+INLINE QSP_BOOL qspIsLocName(QSPString name, QSPString upperName);
+INLINE void qspFreeTextTemplate(QSPMathExpression *expression);
 INLINE void qspExecLocByIndex(int locInd, QSP_BOOL toChangeDesc);
 
-INLINE int qspLocNamesCompare(const void *locName1, const void *locName2)
+INLINE unsigned int qspGetLocNameHash(QSPString name)
 {
-    return qspStrsCompare(((QSPLocName *)locName1)->Name, ((QSPLocName *)locName2)->Name);
+    /* Names are compared case-insensitively */
+    QSP_CHAR *pos;
+    unsigned int nameHash = 7;
+    for (pos = name.Str; pos < name.End; ++pos)
+        nameHash = nameHash * 31 + (unsigned int)QSP_CHRUPR(*pos);
+    return nameHash;
 }
 
-INLINE int qspLocNameCompare(const void *name, const void *compareTo)
+INLINE QSP_BOOL qspIsLocName(QSPString name, QSPString upperName)
 {
-    return qspStrsCompare(*(QSPString *)name, ((QSPLocName *)compareTo)->Name);
+    QSP_CHAR *pos, *upperPos;
+    if (qspStrLen(name) != qspStrLen(upperName)) return QSP_FALSE;
+    for (pos = name.Str, upperPos = upperName.Str; pos < name.End; ++pos, ++upperPos)
+        if ((QSP_CHAR)QSP_CHRUPR(*pos) != *upperPos) return QSP_FALSE;
+    return QSP_TRUE;
+}
+
+INLINE void qspFreeTextTemplate(QSPMathExpression *expression)
+{
+    if (expression)
+    {
+        qspFreeMathExpression(expression);
+        free(expression);
+    }
 }
 
 void qspResizeWorld(int newLocsCount)
@@ -52,6 +74,7 @@ void qspResizeWorld(int newLocsCount)
         {
             qspFreeString(&curLoc->Name);
             qspFreeString(&curLoc->Desc);
+            qspFreeTextTemplate(curLoc->DescTemplate);
             qspFreePrepLines(curLoc->OnVisitLines, curLoc->OnVisitLinesCount);
             if (curLoc->Actions)
             {
@@ -59,6 +82,7 @@ void qspResizeWorld(int newLocsCount)
                 {
                     qspFreeString(&curAct->Image);
                     qspFreeString(&curAct->Desc);
+                    qspFreeTextTemplate(curAct->DescTemplate);
                     qspFreePrepLines(curAct->OnPressLines, curAct->OnPressLinesCount);
                 }
                 free(curLoc->Actions);
@@ -87,6 +111,7 @@ void qspResizeWorld(int newLocsCount)
         {
             curLoc->Name = qspNullString;
             curLoc->Desc = qspNullString;
+            curLoc->DescTemplate = 0;
             curLoc->OnVisitLines = 0;
             curLoc->OnVisitLinesCount = 0;
             curLoc->Actions = 0;
@@ -97,14 +122,26 @@ void qspResizeWorld(int newLocsCount)
 
 void qspUpdateLocsNames(void)
 {
+    int i;
     /* Clear old location index */
     if (qspLocsNames)
     {
-        int i;
         QSPLocName *curLocName = qspLocsNames;
         for (i = 0; i < qspLocsNamesCount; ++i, ++curLocName)
             qspFreeString(&curLocName->Name);
     }
+    if (qspLocsNamesTable)
+    {
+        free(qspLocsNamesTable);
+        qspLocsNamesTable = 0;
+        qspLocsNamesTableMask = 0;
+    }
+    /* Resolved indices can be wrong now */
+    for (i = 0; i < QSP_CACHEDLOCINDICES; ++i)
+    {
+        qspFreeString(&qspCachedLocIndices[i].Name);
+        qspCachedLocIndices[i].Name = qspNullString;
+    }
     /* Adjust the size of the location index */
     if (qspLocsNamesCount != qspLocsCount)
     {
@@ -120,16 +157,27 @@ void qspUpdateLocsNames(void)
     /* Init new location index */
     if (qspLocsNames)
     {
-        int i;
+        int tableSize, slot;
         QSPLocation *curLoc = qspLocs;
         QSPLocName *curLocName = qspLocsNames;
+        /* Keep the table at most half full */
+        for (tableSize = 16; tableSize < qspLocsNamesCount * 2; tableSize *= 2);
+        qspLocsNamesTable = (int *)malloc(tableSize * sizeof(int));
+        qspLocsNamesTableMask = tableSize - 1;
+        for (i = 0; i < tableSize; ++i)
+            qspLocsNamesTable[i] = -1;
         for (i = 0; i < qspLocsCount; ++i, ++curLoc, ++curLocName)
         {
             curLocName->Index = i;
             curLocName->Name = qspCopyToNewText(curLoc->Name);
             qspUpperStr(&curLocName->Name);
+            curLocName->Hash = qspGetLocNameHash(curLocName->Name);
+            /* Duplicates go after the first location with the same name, so they're never found */
+            slot = curLocName->Hash & qspLocsNamesTableMask;
+            while (qspLocsNamesTable[slot] >= 0)
+                slot = (slot + 1) & qspLocsNamesTableMask;
+            qspLocsNamesTable[slot] = i;
         }
-        qsort(qspLocsNames, qspLocsNamesCount, sizeof(QSPLocName), qspLocNamesCompare);
     }
 }
 
@@ -140,17 +188,37 @@ int qspLocIndex(QSPString name)
         name = qspDelSpc(name);
         if (!qspIsEmpty(name))
         {
+            int pos, slot;
             QSPLocName *loc;
-            name = qspCopyToNewText(name);
-            qspUpperStr(&name);
-            loc = (QSPLocName *)bsearch(&name, qspLocsNames, qspLocsNamesCount, sizeof(QSPLocName), qspLocNameCompare);
-            qspFreeString(&name);
-            if (loc) return loc->Index;
+            unsigned int nameHash = qspGetLocNameHash(name);
+            slot = nameHash & qspLocsNamesTableMask;
+            while ((pos = qspLocsNamesTable[slot]) >= 0)
+            {
+                loc = qspLocsNames + pos;
+                if (loc->Hash == nameHash && qspIsLocName(name, loc->Name)) return loc->Index;
+                slot = (slot + 1) & qspLocsNamesTableMask;
+            }
         }
     }
     return -1;
 }
 
+int qspCachedLocIndex(QSPString name)
+{
+    /* Works with allocated texts only, literal names of compiled code keep their texts */
+    QSPCachedLocIndex *cachedIndex;
+    if (!name.Str) return -1;
+    cachedIndex = qspCachedLocIndices + ((size_t)name.Str / sizeof(int)) % QSP_CACHEDLOCINDICES;
+    if (cachedIndex->Name.Str != name.Str || cachedIndex->Name.End != name.End)
+    {
+        /* The cache keeps the text, so it can't be modified or replaced by another text at the same address */
+        qspFreeString(&cachedIndex->Name);
+        cachedIndex->Name = qspShareText(name);
+        cachedIndex->Index = qspLocIndex(name);
+    }
+    return cachedIndex->Index;
+}
+
 INLINE void qspExecLocByIndex(int locInd, QSP_BOOL toChangeDesc)
 {
     QSPString actionName;
@@ -193,24 +261,24 @@ INLINE void qspExecLocByIndex(int locInd, QSP_BOOL toChangeDesc)
     /* Update base description */
     if (!qspIsEmpty(loc->Desc))
     {
-        QSPString locDesc = qspFormatText(loc->Desc, QSP_TRUE);
+        QSPString locDesc = qspFormatTextTemplate(loc->Desc, &loc->DescTemplate);
         if (qspLocationState != oldLocationState) return;
         if (qspAddBufText(&qspCurDesc, locDesc))
             qspCurWindowsChangedState |= QSP_WIN_MAIN;
-        qspFreeNewString(&locDesc, &loc->Desc);
+        qspFreeString(&locDesc);
     }
     /* Update base actions */
     for (i = 0, curAct = loc->Actions; i < loc->ActionsCount; ++i, ++curAct)
     {
         if (qspIsEmpty(curAct->Desc)) break;
         qspRealActIndex = i;
-        actionName = qspFormatText(curAct->Desc, QSP_TRUE);
+        actionName = qspFormatTextTemplate(curAct->Desc, &curAct->DescTemplate);
         if (qspLocationState != oldLocationState) return;
         if (!qspIsEmpty(curAct->Image))
             qspAddAction(actionName, curAct->Image, curAct->OnPressLines, 0, curAct->OnPressLinesCount);
         else
             qspAddAction(actionName, qspNullString, curAct->OnPressLines, 0, curAct->OnPressLinesCount);
-        qspFreeNewString(&actionName, &curAct->Desc);
+        qspFreeString(&actionName);
         if (qspLocationState != oldLocationState) return;
     }
     /* Execute the code */
@@ -236,9 +304,9 @@ INLINE void qspExecLocByIndex(int locInd, QSP_BOOL toChangeDesc)
     --qspCurLocCallDepth;
 }
 
-void qspExecLocByNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT argsCount, QSP_BOOL toMoveArgs, QSPVariant *res)
+void qspExecLocByIndexWithArgs(int locInd, QSPVariant *args, QSP_TINYINT argsCount, QSP_BOOL toMoveArgs, QSPVariant *res)
 {
-    int oldLocationState, locInd = qspLocIndex(name);
+    int oldLocationState;
     if (locInd < 0)
     {
         qspSetError(QSP_ERR_LOCNOTFOUND);
@@ -254,9 +322,15 @@ void qspExecLocByNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT args
     qspReleaseLastLocalScope();
 }
 
+void qspExecLocByNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT argsCount, QSP_BOOL toMoveArgs, QSPVariant *res)
+{
+    qspExecLocByIndexWithArgs(qspLocIndex(name), args, argsCount, toMoveArgs, res);
+}
+
 void qspExecLocByVarNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT argsCount)
 {
     QSPVar *var;
+    QSPVariant *curValue;
     QSPString locName;
     QSPVarsScopeChunk *savedLocalVars;
     int ind, oldLocationState;
@@ -273,11 +347,11 @@ void qspExecLocByVarNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT a
             qspClearLocalVarsScopes(savedLocalVars);
             return;
         }
-        if (ind >= var->ValsCount) break;
-        if (!QSP_ISSTR(var->Values[ind].Type)) break;
-        locName = QSP_STR(var->Values[ind]);
+        if (!((curValue = qspGetVarItem(var, ind)))) break;
+        if (!QSP_ISSTR(curValue->Type)) break;
+        locName = QSP_PSTR(curValue);
         if (!qspIsAnyString(locName)) break;
-        qspExecLocByNameWithArgs(locName, args, argsCount, QSP_FALSE, 0);
+        qspExecLocByIndexWithArgs(qspCachedLocIndex(locName), args, argsCount, QSP_FALSE, 0);
         if (qspLocationState != oldLocationState)
         {
             qspClearLocalVarsScopes(savedLocalVars);
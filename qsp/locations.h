@@ -12,11 +12,13 @@
     #define QSP_LOCSDEFINES
 
     #define QSP_MAXLOCCALLDEPTH 2000
+    #define QSP_CACHEDLOCINDICES 64 /* indices of locations resolved from string values */
 
     typedef struct
     {
         QSPString Image;
         QSPString Desc;
+        QSPMathExpression *DescTemplate; /* compiled on the first use */
         QSPLineOfCode *OnPressLines;
         int OnPressLinesCount;
     } QSPLocAct;
@@ -26,6 +28,7 @@
         QSPString Name;
         /* Base description */
         QSPString Desc;
+        QSPMathExpression *DescTemplate; /* compiled on the first use */
         /* Location code */
         QSPLineOfCode *OnVisitLines;
         int OnVisitLinesCount;
@@ -37,9 +40,16 @@
     typedef struct
     {
         int Index;
-        QSPString Name;
+        QSPString Name; /* upper-cased */
+        unsigned int Hash;
     } QSPLocName;
 
+    typedef struct
+    {
+        QSPString Name; /* shared text of the value, the same text always means the same name */
+        int Index;
+    } QSPCachedLocIndex;
+
     extern QSPLocation *qspLocs;
     extern int qspLocsCount;
     extern QSPLocName *qspLocsNames;
@@ -53,6 +63,8 @@
     void qspResizeWorld(int newLocsCount);
     void qspUpdateLocsNames(void);
     int qspLocIndex(QSPString name);
+    int qspCachedLocIndex(QSPString name);
+    void qspExecLocByIndexWithArgs(int locInd, QSPVariant *args, QSP_TINYINT argsCount, QSP_BOOL toMoveArgs, QSPVariant *res);
     void qspExecLocByNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT argsCount, QSP_BOOL toMoveArgs, QSPVariant *res);
     void qspExecLocByVarNameWithArgs(QSPString name, QSPVariant *args, QSP_TINYINT argsCount);
     void qspNavigateToLocation(int locInd, QSP_BOOL toChangeDesc, QSPVariant *args, QSP_TINYINT argsCount);
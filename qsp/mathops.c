@@ -26,7 +26,13 @@ QSPMathOperation qspOps[qspOpLast_Operation];
 QSPMathOpName qspOpsNames[QSP_MATHOPSLEVELS][QSP_MAXMATHOPSNAMES];
 int qspOpsNamesCounts[QSP_MATHOPSLEVELS];
 int qspOpMaxLen = 0;
-QSPCachedMathExpsBucket qspCachedMathExps[QSP_CACHEDEXPSBUCKETS];
+QSPCachedMathExp **qspCachedMathExps = 0;
+int qspCachedMathExpsBucketsCount = 0;
+QSPCachedMathExp *qspFirstUsedMathExp = 0; /* the most recently used expression */
+QSPCachedMathExp *qspLastUsedMathExp = 0; /* the least recently used expression */
+QSPExpCacheStats qspCachedMathExpsStats;
+clock_t qspMathExpsCompileTime = 0;
+int qspMathFoldedOpsCount = 0; /* number of compiled items removed by constant folding */
 
 INLINE void qspAddOperation(QSP_TINYINT opCode, QSP_TINYINT priority, QSP_FUNCTION func, QSP_TINYINT resType, QSP_TINYINT minArgs, QSP_TINYINT maxArgs, ...);
 INLINE void qspAddSingleOpName(QSP_TINYINT opCode, QSPString opName, QSP_TINYINT type, int level);
@@ -34,7 +40,10 @@ INLINE void qspAddOpName(QSP_TINYINT opCode, QSP_CHAR *opName, int level, QSP_BO
 INLINE int qspMathOpsCompare(const void *opName1, const void *opName2);
 INLINE int qspMathOpStringFullCompare(const void *name, const void *compareTo);
 INLINE int qspMathOpStringCompare(const void *name, const void *compareTo);
-INLINE QSPMathExpression *qspMathExpGetCompiled(QSPString expStr);
+INLINE void qspResizeMathExpsBuckets(int bucketsCount);
+INLINE void qspFreeCachedMathExp(QSPCachedMathExp *exp);
+INLINE void qspTrimMathExps(int sizeToAdd);
+INLINE QSPCachedMathExp *qspMathExpGetCompiled(QSPString expStr);
 INLINE QSP_TINYINT qspFunctionOpCode(QSPString funName);
 INLINE QSP_BIGINT qspGetNumber(QSPString *expr);
 INLINE QSPString qspGetName(QSPString *expr);
@@ -44,9 +53,20 @@ INLINE QSPString qspGetCodeBlock(QSPString *expr);
 INLINE QSP_BOOL qspPushOperationToStack(QSP_TINYINT *opStack, QSP_TINYINT *argStack, int *opSp, QSP_TINYINT opCode);
 INLINE QSP_BOOL qspAppendValueToCompiled(QSPMathExpression* expression, QSP_TINYINT opCode, QSPVariant v);
 INLINE QSP_BOOL qspAppendOperationToCompiled(QSPMathExpression* expression, QSP_TINYINT opCode, QSP_TINYINT argsCount);
+INLINE QSP_BOOL qspAppendTemplateToCompiled(QSPMathExpression *expression, QSPString txt);
 INLINE int qspSkipMathValue(QSPMathExpression *expression, int valueIndex);
-INLINE QSPVariant qspCalculateArgumentValue(QSPMathExpression *expression, int valueIndex, QSP_TINYINT type);
+INLINE void qspLinkCompiledArgs(QSPMathExpression *expression, int opIndex);
+INLINE QSP_BOOL qspIsConstantValue(QSPMathCompiledOp *item);
+INLINE QSP_BOOL qspIsPureOperation(QSP_TINYINT opCode, QSP_TINYINT argsCount);
+INLINE void qspReplaceCompiledItems(QSPMathExpression *expression, int firstIndex, int keptIndex, int keptCount);
+INLINE QSP_BOOL qspFoldCompiledOperation(QSPMathExpression *expression, int opIndex);
+INLINE QSP_TINYINT qspGetCompiledArgBaseType(QSPMathCompiledOp *item);
+INLINE void qspSpecializeCompiledOperation(QSPMathExpression *expression, int opIndex);
+INLINE void qspFlattenCompiledOperation(QSPMathExpression *expression, int opIndex);
+INLINE void qspReleaseCompiledItems(QSPMathCompiledOp *item, int count);
 INLINE void qspNegateValue(QSPVariant *val, QSPVariant *res);
+INLINE QSPString qspJoinTextValues(QSPVariant *args, QSP_TINYINT count);
+INLINE void qspAppendValues(QSPVariant *args, QSP_TINYINT count, QSPVariant *res);
 INLINE void qspFunctionLen(QSPVariant *args, QSP_TINYINT count, QSPVariant *res);
 INLINE void qspFunctionIsNum(QSPVariant *args, QSP_TINYINT count, QSPVariant *res);
 INLINE void qspFunctionStrComp(QSPVariant *args, QSP_TINYINT count, QSPVariant *res);
@@ -167,70 +187,168 @@ INLINE int qspMathOpStringCompare(const void *name, const void *compareTo)
 
 void qspClearAllMathExps(QSP_BOOL toInit)
 {
-    int i, j;
-    QSPCachedMathExp *exp;
-    QSPCachedMathExpsBucket *bucket = qspCachedMathExps;
-    for (i = 0; i < QSP_CACHEDEXPSBUCKETS; ++i, ++bucket)
+    if (toInit)
     {
-        if (!toInit && bucket->ExpsCount)
+        qspCachedMathExps = 0;
+        qspCachedMathExpsBucketsCount = 0;
+        qspFirstUsedMathExp = qspLastUsedMathExp = 0;
+        qspCachedMathExpsStats.ExpsCount = 0;
+        qspCachedMathExpsStats.MemoryUsed = 0;
+        qspCachedMathExpsStats.MemoryLimit = QSP_CACHEDEXPSSIZE;
+        qspCachedMathExpsStats.HitsCount = 0;
+        qspCachedMathExpsStats.MissesCount = 0;
+        qspCachedMathExpsStats.EvictionsCount = 0;
+        qspMathExpsCompileTime = 0;
+        qspMathFoldedOpsCount = 0;
+    }
+    else
+    {
+        /* Expressions that are being evaluated are kept */
+        QSPCachedMathExp *prevExp, *exp = qspLastUsedMathExp;
+        while (exp)
         {
-            exp = bucket->Exps;
-            for (j = bucket->ExpsCount; j > 0; --j)
-            {
-                qspFreeString(&exp->Text);
-                qspFreeMathExpression(&exp->CompiledExp);
-                ++exp;
-            }
+            prevExp = exp->PrevUsed;
+            if (!exp->UseCount) qspFreeCachedMathExp(exp);
+            exp = prevExp;
+        }
+        if (!qspFirstUsedMathExp && qspCachedMathExps)
+        {
+            free(qspCachedMathExps);
+            qspCachedMathExps = 0;
+            qspCachedMathExpsBucketsCount = 0;
         }
-        bucket->ExpsCount = 0;
-        bucket->ExpToEvict = 0;
     }
 }
 
-INLINE QSPMathExpression *qspMathExpGetCompiled(QSPString expStr)
+QSPExpCacheStats qspGetMathExpsStats(void)
 {
-    QSPMathExpression compiledExp;
-    QSPCachedMathExp *exp;
-    QSPCachedMathExpsBucket *bucket;
-    QSP_CHAR *pos;
-    int i, expsCount;
-    unsigned int bCode = 7;
-    /* Find a correct bucket by hash value */
-    for (pos = expStr.Str; pos < expStr.End; ++pos)
-        bCode = bCode * 31 + (unsigned char)*pos;
-    bucket = qspCachedMathExps + bCode % QSP_CACHEDEXPSBUCKETS;
-    /* Search for existing item in the bucket */
-    exp = bucket->Exps;
-    expsCount = bucket->ExpsCount;
-    for (i = expsCount; i > 0; --i)
+    QSPExpCacheStats stats = qspCachedMathExpsStats;
+    stats.CompileTime = (int)(qspMathExpsCompileTime * 1000 / CLOCKS_PER_SEC);
+    stats.FoldedOpsCount = qspMathFoldedOpsCount;
+    return stats;
+}
+
+void qspSetMathExpsCacheSize(int maxSize)
+{
+    qspCachedMathExpsStats.MemoryLimit = (maxSize > 0 ? maxSize : 0);
+    qspTrimMathExps(0);
+}
+
+INLINE void qspResizeMathExpsBuckets(int bucketsCount)
+{
+    int i;
+    QSPCachedMathExp *exp, **bucket;
+    if (qspCachedMathExps) free(qspCachedMathExps);
+    qspCachedMathExps = (QSPCachedMathExp **)malloc(bucketsCount * sizeof(QSPCachedMathExp *));
+    qspCachedMathExpsBucketsCount = bucketsCount;
+    for (i = 0; i < bucketsCount; ++i)
+        qspCachedMathExps[i] = 0;
+    /* Every entry is in the list of used expressions */
+    for (exp = qspFirstUsedMathExp; exp; exp = exp->NextUsed)
     {
-        if (qspStrsEqual(exp->Text, expStr)) return &exp->CompiledExp;
-        ++exp;
+        bucket = qspCachedMathExps + exp->Hash % bucketsCount;
+        exp->NextInBucket = *bucket;
+        *bucket = exp;
     }
-    /* Compile the new expression */
-    if (!qspCompileMathExpression(expStr, &compiledExp)) return 0;
-    if (expsCount < QSP_MAXCACHEDEXPSBUCKETSIZE)
+}
+
+INLINE void qspFreeCachedMathExp(QSPCachedMathExp *exp)
+{
+    QSPCachedMathExp **link = qspCachedMathExps + exp->Hash % qspCachedMathExpsBucketsCount;
+    while (*link != exp) link = &(*link)->NextInBucket;
+    *link = exp->NextInBucket;
+    if (exp->PrevUsed)
+        exp->PrevUsed->NextUsed = exp->NextUsed;
+    else
+        qspFirstUsedMathExp = exp->NextUsed;
+    if (exp->NextUsed)
+        exp->NextUsed->PrevUsed = exp->PrevUsed;
+    else
+        qspLastUsedMathExp = exp->PrevUsed;
+    qspCachedMathExpsStats.MemoryUsed -= exp->Size;
+    --qspCachedMathExpsStats.ExpsCount;
+    qspFreeString(&exp->Text);
+    qspFreeMathExpression(&exp->CompiledExp);
+    free(exp);
+}
+
+INLINE void qspTrimMathExps(int sizeToAdd)
+{
+    /* Evict the least recently used expressions until we fit the budget */
+    QSPCachedMathExp *prevExp, *exp = qspLastUsedMathExp;
+    while (exp && qspCachedMathExpsStats.MemoryUsed + sizeToAdd > qspCachedMathExpsStats.MemoryLimit)
     {
-        /* Add a new entry */
-        exp = bucket->Exps + expsCount;
-        exp->Text = qspCopyToNewText(expStr);
-        exp->CompiledExp = compiledExp;
-        bucket->ExpsCount++;
-        return &exp->CompiledExp;
+        prevExp = exp->PrevUsed;
+        if (!exp->UseCount)
+        {
+            qspFreeCachedMathExp(exp);
+            ++qspCachedMathExpsStats.EvictionsCount;
+        }
+        exp = prevExp;
     }
-    else
+}
+
+INLINE QSPCachedMathExp *qspMathExpGetCompiled(QSPString expStr)
+{
+    QSPMathExpression compiledExp;
+    QSPCachedMathExp *exp, **bucket;
+    clock_t startTime;
+    QSP_BOOL isCompiled;
+    unsigned int hash = qspStrHash(expStr);
+    /* Search for existing item */
+    if (qspCachedMathExps)
     {
-        /* Clear the old expression */
-        exp = bucket->Exps + bucket->ExpToEvict;
-        qspFreeString(&exp->Text);
-        qspFreeMathExpression(&exp->CompiledExp);
-        /* Replace it with the new one */
-        exp->Text = qspCopyToNewText(expStr);
-        exp->CompiledExp = compiledExp;
-        /* Update the next item to be evicted */
-        bucket->ExpToEvict = (bucket->ExpToEvict + 1) % QSP_MAXCACHEDEXPSBUCKETSIZE;
-        return &exp->CompiledExp;
+        for (exp = qspCachedMathExps[hash % qspCachedMathExpsBucketsCount]; exp; exp = exp->NextInBucket)
+        {
+            if (exp->Hash == hash && qspStrsEqual(exp->Text, expStr))
+            {
+                ++qspCachedMathExpsStats.HitsCount;
+                if (exp->PrevUsed)
+                {
+                    /* Move it to the beginning of the list */
+                    exp->PrevUsed->NextUsed = exp->NextUsed;
+                    if (exp->NextUsed)
+                        exp->NextUsed->PrevUsed = exp->PrevUsed;
+                    else
+                        qspLastUsedMathExp = exp->PrevUsed;
+                    exp->PrevUsed = 0;
+                    exp->NextUsed = qspFirstUsedMathExp;
+                    qspFirstUsedMathExp->PrevUsed = exp;
+                    qspFirstUsedMathExp = exp;
+                }
+                return exp;
+            }
+        }
     }
+    /* Compile the new expression */
+    ++qspCachedMathExpsStats.MissesCount;
+    startTime = clock();
+    isCompiled = qspCompileMathExpression(expStr, &compiledExp);
+    qspMathExpsCompileTime += clock() - startTime;
+    if (!isCompiled) return 0;
+    exp = (QSPCachedMathExp *)malloc(sizeof(QSPCachedMathExp));
+    exp->Text = qspCopyToNewText(expStr);
+    exp->CompiledExp = compiledExp;
+    exp->Hash = hash;
+    exp->Size = (int)(sizeof(QSPCachedMathExp) + qspStrLen(expStr) * sizeof(QSP_CHAR) + compiledExp.Capacity * sizeof(QSPMathCompiledOp));
+    exp->UseCount = 0;
+    /* Make room for the new entry */
+    qspTrimMathExps(exp->Size);
+    if (qspCachedMathExpsStats.ExpsCount >= qspCachedMathExpsBucketsCount)
+        qspResizeMathExpsBuckets(qspCachedMathExpsBucketsCount ? qspCachedMathExpsBucketsCount * 2 : QSP_CACHEDEXPSBUCKETS);
+    bucket = qspCachedMathExps + hash % qspCachedMathExpsBucketsCount;
+    exp->NextInBucket = *bucket;
+    *bucket = exp;
+    exp->PrevUsed = 0;
+    exp->NextUsed = qspFirstUsedMathExp;
+    if (qspFirstUsedMathExp)
+        qspFirstUsedMathExp->PrevUsed = exp;
+    else
+        qspLastUsedMathExp = exp;
+    qspFirstUsedMathExp = exp;
+    qspCachedMathExpsStats.MemoryUsed += exp->Size;
+    ++qspCachedMathExpsStats.ExpsCount;
+    return exp;
 }
 
 void qspInitMath(void)
@@ -259,9 +377,13 @@ void qspInitMath(void)
     qspAddOperation(qspOpTuple, 127, 0, QSP_TYPE_TUPLE, 0, QSP_MAXMATHOPARGS, QSP_TYPE_UNDEF, QSP_TYPE_TERM);
     qspAddOperation(qspOpValue, 0, 0, QSP_TYPE_UNDEF, 0, 0);
     qspAddOperation(qspOpValueToFormat, 0, 0, QSP_TYPE_UNDEF, 0, 0);
+    qspAddOperation(qspOpJumpIfFalse, 0, 0, QSP_TYPE_BOOL, 1, 1, QSP_TYPE_BOOL);
+    qspAddOperation(qspOpJumpIfTrue, 0, 0, QSP_TYPE_BOOL, 1, 1, QSP_TYPE_BOOL);
+    qspAddOperation(qspOpPopJumpIfFalse, 0, 0, QSP_TYPE_UNDEF, 1, 1, QSP_TYPE_BOOL);
+    qspAddOperation(qspOpJump, 0, 0, QSP_TYPE_UNDEF, 1, 1, QSP_TYPE_UNDEF);
 
     qspAddOperation(qspOpNegation, 18, 0, QSP_TYPE_UNDEF, 1, 1, QSP_TYPE_UNDEF);
-    qspAddOperation(qspOpAppend, 12, 0, QSP_TYPE_UNDEF, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
+    qspAddOperation(qspOpAppend, 12, 0, QSP_TYPE_UNDEF, 2, QSP_MAXMATHOPARGS, QSP_TYPE_UNDEF, QSP_TYPE_TERM); /* chains get joined */
     qspAddOperation(qspOpAdd, 14, 0, QSP_TYPE_UNDEF, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
     qspAddOperation(qspOpSub, 14, 0, QSP_TYPE_UNDEF, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
     qspAddOperation(qspOpMul, 17, 0, QSP_TYPE_UNDEF, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
@@ -277,6 +399,24 @@ void qspInitMath(void)
     qspAddOperation(qspOpEq, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
     qspAddOperation(qspOpLt, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
     qspAddOperation(qspOpGt, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
+    qspAddOperation(qspOpAddNums, 14, 0, QSP_TYPE_NUM, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpSubNums, 14, 0, QSP_TYPE_NUM, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpMulNums, 17, 0, QSP_TYPE_NUM, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpDivNums, 17, 0, QSP_TYPE_NUM, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpNeNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpLeqNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpGeqNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpEqNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpLtNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpGtNums, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_NUM, QSP_TYPE_NUM);
+    qspAddOperation(qspOpConcatStrs, 12, 0, QSP_TYPE_STR, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpNeStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpLeqStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpGeqStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpEqStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpLtStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpGtStrs, 10, 0, QSP_TYPE_BOOL, 2, 2, QSP_TYPE_STR, QSP_TYPE_STR);
+    qspAddOperation(qspOpJoinStrs, 0, 0, QSP_TYPE_STR, 1, QSP_MAXMATHOPARGS, QSP_TYPE_STR, QSP_TYPE_TERM);
     qspAddOperation(qspOpIIf, 30, 0, QSP_TYPE_UNDEF, 3, 3, QSP_TYPE_BOOL, QSP_TYPE_UNDEF, QSP_TYPE_UNDEF);
 
     qspAddOperation(qspOpMin, 30, qspFunctionMin, QSP_TYPE_UNDEF, 1, QSP_MAXMATHOPARGS, QSP_TYPE_UNDEF, QSP_TYPE_TERM);
@@ -549,7 +689,11 @@ INLINE QSP_BOOL qspAppendValueToCompiled(QSPMathExpression* expression, QSP_TINY
     compiledOp = expression->CompItems + opIndex;
     compiledOp->OpCode = opCode;
     compiledOp->ArgsCount = 0;
+    compiledOp->ArgType = QSP_TYPE_UNDEF;
+    compiledOp->ValueType = (v.Type == QSP_TYPE_VARREF ? QSP_TYPE_UNDEF : v.Type);
     compiledOp->Value = v;
+    compiledOp->VarNameId = (v.Type == QSP_TYPE_VARREF ? qspGetVarNameId(QSP_STR(v)) : -1);
+    compiledOp->JumpOffset = 0;
     ++expression->ItemsCount;
     return QSP_TRUE;
 }
@@ -572,7 +716,102 @@ INLINE QSP_BOOL qspAppendOperationToCompiled(QSPMathExpression *expression, QSP_
     compiledOp = expression->CompItems + opIndex;
     compiledOp->OpCode = opCode;
     compiledOp->ArgsCount = argsCount;
+    compiledOp->ArgType = QSP_TYPE_UNDEF;
+    compiledOp->ValueType = qspOps[opCode].ResType;
+    compiledOp->VarNameId = -1;
+    compiledOp->JumpOffset = 0;
     ++expression->ItemsCount;
+    qspLinkCompiledArgs(expression, opIndex);
+    if (!qspFoldCompiledOperation(expression, opIndex))
+    {
+        qspSpecializeCompiledOperation(expression, opIndex);
+        qspFlattenCompiledOperation(expression, opIndex);
+    }
+    return QSP_TRUE;
+}
+
+INLINE QSP_BOOL qspAppendTemplateToCompiled(QSPMathExpression *expression, QSPString txt)
+{
+    /* The expression takes ownership of the text */
+    QSPVariant v;
+    QSPString exprStr, rest = txt;
+    QSPMathExpression subExpression;
+    QSP_CHAR *pos = qspStrStr(txt, QSP_STATIC_STR(QSP_LSUBEX));
+    QSP_TINYINT opCode = qspOpValue, partsCount = 0;
+    QSP_BOOL isCompiled = QSP_TRUE;
+    int itemsCount, firstIndex = expression->ItemsCount, oldLocationState = qspLocationState;
+    if (pos)
+    {
+        opCode = qspOpValueToFormat;
+        do
+        {
+            if (pos > rest.Str)
+            {
+                if (partsCount >= QSP_MAXMATHOPARGS - 1 ||
+                    !qspAppendValueToCompiled(expression, qspOpValue, qspStrVariant(qspCopyToNewText(qspStringFromPair(rest.Str, pos)), QSP_TYPE_STR)))
+                {
+                    isCompiled = QSP_FALSE;
+                    break;
+                }
+                ++partsCount;
+            }
+            rest.Str = pos + QSP_STATIC_LEN(QSP_LSUBEX);
+            pos = qspKeywordPos(rest, QSP_STATIC_STR(QSP_RSUBEX), QSP_FALSE);
+            if (!pos)
+            {
+                isCompiled = QSP_FALSE;
+                break;
+            }
+            exprStr = qspCopyToNewText(qspStringFromPair(rest.Str, pos));
+            qspPrepareStringToExecution(&exprStr);
+            isCompiled = qspCompileMathExpression(exprStr, &subExpression);
+            qspFreeString(&exprStr);
+            if (!isCompiled) break;
+            /* Jumps are relative, so we can move the items of the subexpression as is */
+            itemsCount = expression->ItemsCount + subExpression.ItemsCount;
+            if (partsCount >= QSP_MAXMATHOPARGS - 1 || itemsCount >= QSP_MAXMATHITEMS)
+            {
+                qspFreeMathExpression(&subExpression);
+                isCompiled = QSP_FALSE;
+                break;
+            }
+            if (itemsCount >= expression->Capacity)
+            {
+                expression->Capacity = itemsCount + 16;
+                expression->CompItems = (QSPMathCompiledOp *)realloc(expression->CompItems, expression->Capacity * sizeof(QSPMathCompiledOp));
+            }
+            memcpy(expression->CompItems + expression->ItemsCount, subExpression.CompItems, subExpression.ItemsCount * sizeof(QSPMathCompiledOp));
+            expression->ItemsCount = itemsCount;
+            free(subExpression.CompItems);
+            ++partsCount;
+            rest.Str = pos + QSP_STATIC_LEN(QSP_RSUBEX);
+            pos = qspStrStr(rest, QSP_STATIC_STR(QSP_LSUBEX));
+        } while (pos);
+        if (isCompiled && !qspIsEmpty(rest))
+        {
+            isCompiled = qspAppendValueToCompiled(expression, qspOpValue, qspStrVariant(qspCopyToNewText(rest), QSP_TYPE_STR));
+            if (isCompiled) ++partsCount;
+        }
+        if (isCompiled && qspAppendOperationToCompiled(expression, qspOpJoinStrs, partsCount))
+        {
+            qspFreeString(&txt);
+            return QSP_TRUE;
+        }
+        /* Keep the whole text to report errors at runtime */
+        qspReleaseCompiledItems(expression->CompItems + firstIndex, expression->ItemsCount - firstIndex);
+        expression->ItemsCount = firstIndex;
+        if (qspLocationState != oldLocationState)
+        {
+            qspLocationState = oldLocationState;
+            qspResetError(QSP_FALSE);
+        }
+    }
+    v = qspStrVariant(txt, QSP_TYPE_STR);
+    if (!qspAppendValueToCompiled(expression, opCode, v))
+    {
+        qspFreeVariant(&v);
+        return QSP_FALSE;
+    }
     return QSP_TRUE;
 }
 
@@ -675,6 +914,12 @@ QSP_BOOL qspCompileMathExpression(QSPString s, QSPMathExpression *expression)
                         qspSetError(QSP_ERR_ARGSCOUNT);
                         break;
                     }
+                    if (opStack[opSp - 1] == qspOpIIf)
+                    {
+                        /* Only one of the values gets evaluated */
+                        opCode = (argStack[opSp - 1] == 1 ? qspOpPopJumpIfFalse : qspOpJump);
+                        if (!qspAppendOperationToCompiled(expression, opCode, 1)) break;
+                    }
                 }
                 else
                 {
@@ -691,6 +936,15 @@ QSP_BOOL qspCompileMathExpression(QSPString s, QSPMathExpression *expression)
                 waitForOperator = QSP_FALSE;
                 break;
             default:
+                /* The first argument is ready, so we can skip the second one */
+                if (opCode == qspOpAnd)
+                {
+                    if (!qspAppendOperationToCompiled(expression, qspOpJumpIfFalse, 1)) break;
+                }
+                else if (opCode == qspOpOr)
+                {
+                    if (!qspAppendOperationToCompiled(expression, qspOpJumpIfTrue, 1)) break;
+                }
                 if (!qspPushOperationToStack(opStack, argStack, &opSp, opCode)) break;
                 waitForOperator = QSP_FALSE;
                 break;
@@ -722,14 +976,8 @@ QSP_BOOL qspCompileMathExpression(QSPString s, QSPMathExpression *expression)
             {
                 name = qspGetString(&s);
                 if (qspErrorNum) break;
-                v = qspStrVariant(name, QSP_TYPE_STR);
-                /* Format strings if they contain subexpressions */
-                opCode = qspStrStr(name, QSP_STATIC_STR(QSP_LSUBEX)) ? qspOpValueToFormat : qspOpValue;
-                if (!qspAppendValueToCompiled(expression, opCode, v))
-                {
-                    qspFreeVariant(&v);
-                    break;
-                }
+                /* Strings with subexpressions get split into parts */
+                if (!qspAppendTemplateToCompiled(expression, name)) break;
                 waitForOperator = QSP_TRUE;
             }
             else if (*s.Str == QSP_LCODE_CHAR)
@@ -923,11 +1171,314 @@ INLINE int qspSkipMathValue(QSPMathExpression *expression, int valueIndex)
     return valueIndex;
 }
 
-void qspFreeMathExpression(QSPMathExpression *expression)
+INLINE void qspLinkCompiledArgs(QSPMathExpression *expression, int opIndex)
+{
+    QSP_TINYINT argType;
+    int i, argIndex, argIndices[QSP_MAXMATHOPARGS];
+    QSPMathCompiledOp *expItems = expression->CompItems, *op = expItems + opIndex;
+    /* Find positions of the arguments */
+    argIndex = opIndex - 1; /* move to the last argument */
+    for (i = op->ArgsCount - 1; i >= 0; --i)
+    {
+        argIndices[i] = argIndex;
+        /* Arguments get converted right after they are calculated, values of the expected type are kept as is */
+        argType = qspOps[op->OpCode].ArgsTypes[i];
+        expItems[argIndex].ArgType = (argType == expItems[argIndex].ValueType ? QSP_TYPE_UNDEF : argType);
+        argIndex = qspSkipMathValue(expression, argIndex);
+    }
+    switch (op->OpCode)
+    {
+    case qspOpAnd:
+    case qspOpOr:
+        /* The first argument ends with a jump to the operation */
+        expItems[argIndices[0]].JumpOffset = opIndex - argIndices[0];
+        break;
+    case qspOpIIf:
+        /* The condition jumps to the third argument, the second argument jumps to the operation */
+        expItems[argIndices[0]].JumpOffset = argIndices[1] + 1 - argIndices[0];
+        expItems[argIndices[1]].JumpOffset = opIndex - argIndices[1];
+        break;
+    case qspOpArrItem:
+    case qspOpFirstArrItem:
+    case qspOpLastArrItem:
+        /* The name of the variable doesn't get evaluated, it also defines the type of the value */
+        op->Value = expItems[argIndices[0]].Value;
+        op->VarNameId = expItems[argIndices[0]].VarNameId;
+        op->ValueType = qspGetVarType(QSP_STR(op->Value));
+        break;
+    }
+}
+
+INLINE QSP_BOOL qspIsConstantValue(QSPMathCompiledOp *item)
+{
+    return (item->OpCode == qspOpValue && item->Value.Type != QSP_TYPE_VARREF);
+}
+
+INLINE QSP_BOOL qspIsPureOperation(QSP_TINYINT opCode, QSP_TINYINT argsCount)
 {
+    /* Results of these operations depend on their arguments only */
+    switch (opCode)
+    {
+    case qspOpTuple:
+    case qspOpNegation:
+    case qspOpAppend:
+    case qspOpAdd:
+    case qspOpSub:
+    case qspOpMul:
+    case qspOpDiv:
+    case qspOpMod:
+    case qspOpAnd:
+    case qspOpOr:
+    case qspOpNot:
+    case qspOpNe:
+    case qspOpLeq:
+    case qspOpGeq:
+    case qspOpEq:
+    case qspOpLt:
+    case qspOpGt:
+    case qspOpIIf:
+    case qspOpStr:
+    case qspOpVal:
+    case qspOpIsNum:
+    case qspOpLen:
+    case qspOpLCase:
+    case qspOpUCase:
+    case qspOpTrim:
+    case qspOpMid:
+    case qspOpInstr:
+    case qspOpReplace:
+    case qspOpStrComp:
+    case qspOpStrFind:
+    case qspOpStrPos:
+    case qspOpRGB:
+    case qspOpJoinStrs:
+        return QSP_TRUE;
+    case qspOpMin:
+    case qspOpMax:
+        return (argsCount > 1); /* a single argument is the name of an array */
+    }
+    /* RAND, RND, MSECSCOUNT, INPUT, FUNC, DYNEVAL & everything that reads the game state */
+    return QSP_FALSE;
+}
+
+INLINE void qspReplaceCompiledItems(QSPMathExpression *expression, int firstIndex, int keptIndex, int keptCount)
+{
+    /* Keep the specified items only, the operation is the last item of the expression */
+    QSPMathCompiledOp *expItems = expression->CompItems;
     int itemsCount = expression->ItemsCount;
-    QSPMathCompiledOp *item = expression->CompItems;
-    while (--itemsCount >= 0)
+    qspReleaseCompiledItems(expItems + firstIndex, keptIndex - firstIndex);
+    qspReleaseCompiledItems(expItems + keptIndex + keptCount, itemsCount - keptIndex - keptCount);
+    if (keptIndex > firstIndex)
+        memmove(expItems + firstIndex, expItems + keptIndex, keptCount * sizeof(QSPMathCompiledOp));
+    expression->ItemsCount = firstIndex + keptCount;
+    qspMathFoldedOpsCount += itemsCount - expression->ItemsCount;
+}
+
+INLINE QSP_BOOL qspFoldCompiledOperation(QSPMathExpression *expression, int opIndex)
+{
+    QSPVariant value;
+    QSPMathExpression subExpression;
+    QSPMathCompiledOp *expItems = expression->CompItems, *op = expItems + opIndex;
+    int i, firstIndex, jumpIndex, branchEndIndex, oldLocationState;
+    if (!qspIsPureOperation(op->OpCode, op->ArgsCount) || qspErrorNum) return QSP_FALSE;
+    firstIndex = qspSkipMathValue(expression, opIndex) + 1;
+    switch (op->OpCode)
+    {
+    case qspOpAnd:
+    case qspOpOr:
+    case qspOpIIf:
+        /* Check whether the first argument is a constant followed by the jump */
+        branchEndIndex = jumpIndex = qspSkipMathValue(expression, opIndex - 1);
+        if (op->OpCode == qspOpIIf) /* skip the jump after the second argument */
+            jumpIndex = qspSkipMathValue(expression, branchEndIndex);
+        if (jumpIndex != firstIndex + 1 || !qspIsConstantValue(expItems + firstIndex)) break;
+        qspShareToNewVariant(&value, &expItems[firstIndex].Value);
+        if (!qspConvertVariantTo(&value, QSP_TYPE_BOOL))
+        {
+            /* We'll report the error at runtime */
+            qspFreeVariant(&value);
+            return QSP_FALSE;
+        }
+        if (op->OpCode == qspOpIIf)
+        {
+            /* Keep the selected branch only */
+            if (QSP_ISTRUE(QSP_NUM(value)))
+                qspReplaceCompiledItems(expression, firstIndex, jumpIndex + 1, branchEndIndex - jumpIndex - 1);
+            else
+                qspReplaceCompiledItems(expression, firstIndex, branchEndIndex + 1, opIndex - branchEndIndex - 1);
+            return QSP_TRUE;
+        }
+        if (QSP_ISTRUE(QSP_NUM(value)) == (op->OpCode == qspOpOr))
+        {
+            /* The result doesn't depend on the second argument */
+            qspFreeVariant(&expItems[firstIndex].Value);
+            expItems[firstIndex].Value = value;
+            expItems[firstIndex].ArgType = QSP_TYPE_UNDEF;
+            expItems[firstIndex].ValueType = value.Type;
+            qspReplaceCompiledItems(expression, firstIndex, firstIndex, 1);
+            return QSP_TRUE;
+        }
+        break;
+    }
+    /* All the arguments have to be constants */
+    for (i = firstIndex; i < opIndex; ++i)
+    {
+        switch (expItems[i].OpCode)
+        {
+        case qspOpJumpIfFalse:
+        case qspOpJumpIfTrue:
+        case qspOpPopJumpIfFalse:
+        case qspOpJump:
+            break;
+        default:
+            if (!qspIsConstantValue(expItems + i)) return QSP_FALSE;
+            break;
+        }
+    }
+    /* Calculate the value once, jumps are relative so the items can be evaluated as a separate expression */
+    subExpression.CompItems = expItems + firstIndex;
+    subExpression.ItemsCount = opIndex - firstIndex + 1;
+    oldLocationState = qspLocationState;
+    value = qspCalculateValue(&subExpression);
+    if (qspLocationState != oldLocationState)
+    {
+        /* Keep the operation to report the error at runtime, reset the location state */
+        qspLocationState = oldLocationState;
+        qspResetError(QSP_FALSE);
+        return QSP_FALSE;
+    }
+    op->OpCode = qspOpValue;
+    op->ArgsCount = 0;
+    op->ValueType = value.Type;
+    op->Value = value;
+    op->VarNameId = -1;
+    qspReplaceCompiledItems(expression, firstIndex, opIndex, 1);
+    return QSP_TRUE;
+}
+
+INLINE QSP_TINYINT qspGetCompiledArgBaseType(QSPMathCompiledOp *item)
+{
+    /* Type of the value received by the operation that takes the result of this item */
+    QSP_TINYINT type = (QSP_ISDEF(item->ArgType) ? item->ArgType : item->ValueType);
+    return (QSP_ISDEF(type) ? QSP_BASETYPE(type) : QSP_TYPE_UNDEF);
+}
+
+INLINE void qspSpecializeCompiledOperation(QSPMathExpression *expression, int opIndex)
+{
+    QSP_TINYINT type1, type2, specOpCode = qspOpUnknown;
+    QSPMathCompiledOp *expItems = expression->CompItems, *op = expItems + opIndex;
+    switch (op->OpCode)
+    {
+    case qspOpNegation:
+        if (qspGetCompiledArgBaseType(expItems + opIndex - 1) == QSP_TYPE_NUM)
+            op->ValueType = QSP_TYPE_NUM;
+        return;
+    case qspOpIIf:
+        /* The result has a known type if both branches have the same type, the second one is wrapped by the jump */
+        type1 = expItems[qspSkipMathValue(expression, opIndex - 1) - 1].ValueType;
+        type2 = expItems[opIndex - 1].ValueType;
+        if (type1 == type2) op->ValueType = type1;
+        return;
+    case qspOpAppend:
+    case qspOpAdd:
+    case qspOpSub:
+    case qspOpMul:
+    case qspOpDiv:
+    case qspOpNe:
+    case qspOpLeq:
+    case qspOpGeq:
+    case qspOpEq:
+    case qspOpLt:
+    case qspOpGt:
+        break;
+    default:
+        return;
+    }
+    /* Binary operations skip conversions of the arguments if their types are known */
+    type1 = qspGetCompiledArgBaseType(expItems + qspSkipMathValue(expression, opIndex - 1));
+    type2 = qspGetCompiledArgBaseType(expItems + opIndex - 1);
+    if (type1 != type2) return;
+    switch (type1)
+    {
+    case QSP_TYPE_NUM:
+        switch (op->OpCode)
+        {
+        case qspOpAdd: specOpCode = qspOpAddNums; break;
+        case qspOpSub: specOpCode = qspOpSubNums; break;
+        case qspOpMul: specOpCode = qspOpMulNums; break;
+        case qspOpDiv: specOpCode = qspOpDivNums; break;
+        case qspOpNe: specOpCode = qspOpNeNums; break;
+        case qspOpLeq: specOpCode = qspOpLeqNums; break;
+        case qspOpGeq: specOpCode = qspOpGeqNums; break;
+        case qspOpEq: specOpCode = qspOpEqNums; break;
+        case qspOpLt: specOpCode = qspOpLtNums; break;
+        case qspOpGt: specOpCode = qspOpGtNums; break;
+        }
+        break;
+    case QSP_TYPE_STR:
+        switch (op->OpCode)
+        {
+        case qspOpAppend:
+        case qspOpAdd: specOpCode = qspOpConcatStrs; break;
+        case qspOpNe: specOpCode = qspOpNeStrs; break;
+        case qspOpLeq: specOpCode = qspOpLeqStrs; break;
+        case qspOpGeq: specOpCode = qspOpGeqStrs; break;
+        case qspOpEq: specOpCode = qspOpEqStrs; break;
+        case qspOpLt: specOpCode = qspOpLtStrs; break;
+        case qspOpGt: specOpCode = qspOpGtStrs; break;
+        }
+        break;
+    }
+    if (specOpCode != qspOpUnknown)
+    {
+        op->OpCode = specOpCode;
+        op->ValueType = qspOps[specOpCode].ResType;
+    }
+}
+
+INLINE void qspFlattenCompiledOperation(QSPMathExpression *expression, int opIndex)
+{
+    QSP_TINYINT opCode, argsCount;
+    QSPMathCompiledOp *expItems = expression->CompItems, *op = expItems + opIndex;
+    int firstArgIndex;
+    switch (op->OpCode)
+    {
+    case qspOpAppend:
+    case qspOpConcatStrs:
+        break;
+    default:
+        return;
+    }
+    /* Chains of concatenations are evaluated by a single operation that copies every part once */
+    firstArgIndex = qspSkipMathValue(expression, opIndex - 1);
+    switch (expItems[firstArgIndex].OpCode)
+    {
+    case qspOpAppend:
+        if (op->OpCode != qspOpAppend) return;
+        opCode = qspOpAppend;
+        break;
+    case qspOpConcatStrs:
+    case qspOpJoinStrs:
+        if (op->OpCode != qspOpConcatStrs) return;
+        opCode = qspOpJoinStrs;
+        break;
+    default:
+        return;
+    }
+    argsCount = expItems[firstArgIndex].ArgsCount + 1;
+    if (argsCount > QSP_MAXMATHOPARGS) return;
+    /* Arguments of the first argument become arguments of the operation */
+    memmove(expItems + firstArgIndex, expItems + firstArgIndex + 1, (opIndex - firstArgIndex) * sizeof(QSPMathCompiledOp));
+    --expression->ItemsCount;
+    op = expItems + opIndex - 1;
+    op->OpCode = opCode;
+    op->ArgsCount = argsCount;
+    op->ValueType = qspOps[opCode].ResType;
+}
+
+INLINE void qspReleaseCompiledItems(QSPMathCompiledOp *item, int count)
+{
+    while (--count >= 0)
     {
         switch (item->OpCode)
         {
@@ -938,279 +1489,374 @@ void qspFreeMathExpression(QSPMathExpression *expression)
         }
         ++item;
     }
-    free(expression->CompItems);
 }
 
-INLINE QSPVariant qspCalculateArgumentValue(QSPMathExpression *expression, int valueIndex, QSP_TINYINT type)
+void qspFreeMathExpression(QSPMathExpression *expression)
 {
-    int oldLocationState = qspLocationState;
-    QSPVariant res = qspCalculateValue(expression, valueIndex);
-    if (qspLocationState != oldLocationState)
-        return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-    if (QSP_ISDEF(type) && !qspConvertVariantTo(&res, type))
-    {
-        qspSetError(QSP_ERR_TYPEMISMATCH);
-        qspFreeVariant(&res);
-        return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-    }
-    return res;
+    qspReleaseCompiledItems(expression->CompItems, expression->ItemsCount);
+    free(expression->CompItems);
 }
 
-QSPVariant qspCalculateValue(QSPMathExpression *expression, int valueIndex) /* the last item represents the whole expression */
+QSPVariant qspCalculateValue(QSPMathExpression *expression) /* items get evaluated in a single pass */
 {
-    QSPVariant *args, tos;
+    QSPVariant *stack, *stackTop, *args, tos;
+    QSPMathCompiledOp *item, *lastItem;
     QSP_TINYINT opCode, argsCount, type;
     int oldLocationState;
-    if (valueIndex < 0)
+    if (expression->ItemsCount <= 0)
     {
         qspSetError(QSP_ERR_INTERNAL);
         return qspGetEmptyVariant(QSP_TYPE_UNDEF);
     }
     oldLocationState = qspLocationState;
-    opCode = expression->CompItems[valueIndex].OpCode;
-    argsCount = expression->CompItems[valueIndex].ArgsCount;
-    type = qspOps[opCode].ResType;
-    if (QSP_ISDEF(type)) tos.Type = type;
-    if (argsCount)
+    /* Every item adds one value at most */
+    stack = stackTop = (QSPVariant *)qspAllocateMemory(expression->ItemsCount * sizeof(QSPVariant));
+    item = expression->CompItems;
+    lastItem = item + expression->ItemsCount;
+    while (item < lastItem)
     {
-        int i, argIndices[QSP_MAXMATHOPARGS];
-        /* Find positions of the arguments */
-        --valueIndex; /* move to the last argument */
-        for (i = argsCount - 1; i > 0; --i)
+        opCode = item->OpCode;
+        switch (opCode)
+        {
+        case qspOpValue:
+            if (item->Value.Type == QSP_TYPE_VARREF)
+            {
+                /* Array operations refer to names of variables directly */
+                ++item;
+                continue;
+            }
+            break;
+        case qspOpJumpIfFalse:
+            if (QSP_ISFALSE(QSP_PNUM(stackTop - 1)))
+                item += item->JumpOffset;
+            else
+            {
+                --stackTop; /* it's a boolean value, we don't have to release it */
+                ++item;
+            }
+            continue;
+        case qspOpJumpIfTrue:
+            if (QSP_ISTRUE(QSP_PNUM(stackTop - 1)))
+                item += item->JumpOffset;
+            else
+            {
+                --stackTop; /* it's a boolean value, we don't have to release it */
+                ++item;
+            }
+            continue;
+        case qspOpPopJumpIfFalse:
+            --stackTop; /* it's a boolean value, we don't have to release it */
+            if (QSP_ISFALSE(QSP_PNUM(stackTop)))
+                item += item->JumpOffset;
+            else
+                ++item;
+            continue;
+        case qspOpJump:
+            item += item->JumpOffset;
+            continue;
+        }
+        switch (opCode)
         {
-            argIndices[i] = valueIndex;
-            valueIndex = qspSkipMathValue(expression, valueIndex);
+        case qspOpAnd:
+        case qspOpOr:
+        case qspOpIIf:
+            argsCount = 1; /* other arguments are already processed by jumps */
+            break;
+        case qspOpArrItem:
+        case qspOpFirstArrItem:
+        case qspOpLastArrItem:
+            argsCount = item->ArgsCount - 1; /* the name of the variable isn't on the stack */
+            break;
+        default:
+            argsCount = item->ArgsCount;
+            break;
         }
-        argIndices[0] = valueIndex;
+        args = stackTop - argsCount;
+        type = qspOps[opCode].ResType;
+        if (QSP_ISDEF(type)) tos.Type = type;
         switch (opCode)
         {
-        case qspOpAnd: /* logical AND operator, we don't pre-evaluate arguments */
+        case qspOpValue:
+            /* Share the value instead of moving it because it has to be possible to reuse the compiled expression */
+            qspShareToNewVariant(&tos, &item->Value);
+            break;
+        case qspOpValueToFormat:
+            /* Share the value instead of moving it because it has to be possible to reuse the compiled expression */
+            qspShareToNewVariant(&tos, &item->Value);
+            if (QSP_ISSTR(tos.Type))
             {
-                QSPVariant arg = qspCalculateArgumentValue(expression, argIndices[0], QSP_TYPE_BOOL);
-                if (qspLocationState != oldLocationState)
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                if (QSP_ISTRUE(QSP_NUM(arg)))
-                {
-                    arg = qspCalculateArgumentValue(expression, argIndices[1], QSP_TYPE_BOOL);
-                    if (qspLocationState != oldLocationState)
-                        return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                    QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(arg));
-                }
-                else
-                {
-                    QSP_NUM(tos) = QSP_TOBOOL(QSP_FALSE);
-                }
-                return tos;
+                QSPString textToFormat = QSP_STR(tos);
+                QSP_STR(tos) = qspFormatText(textToFormat, QSP_TRUE);
+                qspFreeNewString(&textToFormat, &QSP_STR(tos)); /* release the old one, keep the new one */
             }
-        case qspOpOr: /* logical OR operator, we don't pre-evaluate arguments */
+            break;
+        case qspOpArrItem:
+            qspGetVarValueByIndex(QSP_STR(item->Value), item->VarNameId, args[0], &tos);
+            break;
+        case qspOpFirstArrItem:
+            qspGetFirstVarValue(QSP_STR(item->Value), item->VarNameId, &tos);
+            break;
+        case qspOpLastArrItem:
+            qspGetLastVarValue(QSP_STR(item->Value), item->VarNameId, &tos);
+            break;
+        case qspOpAnd:
+        case qspOpOr:
+            /* The value is either the second argument or the first one that caused the jump */
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]));
+            break;
+        case qspOpIIf:
+            /* The value that got evaluated */
+            qspMoveToNewVariant(&tos, args);
+            break;
+        case qspOpAdd:
+            qspAutoConvertCombine(args, args + 1, QSP_ADD_CHAR, &tos);
+            break;
+        case qspOpSub:
+            qspAutoConvertCombine(args, args + 1, QSP_SUB_CHAR, &tos);
+            break;
+        case qspOpMul:
+            qspAutoConvertCombine(args, args + 1, QSP_MUL_CHAR, &tos);
+            break;
+        case qspOpDiv:
+            qspAutoConvertCombine(args, args + 1, QSP_DIV_CHAR, &tos);
+            break;
+        case qspOpMod:
+            if (QSP_NUM(args[1]) == 0)
             {
-                QSPVariant arg = qspCalculateArgumentValue(expression, argIndices[0], QSP_TYPE_BOOL);
-                if (qspLocationState != oldLocationState)
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                if (QSP_ISTRUE(QSP_NUM(arg)))
-                {
-                    QSP_NUM(tos) = QSP_TOBOOL(QSP_TRUE);
-                }
-                else
-                {
-                    arg = qspCalculateArgumentValue(expression, argIndices[1], QSP_TYPE_BOOL);
-                    if (qspLocationState != oldLocationState)
-                        return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                    QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(arg));
-                }
-                return tos;
+                qspSetError(QSP_ERR_DIVBYZERO);
+                break;
             }
-        case qspOpNot: /* logical NOT operator, we don't pre-evaluate arguments */
+            QSP_NUM(tos) = QSP_NUM(args[0]) % QSP_NUM(args[1]);
+            break;
+        case qspOpNegation:
+            qspNegateValue(args, &tos);
+            break;
+        case qspOpTuple:
+            QSP_TUPLE(tos) = qspMoveToNewTuple(args, argsCount);
+            break;
+        case qspOpAppend:
+            if (argsCount == 2)
+                qspAutoConvertAppend(args, args + 1, &tos);
+            else
+                qspAppendValues(args, argsCount, &tos);
+            break;
+        case qspOpEq:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) == 0);
+            break;
+        case qspOpNe:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) != 0);
+            break;
+        case qspOpLt:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) < 0);
+            break;
+        case qspOpGt:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) > 0);
+            break;
+        case qspOpLeq:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) <= 0);
+            break;
+        case qspOpGeq:
+            QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) >= 0);
+            break;
+        /* Specialized operations ---------------------------------------------------------- */
+        case qspOpAddNums:
+            QSP_NUM(tos) = QSP_NUM(args[0]) + QSP_NUM(args[1]);
+            break;
+        case qspOpSubNums:
+            QSP_NUM(tos) = QSP_NUM(args[0]) - QSP_NUM(args[1]);
+            break;
+        case qspOpMulNums:
+            QSP_NUM(tos) = QSP_NUM(args[0]) * QSP_NUM(args[1]);
+            break;
+        case qspOpDivNums:
+            if (QSP_NUM(args[1]) == 0)
             {
-                QSPVariant arg = qspCalculateArgumentValue(expression, argIndices[0], QSP_TYPE_BOOL);
-                if (qspLocationState != oldLocationState)
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                QSP_NUM(tos) = QSP_TOBOOL(!QSP_NUM(arg));
-                return tos;
+                qspSetError(QSP_ERR_DIVBYZERO);
+                break;
             }
-        case qspOpIIf: /* inline IF operator, we don't pre-evaluate arguments */
+            QSP_NUM(tos) = QSP_NUM(args[0]) / QSP_NUM(args[1]);
+            break;
+        case qspOpEqNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) == QSP_NUM(args[1]));
+            break;
+        case qspOpNeNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) != QSP_NUM(args[1]));
+            break;
+        case qspOpLtNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) < QSP_NUM(args[1]));
+            break;
+        case qspOpGtNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) > QSP_NUM(args[1]));
+            break;
+        case qspOpLeqNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) <= QSP_NUM(args[1]));
+            break;
+        case qspOpGeqNums:
+            QSP_NUM(tos) = QSP_TOBOOL(QSP_NUM(args[0]) >= QSP_NUM(args[1]));
+            break;
+        case qspOpConcatStrs:
+            QSP_STR(tos) = qspConcatText(QSP_STR(args[0]), QSP_STR(args[1]));
+            break;
+        case qspOpEqStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) == 0);
+            break;
+        case qspOpNeStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) != 0);
+            break;
+        case qspOpLtStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) < 0);
+            break;
+        case qspOpGtStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) > 0);
+            break;
+        case qspOpLeqStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) <= 0);
+            break;
+        case qspOpGeqStrs:
+            QSP_NUM(tos) = QSP_TOBOOL(qspStrsCompare(QSP_STR(args[0]), QSP_STR(args[1])) >= 0);
+            break;
+        case qspOpJoinStrs:
+            if (argsCount == 1)
             {
-                QSPVariant arg = qspCalculateArgumentValue(expression, argIndices[0], QSP_TYPE_BOOL);
-                if (qspLocationState != oldLocationState)
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                tos = qspCalculateArgumentValue(expression, (QSP_ISTRUE(QSP_NUM(arg)) ? argIndices[1] : argIndices[2]), QSP_TYPE_UNDEF);
-                if (qspLocationState != oldLocationState)
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                return tos;
+                qspMoveToNewVariant(&tos, args);
+                tos.Type = QSP_TYPE_STR;
             }
+            else
+                QSP_STR(tos) = qspJoinTextValues(args, argsCount);
+            break;
+        /* Embedded functions -------------------------------------------------------------- */
+        case qspOpNot:
+            QSP_NUM(tos) = QSP_TOBOOL(!QSP_NUM(args[0]));
+            break;
+        case qspOpLoc:
+            QSP_NUM(tos) = QSP_TOBOOL(qspCachedLocIndex(QSP_STR(args[0])) >= 0);
+            break;
+        case qspOpObj:
+            QSP_NUM(tos) = qspObjsCountByName(QSP_STR(args[0]));
+            break;
+        case qspOpLCase:
+            qspMoveToNewVariant(&tos, args);
+            qspUnshareText(&QSP_STR(tos));
+            qspLowerStr(&QSP_STR(tos));
+            break;
+        case qspOpUCase:
+            qspMoveToNewVariant(&tos, args);
+            qspUnshareText(&QSP_STR(tos));
+            qspUpperStr(&QSP_STR(tos));
+            break;
+        case qspOpStr:
+            qspMoveToNewVariant(&tos, args);
+            break;
+        case qspOpVal:
+            QSP_NUM(tos) = qspGetVariantAsNum(args, 0);
+            break;
+        case qspOpArrSize:
+            QSP_NUM(tos) = qspArraySize(QSP_STR(args[0]));
+            break;
+        case qspOpTrim:
+            QSP_STR(tos) = qspCopyToNewText(qspDelSpc(QSP_STR(args[0])));
+            break;
+        case qspOpInput:
+            QSP_STR(tos) = qspCallInputBox(QSP_STR(args[0]));
+            break;
+        case qspOpRnd:
+            QSP_NUM(tos) = qspUniformRand(1, 1000);
+            break;
+        case qspOpCountObj:
+            QSP_NUM(tos) = qspCurObjsCount;
+            break;
+        case qspOpMsecsCount:
+            QSP_NUM(tos) = qspGetTime();
+            break;
+        case qspOpQSPVer:
+            QSP_STR(tos) = (argsCount ? qspCallVersion(QSP_STR(args[0])) : qspCallVersion(qspNullString));
+            break;
+        case qspOpUserText:
+            QSP_STR(tos) = (qspCurInput.Str ? qspCopyToNewText(qspCurInput) : qspNullString);
+            break;
+        case qspOpCurLoc:
+            QSP_STR(tos) = (qspCurLoc >= 0 && qspCurLoc < qspLocsCount ? qspCopyToNewText(qspLocs[qspCurLoc].Name) : qspNullString);
+            break;
+        case qspOpSelObj:
+            QSP_STR(tos) = (qspCurSelObject >= 0 ? qspCopyToNewText(qspCurObjects[qspCurSelObject].Name) : qspNullString);
+            break;
+        case qspOpSelAct:
+            QSP_STR(tos) = (qspCurSelAction >= 0 ? qspCopyToNewText(qspCurActions[qspCurSelAction].Desc) : qspNullString);
+            break;
+        case qspOpMainText:
+            QSP_STR(tos) = (qspCurDesc.Len > 0 ? qspCopyToNewText(qspBufStringToString(qspCurDesc)) : qspNullString);
+            break;
+        case qspOpStatText:
+            QSP_STR(tos) = (qspCurVars.Len > 0 ? qspCopyToNewText(qspBufStringToString(qspCurVars)) : qspNullString);
+            break;
+        case qspOpCurActs:
+            QSP_STR(tos) = qspGetAllActionsAsCode();
+            break;
+        case qspOpCurObjs:
+            QSP_STR(tos) = qspGetAllObjectsAsCode();
+            break;
+        /* External functions -------------------------------------------------------------- */
         default:
-            args = (QSPVariant *)qspAllocateMemory(argsCount * sizeof(QSPVariant));
-            for (i = 0; i < argsCount; ++i)
-            {
-                args[i] = qspCalculateArgumentValue(expression, argIndices[i], qspOps[opCode].ArgsTypes[i]);
-                if (qspLocationState != oldLocationState)
-                {
-                    /* We have to clean up collected arguments */
-                    qspFreeVariants(args, i);
-                    qspReleaseMemory(args);
-                    return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-                }
-            }
+            qspOps[opCode].Func(args, argsCount, &tos);
             break;
         }
-    }
-    switch (opCode)
-    {
-    case qspOpValue:
-        /* Copy the value instead of moving it because it has to be possible to reuse the compiled expression */
-        qspCopyToNewVariant(&tos, &expression->CompItems[valueIndex].Value);
-        break;
-    case qspOpValueToFormat:
-        /* Copy the value instead of moving it because it has to be possible to reuse the compiled expression */
-        qspCopyToNewVariant(&tos, &expression->CompItems[valueIndex].Value);
-        if (QSP_ISSTR(tos.Type))
-        {
-            QSPString textToFormat = QSP_STR(tos);
-            QSP_STR(tos) = qspFormatText(textToFormat, QSP_TRUE);
-            qspFreeNewString(&textToFormat, &QSP_STR(tos)); /* release the old one, keep the new one */
-        }
-        break;
-    case qspOpArrItem:
-        qspGetVarValueByIndex(QSP_STR(args[0]), args[1], &tos);
-        break;
-    case qspOpFirstArrItem:
-        qspGetFirstVarValue(QSP_STR(args[0]), &tos);
-        break;
-    case qspOpLastArrItem:
-        qspGetLastVarValue(QSP_STR(args[0]), &tos);
-        break;
-    case qspOpAdd:
-        qspAutoConvertCombine(args, args + 1, QSP_ADD_CHAR, &tos);
-        break;
-    case qspOpSub:
-        qspAutoConvertCombine(args, args + 1, QSP_SUB_CHAR, &tos);
-        break;
-    case qspOpMul:
-        qspAutoConvertCombine(args, args + 1, QSP_MUL_CHAR, &tos);
-        break;
-    case qspOpDiv:
-        qspAutoConvertCombine(args, args + 1, QSP_DIV_CHAR, &tos);
-        break;
-    case qspOpMod:
-        if (QSP_NUM(args[1]) == 0)
+        if (argsCount) qspFreeVariants(args, argsCount);
+        stackTop = args;
+        if (qspLocationState != oldLocationState) break;
+        /* Convert the result for the operation that takes it */
+        if (QSP_ISDEF(item->ArgType) && !qspConvertVariantTo(&tos, item->ArgType))
         {
-            qspSetError(QSP_ERR_DIVBYZERO);
+            qspSetError(QSP_ERR_TYPEMISMATCH);
+            qspFreeVariant(&tos);
             break;
         }
-        QSP_NUM(tos) = QSP_NUM(args[0]) % QSP_NUM(args[1]);
-        break;
-    case qspOpNegation:
-        qspNegateValue(args, &tos);
-        break;
-    case qspOpTuple:
-        QSP_TUPLE(tos) = qspMoveToNewTuple(args, argsCount);
-        break;
-    case qspOpAppend:
-        qspAutoConvertAppend(args, args + 1, &tos);
-        break;
-    case qspOpEq:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) == 0);
-        break;
-    case qspOpNe:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) != 0);
-        break;
-    case qspOpLt:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) < 0);
-        break;
-    case qspOpGt:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) > 0);
-        break;
-    case qspOpLeq:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) <= 0);
-        break;
-    case qspOpGeq:
-        QSP_NUM(tos) = QSP_TOBOOL(qspVariantsCompare(args, args + 1) >= 0);
-        break;
-    /* Embedded functions -------------------------------------------------------------- */
-    case qspOpLoc:
-        QSP_NUM(tos) = QSP_TOBOOL(qspLocIndex(QSP_STR(args[0])) >= 0);
-        break;
-    case qspOpObj:
-        QSP_NUM(tos) = qspObjsCountByName(QSP_STR(args[0]));
-        break;
-    case qspOpLCase:
-        qspMoveToNewVariant(&tos, args);
-        qspLowerStr(&QSP_STR(tos));
-        break;
-    case qspOpUCase:
-        qspMoveToNewVariant(&tos, args);
-        qspUpperStr(&QSP_STR(tos));
-        break;
-    case qspOpStr:
-        qspMoveToNewVariant(&tos, args);
-        break;
-    case qspOpVal:
-        QSP_NUM(tos) = qspGetVariantAsNum(args, 0);
-        break;
-    case qspOpArrSize:
-        QSP_NUM(tos) = qspArraySize(QSP_STR(args[0]));
-        break;
-    case qspOpTrim:
-        QSP_STR(tos) = qspCopyToNewText(qspDelSpc(QSP_STR(args[0])));
-        break;
-    case qspOpInput:
-        QSP_STR(tos) = qspCallInputBox(QSP_STR(args[0]));
-        break;
-    case qspOpRnd:
-        QSP_NUM(tos) = qspUniformRand(1, 1000);
-        break;
-    case qspOpCountObj:
-        QSP_NUM(tos) = qspCurObjsCount;
-        break;
-    case qspOpMsecsCount:
-        QSP_NUM(tos) = qspGetTime();
-        break;
-    case qspOpQSPVer:
-        QSP_STR(tos) = (argsCount ? qspCallVersion(QSP_STR(args[0])) : qspCallVersion(qspNullString));
-        break;
-    case qspOpUserText:
-        QSP_STR(tos) = (qspCurInput.Str ? qspCopyToNewText(qspCurInput) : qspNullString);
-        break;
-    case qspOpCurLoc:
-        QSP_STR(tos) = (qspCurLoc >= 0 && qspCurLoc < qspLocsCount ? qspCopyToNewText(qspLocs[qspCurLoc].Name) : qspNullString);
-        break;
-    case qspOpSelObj:
-        QSP_STR(tos) = (qspCurSelObject >= 0 ? qspCopyToNewText(qspCurObjects[qspCurSelObject].Name) : qspNullString);
-        break;
-    case qspOpSelAct:
-        QSP_STR(tos) = (qspCurSelAction >= 0 ? qspCopyToNewText(qspCurActions[qspCurSelAction].Desc) : qspNullString);
-        break;
-    case qspOpMainText:
-        QSP_STR(tos) = (qspCurDesc.Len > 0 ? qspCopyToNewText(qspBufStringToString(qspCurDesc)) : qspNullString);
-        break;
-    case qspOpStatText:
-        QSP_STR(tos) = (qspCurVars.Len > 0 ? qspCopyToNewText(qspBufStringToString(qspCurVars)) : qspNullString);
-        break;
-    case qspOpCurActs:
-        QSP_STR(tos) = qspGetAllActionsAsCode();
-        break;
-    case qspOpCurObjs:
-        QSP_STR(tos) = qspGetAllObjectsAsCode();
-        break;
-    /* External functions -------------------------------------------------------------- */
-    default:
-        qspOps[opCode].Func(args, argsCount, &tos);
-        break;
+        *stackTop++ = tos;
+        ++item;
     }
-    if (argsCount)
+    if (item < lastItem)
     {
-        qspFreeVariants(args, argsCount);
-        qspReleaseMemory(args);
+        /* We have to clean up collected values */
+        qspFreeVariants(stack, (int)(stackTop - stack));
+        qspReleaseMemory(stack);
+        return qspGetEmptyVariant(QSP_TYPE_UNDEF);
     }
-    if (qspLocationState != oldLocationState) return qspGetEmptyVariant(QSP_TYPE_UNDEF);
+    tos = *stack;
+    qspReleaseMemory(stack);
     return tos;
 }
 
 QSPVariant qspCalculateExprValue(QSPString expr)
 {
-    QSPMathExpression *expression = qspMathExpGetCompiled(expr);
-    if (!expression) return qspGetEmptyVariant(QSP_TYPE_UNDEF);
-    return qspCalculateValue(expression, expression->ItemsCount - 1);
+    QSPVariant res;
+    QSPCachedMathExp *exp = qspMathExpGetCompiled(expr);
+    if (!exp) return qspGetEmptyVariant(QSP_TYPE_UNDEF);
+    ++exp->UseCount; /* nested evaluations can't evict the expression */
+    res = qspCalculateValue(&exp->CompiledExp);
+    if (!--exp->UseCount && qspCachedMathExpsStats.MemoryUsed > qspCachedMathExpsStats.MemoryLimit)
+        qspTrimMathExps(0);
+    return res;
+}
+
+void qspCompileTextTemplate(QSPString txt, QSPMathExpression *expression)
+{
+    /* The expression takes ownership of the text, it can't fail because we fall back to runtime formatting */
+    expression->ItemsCount = 0;
+    expression->Capacity = 4;
+    expression->CompItems = (QSPMathCompiledOp *)malloc(expression->Capacity * sizeof(QSPMathCompiledOp));
+    qspAppendTemplateToCompiled(expression, txt);
+}
+
+QSPString qspFormatTextTemplate(QSPString txt, QSPMathExpression **expression)
+{
+    /* Templates get compiled on the first use */
+    QSPVariant res;
+    if (!*expression)
+    {
+        *expression = (QSPMathExpression *)malloc(sizeof(QSPMathExpression));
+        qspCompileTextTemplate(qspShareText(txt), *expression);
+    }
+    res = qspCalculateValue(*expression);
+    return QSP_STR(res);
 }
 
 INLINE void qspNegateValue(QSPVariant *val, QSPVariant *res)
@@ -1236,6 +1882,54 @@ INLINE void qspNegateValue(QSPVariant *val, QSPVariant *res)
     }
 }
 
+INLINE QSPString qspJoinTextValues(QSPVariant *args, QSP_TINYINT count)
+{
+    QSPString res;
+    QSP_CHAR *dest;
+    int i, len = 0;
+    /* Values are already evaluated, so we know the exact length of the result */
+    for (i = 0; i < count; ++i)
+        len += qspStrLen(QSP_STR(args[i]));
+    if (!len) return qspNullString;
+    res.Str = dest = qspAllocateText(len);
+    res.End = dest + len;
+    for (i = 0; i < count; ++i)
+    {
+        len = qspStrLen(QSP_STR(args[i]));
+        if (len)
+        {
+            memcpy(dest, QSP_STR(args[i]).Str, len * sizeof(QSP_CHAR));
+            dest += len;
+        }
+    }
+    return res;
+}
+
+INLINE void qspAppendValues(QSPVariant *args, QSP_TINYINT count, QSPVariant *res)
+{
+    QSPVariant tmp;
+    int i;
+    for (i = 0; i < count; ++i)
+        if (QSP_ISTUPLE(args[i].Type)) break;
+    if (i == count)
+    {
+        /* Strings and numbers get joined at once */
+        for (i = 0; i < count; ++i)
+            qspConvertVariantTo(args + i, QSP_TYPE_STR);
+        QSP_PSTR(res) = qspJoinTextValues(args, count);
+        res->Type = QSP_TYPE_STR;
+        return;
+    }
+    /* Tuples get merged one by one like separate operations do */
+    qspAutoConvertAppend(args, args + 1, res);
+    for (i = 2; i < count; ++i)
+    {
+        qspAutoConvertAppend(res, args + i, &tmp);
+        qspFreeVariant(res);
+        *res = tmp;
+    }
+}
+
 INLINE void qspFunctionLen(QSPVariant *args, QSP_TINYINT QSP_UNUSED(count), QSPVariant *res)
 {
     switch (QSP_BASETYPE(args[0].Type))
@@ -1372,10 +2066,12 @@ INLINE void qspFunctionArrType(QSPVariant *args, QSP_TINYINT count, QSPVariant *
 {
     int arrIndex;
     QSP_TINYINT arrType;
+    QSPVariant *arrItem;
     QSPVar *var = qspVarReference(QSP_STR(args[0]), QSP_FALSE);
     if (!var) return;
     arrIndex = (count == 2 ? qspGetVarIndex(var, args[1], QSP_FALSE) : 0);
-    arrType = ((arrIndex >= 0 && arrIndex < var->ValsCount) ? var->Values[arrIndex].Type : QSP_TYPE_UNDEF);
+    arrItem = qspGetVarItem(var, arrIndex);
+    arrType = (arrItem ? arrItem->Type : QSP_TYPE_UNDEF);
     if (QSP_ISDEF(arrType))
     {
         QSPString typePrefix;
@@ -1444,7 +2140,7 @@ INLINE void qspFunctionArrPack(QSPVariant *args, QSP_TINYINT count, QSPVariant *
                 if (itemsToCopy < itemsCount)
                     itemsCount = (itemsToCopy > 0 ? itemsToCopy : 0);
             }
-            QSP_PTUPLE(res) = qspCopyToNewTuple(var->Values + startInd, itemsCount);
+            QSP_PTUPLE(res) = qspArrayItemsToNewTuple(var, startInd, itemsCount);
             return;
         }
     }
@@ -1534,13 +2230,13 @@ INLINE void qspFunctionRGB(QSPVariant *args, QSP_TINYINT count, QSPVariant *res)
 
 INLINE void qspFunctionDesc(QSPVariant *args, QSP_TINYINT QSP_UNUSED(count), QSPVariant *res)
 {
-    int index = qspLocIndex(QSP_STR(args[0]));
+    int index = qspCachedLocIndex(QSP_STR(args[0]));
     if (index < 0)
     {
         qspSetError(QSP_ERR_LOCNOTFOUND);
         return;
     }
-    QSP_PSTR(res) = qspFormatText(qspLocs[index].Desc, QSP_FALSE);
+    QSP_PSTR(res) = qspFormatTextTemplate(qspLocs[index].Desc, &qspLocs[index].DescTemplate);
 }
 
 INLINE void qspFunctionGetObj(QSPVariant *args, QSP_TINYINT QSP_UNUSED(count), QSPVariant *res)
@@ -1562,7 +2258,7 @@ INLINE void qspFunctionIsPlay(QSPVariant *args, QSP_TINYINT QSP_UNUSED(count), Q
 
 INLINE void qspFunctionFunc(QSPVariant *args, QSP_TINYINT count, QSPVariant *res)
 {
-    qspExecLocByNameWithArgs(QSP_STR(args[0]), args + 1, count - 1, QSP_TRUE, res);
+    qspExecLocByIndexWithArgs(qspCachedLocIndex(QSP_STR(args[0])), args + 1, count - 1, QSP_TRUE, res);
 }
 
 INLINE void qspFunctionDynEval(QSPVariant *args, QSP_TINYINT count, QSPVariant *res)
@@ -15,8 +15,8 @@
     #define QSP_MAXMATHOPARGS 20
     #define QSP_MATHSTACKSIZE 30
     #define QSP_MAXMATHITEMS 200
-    #define QSP_MAXCACHEDEXPSBUCKETSIZE 5
-    #define QSP_CACHEDEXPSBUCKETS 512
+    #define QSP_CACHEDEXPSBUCKETS 512 /* initial number of buckets, it grows with the number of expressions */
+    #define QSP_CACHEDEXPSSIZE (2 * 1024 * 1024) /* default memory budget of the cache */
 
     /* Helpers */
     #define QSP_TOBOOL(x) ((x) != 0) /* converts a number to a QSP boolean value */
@@ -45,7 +45,11 @@
     {
         QSP_TINYINT OpCode;
         QSP_TINYINT ArgsCount;
-        QSPVariant Value;
+        QSP_TINYINT ArgType; /* type expected by the operation that takes the result of this item */
+        QSP_TINYINT ValueType; /* type of the result if it's known at compile time, QSP_TYPE_UNDEF otherwise */
+        QSPVariant Value; /* array operations refer to the name of the variable here */
+        int VarNameId; /* interned name of the variable, only for QSP_TYPE_VARREF values & array operations */
+        int JumpOffset; /* distance to the next item to evaluate, only for jumps */
     } QSPMathCompiledOp;
 
     typedef struct
@@ -55,19 +59,18 @@
         int Capacity;
     } QSPMathExpression;
 
-    typedef struct
+    typedef struct QSPCachedMathExp_s
     {
         QSPString Text;
         QSPMathExpression CompiledExp;
+        unsigned int Hash;
+        int Size; /* estimated memory footprint of the entry */
+        int UseCount; /* number of evaluations in progress, such entries can't be evicted */
+        struct QSPCachedMathExp_s *NextInBucket;
+        struct QSPCachedMathExp_s *PrevUsed; /* more recently used entry */
+        struct QSPCachedMathExp_s *NextUsed; /* less recently used entry */
     } QSPCachedMathExp;
 
-    typedef struct
-    {
-        QSPCachedMathExp Exps[QSP_MAXCACHEDEXPSBUCKETSIZE];
-        int ExpsCount;
-        int ExpToEvict;
-    } QSPCachedMathExpsBucket;
-
     enum
     {
         qspOpUnknown,
@@ -81,6 +84,10 @@
         qspOpTuple,
         qspOpValue,
         qspOpValueToFormat,
+        qspOpJumpIfFalse, /* keeps the value & jumps if it's false, removes the value otherwise */
+        qspOpJumpIfTrue, /* keeps the value & jumps if it's true, removes the value otherwise */
+        qspOpPopJumpIfFalse, /* removes the value & jumps if it's false */
+        qspOpJump,
         qspOpNegation,
         qspOpAppend,
         qspOpAdd,
@@ -96,6 +103,25 @@
         qspOpEq,
         qspOpLt,
         qspOpGt,
+        /* Specialized operations for arguments of known types */
+        qspOpAddNums,
+        qspOpSubNums,
+        qspOpMulNums,
+        qspOpDivNums,
+        qspOpNeNums,
+        qspOpLeqNums,
+        qspOpGeqNums,
+        qspOpEqNums,
+        qspOpLtNums,
+        qspOpGtNums,
+        qspOpConcatStrs,
+        qspOpNeStrs,
+        qspOpLeqStrs,
+        qspOpGeqStrs,
+        qspOpEqStrs,
+        qspOpLtStrs,
+        qspOpGtStrs,
+        qspOpJoinStrs, /* joins parts of a string with subexpressions */
 
         qspOpFirst_Function,
         qspOpNot = qspOpFirst_Function,
@@ -149,13 +175,19 @@
         qspOpLast_Operation
     };
 
+    extern int qspMathFoldedOpsCount;
+
     /* External functions */
     void qspInitMath(void);
     void qspTerminateMath(void);
     void qspClearAllMathExps(QSP_BOOL toInit);
+    QSPExpCacheStats qspGetMathExpsStats(void);
+    void qspSetMathExpsCacheSize(int maxSize);
     QSP_BOOL qspCompileMathExpression(QSPString s, QSPMathExpression *expression);
     void qspFreeMathExpression(QSPMathExpression *expression);
-    QSPVariant qspCalculateValue(QSPMathExpression *expression, int valueIndex);
+    QSPVariant qspCalculateValue(QSPMathExpression *expression);
     QSPVariant qspCalculateExprValue(QSPString expr);
+    void qspCompileTextTemplate(QSPString txt, QSPMathExpression *expression);
+    QSPString qspFormatTextTemplate(QSPString txt, QSPMathExpression **expression);
 
 #endif
@@ -32,3 +32,29 @@ void qspTerminateStackAllocator(void)
         qspCurAllocChunk = 0;
     }
 }
+
+void qspAddMemoryPoolSlab(QSPMemoryPool *pool)
+{
+    QSPMemorySlab *slab = (QSPMemorySlab *)malloc(sizeof(QSPMemorySlab));
+    slab->Next = pool->Slabs;
+    pool->Slabs = slab;
+    pool->FreeSpace = slab->Data;
+    pool->FreeSpaceEnd = slab->Data + QSP_POOLSLABSIZE;
+}
+
+void qspTerminateMemoryPool(QSPMemoryPool *pool)
+{
+    QSPMemorySlab *slab, *nextSlab;
+    /* Keep the slabs while any block is still in use */
+    if (pool->BlocksCount) return;
+    slab = pool->Slabs;
+    while (slab)
+    {
+        nextSlab = slab->Next;
+        free(slab);
+        slab = nextSlab;
+    }
+    pool->Slabs = 0;
+    pool->FreeBlocks = 0;
+    pool->FreeSpace = pool->FreeSpaceEnd = 0;
+}
@@ -11,8 +11,10 @@
     #define QSP_MEMORYDEFINES
 
     #define QSP_ALLOCCHUNKSIZE 16384 /* defines max allowed allocation size */
+    #define QSP_POOLSLABSIZE 16384
 
     typedef struct QSPMemoryChunk_s QSPMemoryChunk;
+    typedef struct QSPMemorySlab_s QSPMemorySlab;
 
     typedef struct QSPMemoryChunk_s
     {
@@ -22,11 +24,29 @@
         QSPMemoryChunk *Prev;
     } QSPMemoryChunk;
 
+    typedef struct QSPMemorySlab_s
+    {
+        QSPMemorySlab *Next;
+        unsigned char Data[QSP_POOLSLABSIZE];
+    } QSPMemorySlab;
+
+    typedef struct
+    {
+        int BlockSize; /* must be a multiple of the pointer size */
+        int BlocksCount; /* number of blocks in use */
+        void *FreeBlocks; /* released blocks keep a pointer to the next released block */
+        unsigned char *FreeSpace;
+        unsigned char *FreeSpaceEnd;
+        QSPMemorySlab *Slabs;
+    } QSPMemoryPool;
+
     extern QSPMemoryChunk *qspCurAllocChunk;
 
     /* External functions */
     void qspInitStackAllocator(void);
     void qspTerminateStackAllocator(void);
+    void qspAddMemoryPoolSlab(QSPMemoryPool *pool);
+    void qspTerminateMemoryPool(QSPMemoryPool *pool);
 
     INLINE QSPMemoryChunk *qspAllocateMemChunk(void)
     {
@@ -67,4 +87,28 @@
             qspCurAllocChunk = curChunk->Prev;
     }
 
+    INLINE void *qspAllocatePoolBlock(QSPMemoryPool *pool)
+    {
+        void *block = pool->FreeBlocks;
+        if (block)
+            pool->FreeBlocks = *(void **)block;
+        else
+        {
+            /* Blocks are placed next to each other in slabs */
+            if (pool->FreeSpace + pool->BlockSize > pool->FreeSpaceEnd)
+                qspAddMemoryPoolSlab(pool);
+            block = pool->FreeSpace;
+            pool->FreeSpace += pool->BlockSize;
+        }
+        ++pool->BlocksCount;
+        return block;
+    }
+
+    INLINE void qspReleasePoolBlock(QSPMemoryPool *pool, void *block)
+    {
+        *(void **)block = pool->FreeBlocks;
+        pool->FreeBlocks = block;
+        --pool->BlocksCount;
+    }
+
 #endif
@@ -59,9 +59,10 @@ void qspStatementShowMenu(QSPVariant *args, QSP_TINYINT count, QSP_TINYINT QSP_U
     else
         maxItems = QSP_MAXMENUITEMS;
     itemsCount = 0;
-    for (curItem = var->Values + ind; ind < var->ValsCount; ++ind, ++curItem)
+    for (; ind < var->ValsCount; ++ind)
     {
         if (itemsCount == maxItems) break;
+        if (!((curItem = qspGetVarItem(var, ind)))) break; /* items that aren't stored are undefined */
         itemName = itemLocation = itemImage = qspNullString;
         switch (QSP_BASETYPE(curItem->Type))
         {
@@ -32,14 +32,16 @@ INLINE void qspAddStatName(QSP_TINYINT statCode, QSPString statName, QSP_BOOL is
 INLINE int qspStatsCompare(const void *statName1, const void *statName2);
 INLINE int qspSearchElse(QSPLineOfCode *lines, int start, int end);
 INLINE int qspSearchEnd(QSPLineOfCode *lines, int start, int end);
-INLINE int qspSearchLabel(QSPLineOfCode *lines, int start, int end, QSPString str);
 INLINE QSP_BOOL qspExecString(QSPLineOfCode *line, int startStat, int endStat, QSPString *jumpTo);
 INLINE QSP_BOOL qspExecMultilineCode(QSPLineOfCode *lines, int endLine, int codeOffset, QSPString *jumpTo, int *lineInd, int *action);
 INLINE QSP_BOOL qspExecSinglelineCode(QSPLineOfCode *lines, int endLine, QSPString *jumpTo, int *lineInd, int *action);
 INLINE QSP_BOOL qspExecStringWithLocals(QSPLineOfCode *line, int startStat, int endStat, QSPString *jumpTo);
 INLINE QSP_BOOL qspStatementIf(QSPLineOfCode *line, int startStat, int endStat, QSPString *jumpTo);
-INLINE QSP_BOOL qspPrepareLoop(QSPString loopHeader, QSPMathExpression *condition, QSPLineOfCode *iteratorLine, QSPString *jumpTo);
-INLINE QSP_BOOL qspCheckCondition(QSPString expr);
+INLINE QSP_BOOL qspStatsHaveLocals(QSPCachedStat *stats, int count);
+INLINE QSP_BOOL qspLinesHaveLocals(QSPLineOfCode *lines, int count);
+INLINE QSPLoopHeader *qspGetLoopHeader(QSPString loopHeader, QSPCachedStat *stat);
+INLINE QSP_BOOL qspPrepareLoop(QSPString loopHeader, QSPCachedStat *stat, QSPLoopHeader **header, QSPString *jumpTo);
+INLINE QSP_BOOL qspCheckCondition(QSPString s, QSPCachedStat *stat);
 INLINE QSP_BOOL qspCheckCompiledCondition(QSPMathExpression *expression);
 INLINE QSP_BOOL qspStatementSinglelineLoop(QSPLineOfCode *line, int startStat, int endStat, QSPString *jumpTo);
 INLINE QSP_BOOL qspStatementMultilineLoop(QSPLineOfCode *lines, int endLine, int lineInd, int codeOffset, QSPString *jumpTo);
@@ -369,16 +371,41 @@ INLINE int qspSearchEnd(QSPLineOfCode *lines, int start, int end)
     return -1;
 }
 
-INLINE int qspSearchLabel(QSPLineOfCode *lines, int start, int end, QSPString str)
+void qspResolveCodeFlow(QSPLineOfCode *lines, int count)
 {
-    lines += start;
-    while (start < end)
+    /* Find ELSE & END of every block ahead of execution, so running blocks never search for them */
+    /* We go backwards, nested blocks get resolved first & outer blocks just skip them */
+    int i, endLine, elseLine;
+    QSPLineOfCode *line;
+    for (i = count - 1; i >= 0; --i)
     {
-        if (lines->Label.Str && qspStrsEqual(lines->Label, str)) return start;
-        ++start;
-        ++lines;
+        line = lines + i;
+        if (!line->Stats) continue;
+        switch (line->Stats->Stat)
+        {
+        case qspStatAct:
+        case qspStatLoop:
+        case qspStatIf:
+            if (!line->IsMultiline) break;
+            /* fall through */
+        case qspStatElseIf:
+        case qspStatElse:
+            /* The same searches run during execution, they store the results in the line */
+            endLine = qspSearchEnd(lines, i, count);
+            if (endLine < 0) break; /* the error is reported during execution */
+            switch (line->Stats->Stat)
+            {
+            case qspStatIf:
+            case qspStatElseIf:
+            case qspStatElse:
+                elseLine = qspSearchElse(lines, i, endLine);
+                /* Without ELSE the search starts at END and stops immediately */
+                if (elseLine < 0) line->LinesToElse = line->LinesToEnd;
+                break;
+            }
+            break;
+        }
     }
-    return -1;
 }
 
 QSP_TINYINT qspGetStatArgs(QSPString s, QSPCachedStat *stat, QSPVariant *args)
@@ -401,14 +428,14 @@ QSP_TINYINT qspGetStatArgs(QSPString s, QSPCachedStat *stat, QSPVariant *args)
         for (argIndex = 0; argIndex < argsCount; ++argIndex)
         {
             type = statArgsTypes[argIndex];
-            argExpression = qspStringFromPair(s.Str + statArgs[argIndex].StartPos, s.Str + statArgs[argIndex].EndPos);
             switch (type)
             {
             case QSP_TYPE_INLINESTR:
+                argExpression = qspStringFromPair(s.Str + statArgs[argIndex].StartPos, s.Str + statArgs[argIndex].EndPos);
                 args[argIndex] = qspStrVariant(qspCopyToNewText(argExpression), QSP_TYPE_STR);
                 break;
             default:
-                args[argIndex] = qspCalculateExprValue(argExpression);
+                args[argIndex] = qspCalculateArgValue(s, statArgs + argIndex);
                 if (qspLocationState != oldLocationState)
                 {
                     qspFreeVariants(args, argIndex);
@@ -462,6 +489,12 @@ INLINE QSP_BOOL qspExecString(QSPLineOfCode *line, int startStat, int endStat, Q
         case qspStatJump:
             {
                 QSPVariant arg; /* 1 argument only */
+                if (stat->JumpLabel.Str)
+                {
+                    qspFreeString(jumpTo);
+                    *jumpTo = qspShareText(stat->JumpLabel);
+                    return QSP_TRUE;
+                }
                 qspGetStatArgs(line->Str, stat, &arg);
                 if (qspLocationState != oldLocationState) return QSP_FALSE;
                 qspUpdateText(jumpTo, qspDelSpc(QSP_STR(arg)));
@@ -514,7 +547,7 @@ INLINE QSP_BOOL qspExecMultilineCode(QSPLineOfCode *lines, int endLine, int code
     case qspStatElseIf:
         {
             int elsePos, oldLocationState = qspLocationState;
-            QSP_BOOL condition = qspCheckCondition(qspStringFromPair(line->Str.Str + line->Stats->ParamPos, line->Str.Str + line->Stats->EndPos));
+            QSP_BOOL condition = qspCheckCondition(line->Str, line->Stats);
             if (qspLocationState != oldLocationState) return QSP_FALSE;
             elsePos = qspSearchElse(lines, ind, endLine);
             if (condition)
@@ -578,7 +611,7 @@ INLINE QSP_BOOL qspExecSinglelineCode(QSPLineOfCode *lines, int endLine,
                 break;
             }
             oldLocationState = qspLocationState;
-            condition = qspCheckCondition(qspStringFromPair(line->Str.Str + line->Stats->ParamPos, endPos));
+            condition = qspCheckCondition(line->Str, line->Stats);
             if (qspLocationState != oldLocationState) break;
             if (condition)
             {
@@ -717,14 +750,14 @@ INLINE QSP_BOOL qspExecStringWithLocals(QSPLineOfCode *line, int startStat, int
 
 void qspExecStringAsCodeWithArgs(QSPString s, QSPVariant *args, QSP_TINYINT count, QSPVariant *res)
 {
-    QSPLineOfCode *strs;
-    int oldLocationState, linesCount;
+    QSPCachedCode *code;
+    int oldLocationState;
     qspAllocateLocalScopeWithArgs(args, count, QSP_TRUE);
 
-    linesCount = qspPreprocessData(s, &strs);
+    code = qspGetCachedCode(s);
     oldLocationState = qspLocationState;
-    qspExecCode(strs, 0, linesCount, 0, 0);
-    qspFreePrepLines(strs, linesCount);
+    qspExecCode(code->Lines, 0, code->LinesCount, 0, 0);
+    qspReleaseCachedCode(code);
     if (qspLocationState != oldLocationState) return;
 
     if (res && !qspApplyResult(res)) return;
@@ -734,16 +767,15 @@ void qspExecStringAsCodeWithArgs(QSPString s, QSPVariant *args, QSP_TINYINT coun
 void qspExecStringAsCode(QSPString s)
 {
     /* Keep the current location context here (don't reset special vars) */
-    QSPLineOfCode *strs;
-    int linesCount = qspPreprocessData(s, &strs);
-    qspExecCodeBlockWithLocals(strs, 0, linesCount, 0, 0);
-    qspFreePrepLines(strs, linesCount);
+    QSPCachedCode *code = qspGetCachedCode(s);
+    qspExecCodeBlockWithLocals(code->Lines, 0, code->LinesCount, 0, 0);
+    qspReleaseCachedCode(code);
 }
 
 INLINE QSP_BOOL qspStatementIf(QSPLineOfCode *line, int startStat, int endStat, QSPString *jumpTo)
 {
     QSP_BOOL condition;
-    int i, c, elseStat, oldLocationState;
+    int elseStat, oldLocationState;
     QSPCachedStat *statements = line->Stats;
     QSP_CHAR *endPos = line->Str.Str + statements[startStat].EndPos;
     if (!qspIsCharAtPos(line->Str, endPos, QSP_COLONDELIM_CHAR))
@@ -751,26 +783,8 @@ INLINE QSP_BOOL qspStatementIf(QSPLineOfCode *line, int startStat, int endStat,
         qspSetError(QSP_ERR_COLONNOTFOUND);
         return QSP_FALSE;
     }
-    elseStat = 0;
-    c = 1;
-    for (i = startStat + 1; i < endStat; ++i)
-    {
-        switch (statements[i].Stat)
-        {
-        case qspStatIf:
-            QSP_INC_POSITIVE(c);
-            break;
-        case qspStatElse:
-        case qspStatElseIf:
-            QSP_DEC_POSITIVE(c);
-            break;
-        }
-        if (!c)
-        {
-            elseStat = i;
-            break;
-        }
-    }
+    elseStat = statements[startStat].ElseStat;
+    if (elseStat >= endStat) elseStat = 0; /* it lies outside of the current range */
     if (elseStat)
     {
         if (elseStat == startStat + 1) /* no code between IF and ELSE */
@@ -790,7 +804,7 @@ INLINE QSP_BOOL qspStatementIf(QSPLineOfCode *line, int startStat, int endStat,
         return QSP_FALSE;
     }
     oldLocationState = qspLocationState;
-    condition = qspCheckCondition(qspStringFromPair(line->Str.Str + statements[startStat].ParamPos, endPos));
+    condition = qspCheckCondition(line->Str, statements + startStat);
     if (qspLocationState != oldLocationState) return QSP_FALSE;
     if (condition)
     {
@@ -804,17 +818,34 @@ INLINE QSP_BOOL qspStatementIf(QSPLineOfCode *line, int startStat, int endStat,
     return QSP_FALSE;
 }
 
-INLINE QSP_BOOL qspPrepareLoop(QSPString loopHeader, QSPMathExpression *condition, QSPLineOfCode *iteratorLine, QSPString *jumpTo)
+INLINE QSP_BOOL qspStatsHaveLocals(QSPCachedStat *stats, int count)
+{
+    /* Nested blocks have their own scopes, but we don't need the exact answer here */
+    for (; count > 0; --count, ++stats)
+        if (stats->Stat == qspStatLocal) return QSP_TRUE;
+    return QSP_FALSE;
+}
+
+INLINE QSP_BOOL qspLinesHaveLocals(QSPLineOfCode *lines, int count)
+{
+    for (; count > 0; --count, ++lines)
+        if (qspStatsHaveLocals(lines->Stats, lines->StatsCount)) return QSP_TRUE;
+    return QSP_FALSE;
+}
+
+INLINE QSPLoopHeader *qspGetLoopHeader(QSPString loopHeader, QSPCachedStat *stat)
 {
     QSPString conditionStr, iteratorStr;
-    QSPLineOfCode initializatorLine;
+    QSPMathExpression condition;
+    QSPLoopHeader *header;
     QSP_CHAR *whilePos, *stepPos;
+    if (stat->LoopHeader) return stat->LoopHeader;
     /* Extract loop parameters */
     whilePos = qspKeywordPos(loopHeader, QSP_STATIC_STR(QSP_STATLOOPWHILE), QSP_TRUE);
     if (!whilePos)
     {
         qspSetError(QSP_ERR_LOOPWHILENOTFOUND);
-        return QSP_FALSE;
+        return 0;
     }
     stepPos = qspKeywordPos(qspStringFromPair(whilePos + QSP_STATIC_LEN(QSP_STATLOOPWHILE), loopHeader.End), QSP_STATIC_STR(QSP_STATLOOPSTEP), QSP_TRUE);
     if (stepPos)
@@ -827,39 +858,47 @@ INLINE QSP_BOOL qspPrepareLoop(QSPString loopHeader, QSPMathExpression *conditio
         conditionStr = qspStringFromPair(whilePos + QSP_STATIC_LEN(QSP_STATLOOPWHILE), loopHeader.End);
         iteratorStr = qspNullString;
     }
-    if (!qspCompileMathExpression(conditionStr, condition))
-        return QSP_FALSE;
+    if (!qspCompileMathExpression(conditionStr, &condition))
+        return 0;
 
-    qspInitLineOfCode(iteratorLine, iteratorStr, 0);
-    if (stepPos && !iteratorLine->StatsCount)
+    header = (QSPLoopHeader *)malloc(sizeof(QSPLoopHeader));
+    qspInitLineOfCode(&header->StepLine, iteratorStr, 0);
+    if (stepPos && !header->StepLine.StatsCount)
     {
         qspSetError(QSP_ERR_CODENOTFOUND);
-        qspFreeMathExpression(condition);
-        qspFreeLineOfCode(iteratorLine);
-        return QSP_FALSE;
+        qspFreeMathExpression(&condition);
+        qspFreeLineOfCode(&header->StepLine);
+        free(header);
+        return 0;
     }
+    qspInitLineOfCode(&header->InitLine, qspStringFromPair(loopHeader.Str, whilePos), 0);
+    header->Condition = condition;
+    header->HasLocals = -1;
+    /* The header stays valid as long as the line of code */
+    stat->LoopHeader = header;
+    ++qspPrepCompilationsCount;
+    return header;
+}
+
+INLINE QSP_BOOL qspPrepareLoop(QSPString loopHeader, QSPCachedStat *stat, QSPLoopHeader **header, QSPString *jumpTo)
+{
+    QSPLoopHeader *loop = qspGetLoopHeader(loopHeader, stat);
+    *header = loop;
+    if (!loop) return QSP_FALSE;
     /* Execute loop initialization */
-    qspInitLineOfCode(&initializatorLine, qspStringFromPair(loopHeader.Str, whilePos), 0);
-    if (initializatorLine.StatsCount)
-    {
-        int oldLocationState = qspLocationState;
-        QSP_BOOL toExit = qspExecString(&initializatorLine, 0, initializatorLine.StatsCount, jumpTo);
-        if (toExit || qspLocationState != oldLocationState)
-        {
-            qspFreeMathExpression(condition);
-            qspFreeLineOfCode(iteratorLine);
-            qspFreeLineOfCode(&initializatorLine);
-            return toExit;
-        }
-    }
-    qspFreeLineOfCode(&initializatorLine);
+    if (loop->InitLine.StatsCount)
+        return qspExecString(&loop->InitLine, 0, loop->InitLine.StatsCount, jumpTo);
     return QSP_FALSE;
 }
 
-INLINE QSP_BOOL qspCheckCondition(QSPString expr)
+INLINE QSP_BOOL qspCheckCondition(QSPString s, QSPCachedStat *stat)
 {
+    QSPVariant condValue;
     int oldLocationState = qspLocationState;
-    QSPVariant condValue = qspCalculateExprValue(expr);
+    if (stat->ArgsCount)
+        condValue = qspCalculateArgValue(s, stat->Args);
+    else /* let the parser report the missing condition */
+        condValue = qspCalculateExprValue(qspStringFromPair(s.Str + stat->ParamPos, s.Str + stat->EndPos));
     if (qspLocationState != oldLocationState) return QSP_FALSE;
     if (!qspConvertVariantTo(&condValue, QSP_TYPE_BOOL))
     {
@@ -873,7 +912,7 @@ INLINE QSP_BOOL qspCheckCondition(QSPString expr)
 INLINE QSP_BOOL qspCheckCompiledCondition(QSPMathExpression *expression)
 {
     int oldLocationState = qspLocationState;
-    QSPVariant condValue = qspCalculateValue(expression, expression->ItemsCount - 1);
+    QSPVariant condValue = qspCalculateValue(expression);
     if (qspLocationState != oldLocationState) return QSP_FALSE;
     if (!qspConvertVariantTo(&condValue, QSP_TYPE_BOOL))
     {
@@ -888,8 +927,7 @@ INLINE QSP_BOOL qspStatementSinglelineLoop(QSPLineOfCode *line, int startStat, i
 {
     QSP_BOOL toExit;
     int oldLocationState;
-    QSPLineOfCode iteratorLine;
-    QSPMathExpression condition;
+    QSPLoopHeader *header;
     QSP_CHAR *endPos = line->Str.Str + line->Stats[startStat].EndPos;
     if (!qspIsCharAtPos(line->Str, endPos, QSP_COLONDELIM_CHAR))
     {
@@ -904,46 +942,34 @@ INLINE QSP_BOOL qspStatementSinglelineLoop(QSPLineOfCode *line, int startStat, i
     qspAllocateLocalScope();
 
     oldLocationState = qspLocationState;
-    toExit = qspPrepareLoop(qspStringFromPair(line->Str.Str + line->Stats[startStat].ParamPos, endPos), &condition, &iteratorLine, jumpTo);
+    toExit = qspPrepareLoop(qspStringFromPair(line->Str.Str + line->Stats[startStat].ParamPos, endPos), line->Stats + startStat, &header, jumpTo);
     if (qspLocationState != oldLocationState) return QSP_FALSE;
     if (!toExit)
     {
         QSP_BOOL conditionValue;
+        if (header->HasLocals < 0)
+            header->HasLocals = qspStatsHaveLocals(line->Stats + startStat + 1, endStat - startStat - 1);
         while (1)
         {
             /* Check condition */
-            conditionValue = qspCheckCompiledCondition(&condition);
-            if (qspLocationState != oldLocationState)
-            {
-                qspFreeMathExpression(&condition);
-                qspFreeLineOfCode(&iteratorLine);
-                return QSP_FALSE;
-            }
+            conditionValue = qspCheckCompiledCondition(&header->Condition);
+            if (qspLocationState != oldLocationState) return QSP_FALSE;
             if (!conditionValue) break;
             /* Execute body */
-            toExit = qspExecStringWithLocals(line, startStat + 1, endStat, jumpTo);
-            if (qspLocationState != oldLocationState)
-            {
-                qspFreeMathExpression(&condition);
-                qspFreeLineOfCode(&iteratorLine);
-                return QSP_FALSE;
-            }
+            if (header->HasLocals)
+                toExit = qspExecStringWithLocals(line, startStat + 1, endStat, jumpTo);
+            else /* the body doesn't need its own scope */
+                toExit = qspExecString(line, startStat + 1, endStat, jumpTo);
+            if (qspLocationState != oldLocationState) return QSP_FALSE;
             if (toExit) break;
             /* Execute iterator */
-            if (iteratorLine.StatsCount)
+            if (header->StepLine.StatsCount)
             {
-                toExit = qspExecStringWithLocals(&iteratorLine, 0, iteratorLine.StatsCount, jumpTo);
-                if (qspLocationState != oldLocationState)
-                {
-                    qspFreeMathExpression(&condition);
-                    qspFreeLineOfCode(&iteratorLine);
-                    return QSP_FALSE;
-                }
+                toExit = qspExecString(&header->StepLine, 0, header->StepLine.StatsCount, jumpTo);
+                if (qspLocationState != oldLocationState) return QSP_FALSE;
                 if (toExit) break;
             }
         }
-        qspFreeMathExpression(&condition);
-        qspFreeLineOfCode(&iteratorLine);
     }
     qspReleaseLastLocalScope();
     return toExit;
@@ -954,18 +980,19 @@ INLINE QSP_BOOL qspStatementMultilineLoop(QSPLineOfCode *lines, int lineInd, int
 {
     QSP_BOOL toExit;
     int oldLocationState;
-    QSPLineOfCode iteratorLine;
-    QSPMathExpression condition;
+    QSPLoopHeader *header;
     QSPLineOfCode *line = lines + lineInd;
     qspAllocateLocalScope();
 
     oldLocationState = qspLocationState;
-    toExit = qspPrepareLoop(qspStringFromPair(line->Str.Str + line->Stats->ParamPos, line->Str.Str + line->Stats->EndPos), &condition, &iteratorLine, jumpTo);
+    toExit = qspPrepareLoop(qspStringFromPair(line->Str.Str + line->Stats->ParamPos, line->Str.Str + line->Stats->EndPos), line->Stats, &header, jumpTo);
     if (qspLocationState != oldLocationState) return QSP_FALSE;
     if (!toExit)
     {
         QSP_BOOL conditionValue;
         ++lineInd;
+        if (header->HasLocals < 0)
+            header->HasLocals = qspLinesHaveLocals(lines + lineInd, endLine - lineInd);
         while (1)
         {
             qspRealLine = line;
@@ -975,34 +1002,22 @@ INLINE QSP_BOOL qspStatementMultilineLoop(QSPLineOfCode *lines, int lineInd, int
                 if (qspIsDebug)
                 {
                     qspCallDebug(line->Str);
-                    if (qspLocationState != oldLocationState)
-                    {
-                        qspFreeMathExpression(&condition);
-                        qspFreeLineOfCode(&iteratorLine);
-                        return QSP_FALSE;
-                    }
+                    if (qspLocationState != oldLocationState) return QSP_FALSE;
                 }
             }
             /* Check condition */
-            conditionValue = qspCheckCompiledCondition(&condition);
-            if (qspLocationState != oldLocationState)
-            {
-                qspFreeMathExpression(&condition);
-                qspFreeLineOfCode(&iteratorLine);
-                return QSP_FALSE;
-            }
+            conditionValue = qspCheckCompiledCondition(&header->Condition);
+            if (qspLocationState != oldLocationState) return QSP_FALSE;
             if (!conditionValue) break;
             /* Execute body */
-            toExit = qspExecCodeBlockWithLocals(lines, lineInd, endLine, codeOffset, jumpTo);
-            if (qspLocationState != oldLocationState)
-            {
-                qspFreeMathExpression(&condition);
-                qspFreeLineOfCode(&iteratorLine);
-                return QSP_FALSE;
-            }
+            if (header->HasLocals)
+                toExit = qspExecCodeBlockWithLocals(lines, lineInd, endLine, codeOffset, jumpTo);
+            else /* the body doesn't need its own scope */
+                toExit = qspExecCode(lines, lineInd, endLine, codeOffset, jumpTo);
+            if (qspLocationState != oldLocationState) return QSP_FALSE;
             if (toExit) break;
             /* Execute iterator */
-            if (iteratorLine.StatsCount)
+            if (header->StepLine.StatsCount)
             {
                 qspRealLine = line;
                 if (codeOffset > 0)
@@ -1011,26 +1026,14 @@ INLINE QSP_BOOL qspStatementMultilineLoop(QSPLineOfCode *lines, int lineInd, int
                     if (qspIsDebug)
                     {
                         qspCallDebug(line->Str);
-                        if (qspLocationState != oldLocationState)
-                        {
-                            qspFreeMathExpression(&condition);
-                            qspFreeLineOfCode(&iteratorLine);
-                            return QSP_FALSE;
-                        }
+                        if (qspLocationState != oldLocationState) return QSP_FALSE;
                     }
                 }
-                toExit = qspExecStringWithLocals(&iteratorLine, 0, iteratorLine.StatsCount, jumpTo);
-                if (qspLocationState != oldLocationState)
-                {
-                    qspFreeMathExpression(&condition);
-                    qspFreeLineOfCode(&iteratorLine);
-                    return QSP_FALSE;
-                }
+                toExit = qspExecString(&header->StepLine, 0, header->StepLine.StatsCount, jumpTo);
+                if (qspLocationState != oldLocationState) return QSP_FALSE;
                 if (toExit) break;
             }
         }
-        qspFreeMathExpression(&condition);
-        qspFreeLineOfCode(&iteratorLine);
     }
     qspReleaseLastLocalScope();
     return toExit;
@@ -1046,7 +1049,7 @@ INLINE void qspStatementUserCall(QSPString s, QSPCachedStat *stat)
         qspReleaseMemory(args);
         return;
     }
-    qspExecLocByNameWithArgs(QSP_STR(args[0]), args + 1, argsCount - 1, QSP_TRUE, 0);
+    qspExecLocByIndexWithArgs(qspCachedLocIndex(QSP_STR(args[0])), args + 1, argsCount - 1, QSP_TRUE, 0);
     qspFreeVariants(args, argsCount);
     qspReleaseMemory(args);
 }
@@ -1150,12 +1153,12 @@ INLINE void qspStatementClear(QSPVariant *QSP_UNUSED(args), QSP_TINYINT QSP_UNUS
 
 INLINE void qspStatementGoSub(QSPVariant *args, QSP_TINYINT count, QSP_TINYINT QSP_UNUSED(extArg))
 {
-    qspExecLocByNameWithArgs(QSP_STR(args[0]), args + 1, count - 1, QSP_TRUE, 0);
+    qspExecLocByIndexWithArgs(qspCachedLocIndex(QSP_STR(args[0])), args + 1, count - 1, QSP_TRUE, 0);
 }
 
 INLINE void qspStatementGoTo(QSPVariant *args, QSP_TINYINT count, QSP_TINYINT extArg)
 {
-    int locInd = qspLocIndex(QSP_STR(args[0]));
+    int locInd = qspCachedLocIndex(QSP_STR(args[0]));
     if (locInd < 0)
     {
         qspSetError(QSP_ERR_LOCNOTFOUND);
@@ -14,6 +14,12 @@
 
 QSPString qspNullString;
 unsigned char qspAsciiClasses[128];
+QSPMemoryPool qspTextPools[QSP_TEXTPOOLS] =
+{
+    { (int)(QSP_TEXTHEADERSIZE + QSP_TEXTPOOLCAPACITY(0) * sizeof(QSP_CHAR)), 0, 0, 0, 0, 0 },
+    { (int)(QSP_TEXTHEADERSIZE + QSP_TEXTPOOLCAPACITY(1) * sizeof(QSP_CHAR)), 0, 0, 0, 0, 0 },
+    { (int)(QSP_TEXTHEADERSIZE + QSP_TEXTPOOLCAPACITY(2) * sizeof(QSP_CHAR)), 0, 0, 0, 0, 0 }
+};
 
 INLINE void qspFillSymbolClass(unsigned char symbolClass, QSP_CHAR *symbols)
 {
@@ -39,12 +45,19 @@ void qspInitSymbolClasses(void)
     qspFillSymbolClass(QSP_CHAR_TYPEPREFIX, QSP_TUPLETYPE QSP_NUMTYPE QSP_STRTYPE);
 }
 
+void qspTerminateTextPools(void)
+{
+    int i;
+    for (i = 0; i < QSP_TEXTPOOLS; ++i)
+        qspTerminateMemoryPool(qspTextPools + i);
+}
+
 QSP_CHAR *qspStringToC(QSPString s)
 {
     QSP_CHAR *string;
     int stringLen = qspStrLen(s);
     string = (QSP_CHAR *)malloc((stringLen + 1) * sizeof(QSP_CHAR));
-    memcpy(string, s.Str, stringLen * sizeof(QSP_CHAR));
+    if (stringLen) memcpy(string, s.Str, stringLen * sizeof(QSP_CHAR));
     string[stringLen] = 0;
     return string;
 }
@@ -55,7 +68,7 @@ QSPString qspConcatText(QSPString val1, QSPString val2)
     int firstLen = qspStrLen(val1), secondLen = qspStrLen(val2), destLen = firstLen + secondLen;
     if (destLen)
     {
-        QSP_CHAR *dest = (QSP_CHAR *)malloc(destLen * sizeof(QSP_CHAR));
+        QSP_CHAR *dest = qspAllocateText(destLen);
         if (firstLen)
             memcpy(dest, val1.Str, firstLen * sizeof(QSP_CHAR));
         if (secondLen)
@@ -6,6 +6,7 @@
  */
 
 #include "declarations.h"
+#include "memory.h"
 
 #ifndef QSP_TEXTDEFINES
     #define QSP_TEXTDEFINES
@@ -13,6 +14,12 @@
     #define QSP_STRSDELIM QSP_FMT("\r\n")
     #define QSP_LSUBEX QSP_FMT("<<")
     #define QSP_RSUBEX QSP_FMT(">>")
+    #define QSP_TEXTREFCOUNT(text) ((int *)(text) - 1) /* allocated texts keep the reference counter before the characters */
+    #define QSP_TEXTPOOLINDEX(text) ((int *)(text) - 2) /* and the index of the pool, texts allocated on the heap keep their negated capacity here */
+    #define QSP_TEXTHEADERSIZE (2 * sizeof(int))
+    #define QSP_TEXTPOOLS 3 /* short texts are allocated from pools of 8, 16, and 32 characters */
+    #define QSP_TEXTPOOLMINCAPACITY 8
+    #define QSP_TEXTPOOLCAPACITY(index) (QSP_TEXTPOOLMINCAPACITY << (index))
 
     /* Frequently used classes of characters */
     enum
@@ -36,9 +43,11 @@
 
     extern QSPString qspNullString;
     extern unsigned char qspAsciiClasses[128];
+    extern QSPMemoryPool qspTextPools[QSP_TEXTPOOLS];
 
     /* External functions */
     void qspInitSymbolClasses(void);
+    void qspTerminateTextPools(void);
     QSP_CHAR *qspStringToC(QSPString s);
     QSPString qspConcatText(QSPString val1, QSPString val2);
     QSPString qspJoinStrs(QSPString *s, int count, QSPString delim);
@@ -105,21 +114,84 @@
         return (s.Str == s.End);
     }
 
+    INLINE int qspGetTextPoolIndex(int len)
+    {
+        if (len <= QSP_TEXTPOOLCAPACITY(0)) return 0;
+        if (len <= QSP_TEXTPOOLCAPACITY(1)) return 1;
+        if (len <= QSP_TEXTPOOLCAPACITY(2)) return 2;
+        return -1;
+    }
+
+    INLINE QSP_CHAR *qspAllocateText(int len)
+    {
+        /* Every text we own is allocated here, so it can be shared */
+        int *header, poolIndex = qspGetTextPoolIndex(len);
+        if (poolIndex >= 0)
+            header = (int *)qspAllocatePoolBlock(qspTextPools + poolIndex);
+        else
+        {
+            header = (int *)malloc(QSP_TEXTHEADERSIZE + len * sizeof(QSP_CHAR));
+            poolIndex = -len; /* longer than any pooled text, so it's always negative */
+        }
+        header[0] = poolIndex;
+        header[1] = 1; /* reference counter */
+        return (QSP_CHAR *)(header + 2);
+    }
+
+    INLINE QSP_CHAR *qspReallocateText(QSP_CHAR *text, int len)
+    {
+        /* The text must not be shared */
+        int *header, poolIndex = *QSP_TEXTPOOLINDEX(text);
+        if (poolIndex >= 0)
+        {
+            QSP_CHAR *newText;
+            int capacity = QSP_TEXTPOOLCAPACITY(poolIndex);
+            if (len <= capacity) return text;
+            newText = qspAllocateText(len);
+            memcpy(newText, text, capacity * sizeof(QSP_CHAR));
+            qspReleasePoolBlock(qspTextPools + poolIndex, QSP_TEXTPOOLINDEX(text));
+            return newText;
+        }
+        if (len <= -poolIndex) return text;
+        header = (int *)realloc(QSP_TEXTPOOLINDEX(text), QSP_TEXTHEADERSIZE + len * sizeof(QSP_CHAR));
+        header[0] = -len;
+        return (QSP_CHAR *)(header + 2);
+    }
+
+    INLINE int qspGetTextCapacity(QSP_CHAR *text)
+    {
+        int poolIndex = *QSP_TEXTPOOLINDEX(text);
+        return (poolIndex >= 0 ? QSP_TEXTPOOLCAPACITY(poolIndex) : -poolIndex);
+    }
+
+    INLINE void qspReleaseText(QSP_CHAR *text)
+    {
+        int *refCount = QSP_TEXTREFCOUNT(text);
+        if (!--(*refCount))
+        {
+            int poolIndex = *QSP_TEXTPOOLINDEX(text);
+            if (poolIndex >= 0)
+                qspReleasePoolBlock(qspTextPools + poolIndex, QSP_TEXTPOOLINDEX(text));
+            else
+                free(QSP_TEXTPOOLINDEX(text));
+        }
+    }
+
     INLINE void qspFreeString(QSPString *s)
     {
-        if (s->Str) free(s->Str);
+        if (s->Str) qspReleaseText(s->Str);
     }
 
     INLINE void qspFreeNewString(QSPString *strToRelease, QSPString *strToKeep)
     {
-        if (strToRelease->Str && strToRelease->Str != strToKeep->Str) free(strToRelease->Str);
+        if (strToRelease->Str && strToRelease->Str != strToKeep->Str) qspReleaseText(strToRelease->Str);
     }
 
     INLINE void qspClearText(QSPString *s)
     {
         if (s->Str)
         {
-            free(s->Str);
+            qspReleaseText(s->Str);
             s->Str = s->End = 0; /* assign the null string */
         }
     }
@@ -130,7 +202,7 @@
         if (strLen)
         {
             QSPString string;
-            QSP_CHAR *destPtr = (QSP_CHAR *)malloc(strLen * sizeof(QSP_CHAR));
+            QSP_CHAR *destPtr = qspAllocateText(strLen);
             memcpy(destPtr, s.Str, strLen * sizeof(QSP_CHAR));
             string.Str = destPtr;
             string.End = destPtr + strLen;
@@ -145,6 +217,28 @@
         *dest = qspCopyToNewText(val);
     }
 
+    INLINE void qspAppendToText(QSPString *dest, QSPString val)
+    {
+        int destLen, newLen, valLen = qspStrLen(val);
+        if (!valLen) return;
+        if (dest->Str && *QSP_TEXTREFCOUNT(dest->Str) == 1)
+        {
+            /* We own the text, so it can grow in place, spare capacity makes repeated appends cheap */
+            destLen = qspStrLen(*dest);
+            newLen = destLen + valLen;
+            if (newLen > qspGetTextCapacity(dest->Str))
+                dest->Str = qspReallocateText(dest->Str, newLen + newLen / 2);
+            memcpy(dest->Str + destLen, val.Str, valLen * sizeof(QSP_CHAR));
+            dest->End = dest->Str + newLen;
+        }
+        else
+        {
+            QSPString res = qspConcatText(*dest, val);
+            qspFreeString(dest);
+            *dest = res;
+        }
+    }
+
     INLINE QSPString qspMoveToNewText(QSPString *s)
     {
         QSPString string = *s;
@@ -152,6 +246,24 @@
         return string;
     }
 
+    INLINE QSPString qspShareText(QSPString s)
+    {
+        /* Works with allocated texts only, we don't copy characters here */
+        if (s.Str) ++(*QSP_TEXTREFCOUNT(s.Str));
+        return s;
+    }
+
+    INLINE void qspUnshareText(QSPString *s)
+    {
+        /* Shared texts have to be copied before we modify them in place */
+        if (s->Str && *QSP_TEXTREFCOUNT(s->Str) > 1)
+        {
+            QSP_CHAR *sharedText = s->Str;
+            *s = qspCopyToNewText(*s);
+            qspReleaseText(sharedText);
+        }
+    }
+
     INLINE QSP_BOOL qspIsCharAtPos(QSPString str, QSP_CHAR *pos, QSP_CHAR ch)
     {
         return (pos < str.End && *pos == ch);
@@ -223,6 +335,16 @@
         return (pos2 == end2) ? 0 : -1;
     }
 
+    INLINE unsigned int qspStrHash(QSPString s)
+    {
+        /* Every character counts as a whole, so non-Latin texts get spread evenly too */
+        QSP_CHAR *pos;
+        unsigned int hash = 7;
+        for (pos = s.Str; pos < s.End; ++pos)
+            hash = hash * 31 + (unsigned int)*pos;
+        return hash;
+    }
+
     INLINE QSP_BOOL qspStrsEqual(QSPString str1, QSPString str2)
     {
         int len1 = qspStrLen(str1);
@@ -314,7 +436,7 @@
         if (initialCapacity)
         {
             res.Capacity = initialCapacity;
-            res.Str = (QSP_CHAR *)malloc(res.Capacity * sizeof(QSP_CHAR));
+            res.Str = qspAllocateText(res.Capacity);
         }
         else
         {
@@ -350,7 +472,7 @@
 
     INLINE void qspFreeBufString(QSPBufString *buf)
     {
-        if (buf->Str) free(buf->Str);
+        if (buf->Str) qspReleaseText(buf->Str);
     }
 
     INLINE QSP_BOOL qspAddBufText(QSPBufString *dest, QSPString val)
@@ -363,7 +485,7 @@
                 if (dest->Len + valLen > dest->Capacity)
                 {
                     dest->Capacity = dest->Len + valLen + dest->CapacityIncrement;
-                    dest->Str = (QSP_CHAR *)realloc(dest->Str, dest->Capacity * sizeof(QSP_CHAR));
+                    dest->Str = qspReallocateText(dest->Str, dest->Capacity);
                 }
                 memcpy(dest->Str + dest->Len, val.Str, valLen * sizeof(QSP_CHAR));
                 dest->Len += valLen;
@@ -371,7 +493,7 @@
             else
             {
                 dest->Capacity = valLen + dest->CapacityIncrement;
-                dest->Str = (QSP_CHAR *)malloc(dest->Capacity * sizeof(QSP_CHAR));
+                dest->Str = qspAllocateText(dest->Capacity);
                 memcpy(dest->Str, val.Str, valLen * sizeof(QSP_CHAR));
                 dest->Len = valLen;
             }
@@ -387,7 +509,7 @@
             if (dest->Len + QSP_CHAR_LEN > dest->Capacity)
             {
                 dest->Capacity = dest->Len + QSP_CHAR_LEN + dest->CapacityIncrement;
-                dest->Str = (QSP_CHAR *)realloc(dest->Str, dest->Capacity * sizeof(QSP_CHAR));
+                dest->Str = qspReallocateText(dest->Str, dest->Capacity);
             }
             dest->Str[dest->Len] = ch;
             dest->Len += QSP_CHAR_LEN;
@@ -395,7 +517,7 @@
         else
         {
             dest->Capacity = QSP_CHAR_LEN + dest->CapacityIncrement;
-            dest->Str = (QSP_CHAR *)malloc(dest->Capacity * sizeof(QSP_CHAR));
+            dest->Str = qspAllocateText(dest->Capacity);
             dest->Str[0] = ch;
             dest->Len = QSP_CHAR_LEN;
         }
@@ -405,7 +527,7 @@
     {
         if (s->Str)
         {
-            free(s->Str);
+            qspReleaseText(s->Str);
             s->Str = 0;
             s->Len = 0;
             s->Capacity = 0;
@@ -12,38 +12,69 @@
 #include "errors.h"
 #include "locations.h"
 #include "mathops.h"
+#include "memory.h"
 #include "regexp.h"
 
 QSPVar qspNullVar;
 QSPVarsScope qspGlobalVars;
 QSPVarsScopeChunk *qspCurrentLocalVars = 0;
 
+QSPVarName *qspVarNames = 0;
+int qspVarNamesCount = 0;
+int qspVarNamesCapacity = 0;
+int *qspVarNamesEntries = 0; /* open addressing table of name ids, its capacity is always a power of 2 */
+int qspVarNamesEntriesCapacity = 0;
+unsigned int qspGlobalVarsGeneration = 0; /* gets changed when global variables get removed */
+int qspArgsVarNameId = -1;
+int qspResultVarNameId = -1;
+
 QSP_TINYINT qspSpecToBaseTypeTable[128];
 
-INLINE int qspIndStringCompare(const void *name, const void *compareTo);
-INLINE int qspIndStringFloorCompare(const void *name, const void *compareTo);
+INLINE int qspIndStringsCompare(const void *ind1, const void *ind2);
 INLINE int qspValuePositionsAscCompare(const void *arg1, const void *arg2);
 INLINE int qspValuePositionsDescCompare(const void *arg1, const void *arg2);
-INLINE unsigned int qspGetNameHash(QSPString name);
-INLINE QSPVar *qspCreateNewVar(QSPVarsBucket *bucket, QSPString name, int capacityIncrement);
-INLINE QSPVar *qspGetVar(QSPVarsBucket *bucket, QSPString name);
-INLINE QSPVar *qspAddVarToLocals(QSPString name);
-INLINE QSPVar *qspAddSpecialVarToScope(QSPVarsScope *scope, QSPString name);
+INLINE QSP_BOOL qspPrepareVarName(QSPString *name);
+INLINE void qspExpandVarNamesEntries(void);
+INLINE int qspFindVarNameId(QSPString name, unsigned int nameHash, QSP_BOOL toCreate);
+INLINE void qspBindLocalVar(QSPVar *var, int nameId);
+INLINE void qspUnbindLocalVar(QSPVar *var);
+INLINE void qspBindLocalVarsScopes(QSPVarsScopeChunk *chunk);
+INLINE void qspUnbindLocalVarsScopes(QSPVarsScopeChunk *chunk);
+INLINE void qspExpandVarsEntries(QSPVarsScope *scope);
+INLINE QSPVar *qspCreateNewVar(QSPVarsScope *scope, QSPString name, unsigned int nameHash);
+INLINE QSPVar *qspGetVar(QSPVarsScope *scope, QSPString name, unsigned int nameHash);
+INLINE QSPVar *qspAddVarToLocals(QSPString name, int nameId);
+INLINE void qspInitFrameVar(QSPVar *var, int nameId);
 INLINE void qspSetVarValuesByReference(QSPVar *var, QSPVariant *vals, int count, QSP_BOOL toMove);
+INLINE QSPVarIndex *qspGetVarIndexItem(QSPVar *var, QSPString str, unsigned int strHash);
+INLINE unsigned int qspPrepareIndexStrKey(QSP_CHAR *buf, QSPString str);
+INLINE void qspAddVarIndexItem(QSPVar *var, QSPString str, unsigned int strHash, int index);
+INLINE void qspExpandVarBlocks(QSPVar *var, int ind);
+INLINE QSPVariant *qspAllocateDenseVarItem(QSPVar *var, int ind);
+INLINE QSPVariant *qspAllocateSparseVarItem(QSPVar *var, int ind);
+INLINE void qspConvertVarToSparse(QSPVar *var);
+INLINE void qspConvertVarToDense(QSPVar *var);
 INLINE void qspRemoveArrayItem(QSPVar *var, int index);
-INLINE QSPVar *qspGetVarData(QSPString s, int *index, QSP_BOOL isSetOperation);
+INLINE QSPVar *qspVarReferenceWithId(QSPString name, int nameId, QSP_BOOL toCreate);
+INLINE QSPVar *qspGetVarData(QSPString s, int nameId, int *index, QSP_BOOL isSetOperation);
 INLINE QSP_BOOL qspGetVarValueByReference(QSPVar *var, int ind, QSP_TINYINT baseType, QSPVariant *res);
-INLINE void qspResetVar(QSPString varName);
+INLINE QSPVar *qspGetTargetVarData(QSPString s, QSPAssignTarget *target, int *index);
+INLINE void qspResetVar(QSPString s, QSPAssignTarget *target);
 INLINE void qspSetVarValueByReference(QSPVar *var, int ind, QSP_TINYINT baseType, QSPVariant *val);
 INLINE void qspSetVarValueByIndex(QSPString varName, QSPVariant index, QSPVariant *val);
 INLINE void qspSetFirstVarValue(QSPString varName, QSPVariant *val);
-INLINE void qspSetVarValue(QSPString varName, QSPVariant *val, QSP_CHAR op);
+INLINE void qspSetVarValue(QSPString s, QSPAssignTarget *target, QSPVariant *val, QSP_CHAR op);
 INLINE void qspMoveTupleToArray(QSPVar *dest, QSPTuple *src, int start, int count);
 INLINE void qspCopyArray(QSPVar *dest, QSPVar *src, int start, int count);
+INLINE void qspSortNumArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending);
+INLINE int qspSortStrItemsCompare(QSPSortStrItem *item1, QSPSortStrItem *item2, QSPVariant *values, int prefixStart);
+INLINE void qspSortStrArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending);
+INLINE void qspSortArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending);
+INLINE void qspReorderArrayItems(QSPVar *var, int *order);
 INLINE void qspSortArray(QSPVar *var, QSP_TINYINT baseValType, QSP_BOOL isAscending);
 INLINE int qspGetVarsNames(QSPString str, QSPString *varNames, int maxNames);
-INLINE void qspSetVarsValues(QSPString *varNames, int varsCount, QSPVariant *v, QSP_CHAR op);
-INLINE QSPString qspGetVarNameOnly(QSPString s);
+INLINE int qspGetRawTargets(QSPString s, QSPCachedArg *namesArg, QSPAssignTarget *targets);
+INLINE void qspSetVarsValues(QSPString s, QSPAssignTarget *targets, int varsCount, QSPVariant *v, QSP_CHAR op);
 
 void qspInitVarTypes(void)
 {
@@ -56,41 +87,181 @@ void qspInitVarTypes(void)
     qspSpecToBaseTypeTable[QSP_TUPLETYPE_CHAR] = QSP_TYPE_TUPLE;
 }
 
-INLINE int qspIndStringCompare(const void *name, const void *compareTo)
+void qspInitVarNames(void)
+{
+    int i;
+    qspVarNames = 0;
+    qspVarNamesCount = qspVarNamesCapacity = 0;
+    qspVarNamesEntriesCapacity = QSP_VARNAMESCAPACITY;
+    qspVarNamesEntries = (int *)malloc(qspVarNamesEntriesCapacity * sizeof(int));
+    for (i = 0; i < qspVarNamesEntriesCapacity; ++i)
+        qspVarNamesEntries[i] = -1;
+    /* Names of the variables of call frames */
+    qspArgsVarNameId = qspGetVarNameId(QSP_STATIC_STR(QSP_VARARGS));
+    qspResultVarNameId = qspGetVarNameId(QSP_STATIC_STR(QSP_VARRES));
+}
+
+void qspTerminateVarNames(void)
 {
-    return qspStrsCompare(*(QSPString *)name, ((QSPVarIndex *)compareTo)->Str);
+    int i;
+    for (i = 0; i < qspVarNamesCount; ++i)
+        qspFreeString(&qspVarNames[i].Name);
+    if (qspVarNames) free(qspVarNames);
+    free(qspVarNamesEntries);
+    qspVarNames = 0;
+    qspVarNamesEntries = 0;
+    qspVarNamesCount = qspVarNamesCapacity = qspVarNamesEntriesCapacity = 0;
 }
 
-INLINE int qspIndStringFloorCompare(const void *name, const void *compareTo)
+INLINE QSP_BOOL qspPrepareVarName(QSPString *name)
 {
-    QSPString key = *(QSPString *)name;
-    QSPVarIndex *item = (QSPVarIndex *)compareTo;
+    if (qspIsEmpty(*name)) return QSP_FALSE;
 
-    /* It's safe to check (item + 1) because the item never points to the last array item */
-    if (qspStrsCompare(key, (item + 1)->Str) < 0 && qspStrsCompare(key, item->Str) >= 0)
-        return 0;
+    /* Ignore type prefix */
+    if (qspIsInClass(*name->Str, QSP_CHAR_TYPEPREFIX))
+        name->Str++;
 
-    return qspStrsCompare(key, item->Str);
+    if (qspIsEmpty(*name) || qspIsInClass(*name->Str, QSP_CHAR_DIGIT) || qspStrCharClass(*name, QSP_CHAR_DELIM))
+        return QSP_FALSE;
+
+    return QSP_TRUE;
 }
 
-INLINE int qspValuePositionsAscCompare(const void *arg1, const void *arg2)
+INLINE void qspExpandVarNamesEntries(void)
 {
-    return qspVariantsCompare(*(QSPVariant **)arg1, *(QSPVariant **)arg2); /* base types of values should be the same */
+    int i, capacity;
+    unsigned int pos, mask;
+    capacity = qspVarNamesEntriesCapacity * 2;
+    mask = (unsigned int)capacity - 1;
+    free(qspVarNamesEntries);
+    qspVarNamesEntries = (int *)malloc(capacity * sizeof(int));
+    for (i = 0; i < capacity; ++i)
+        qspVarNamesEntries[i] = -1;
+    qspVarNamesEntriesCapacity = capacity;
+    /* Rebuild the table, all names are unique here */
+    for (i = 0; i < qspVarNamesCount; ++i)
+    {
+        pos = qspVarNames[i].Hash & mask;
+        while (qspVarNamesEntries[pos] >= 0)
+            pos = (pos + 1) & mask;
+        qspVarNamesEntries[pos] = i;
+    }
 }
 
-INLINE int qspValuePositionsDescCompare(const void *arg1, const void *arg2)
+INLINE int qspFindVarNameId(QSPString name, unsigned int nameHash, QSP_BOOL toCreate)
 {
-    return qspVariantsCompare(*(QSPVariant **)arg2, *(QSPVariant **)arg1); /* base types of values should be the same */
+    /* We expect the name to be validated already */
+    int nameId;
+    unsigned int pos, mask;
+    QSPVarName *varName;
+    /* Keep the load factor of the table below 1/2 */
+    if (qspVarNamesCount * 2 >= qspVarNamesEntriesCapacity)
+        qspExpandVarNamesEntries();
+    mask = (unsigned int)qspVarNamesEntriesCapacity - 1;
+    pos = nameHash & mask;
+    while ((nameId = qspVarNamesEntries[pos]) >= 0)
+    {
+        varName = qspVarNames + nameId;
+        if (varName->Hash == nameHash && qspStrsEqual(varName->Name, name)) return nameId;
+        pos = (pos + 1) & mask;
+    }
+    if (!toCreate) return -1;
+    /* Add a new name */
+    if (qspVarNamesCount >= qspVarNamesCapacity)
+    {
+        qspVarNamesCapacity = (qspVarNamesCapacity ? qspVarNamesCapacity * 2 : 64);
+        qspVarNames = (QSPVarName *)realloc(qspVarNames, qspVarNamesCapacity * sizeof(QSPVarName));
+    }
+    nameId = qspVarNamesCount++;
+    varName = qspVarNames + nameId;
+    varName->Name = qspCopyToNewText(name);
+    varName->Hash = nameHash;
+    varName->LocalVar = 0;
+    varName->GlobalVar = 0;
+    varName->GlobalVarGeneration = qspGlobalVarsGeneration - 1;
+    qspVarNamesEntries[pos] = nameId;
+    return nameId;
 }
 
-INLINE unsigned int qspGetNameHash(QSPString name)
+int qspGetVarNameId(QSPString name)
 {
-    QSP_CHAR *pos;
-    unsigned int nameHash = 7;
-    for (pos = name.Str; pos < name.End; ++pos)
-        nameHash = nameHash * 31 + (unsigned char)*pos;
+    /* Returns -1 for incorrect names, we don't report errors here */
+    if (!qspPrepareVarName(&name)) return -1;
+    return qspFindVarNameId(name, qspGetNameHash(name), QSP_TRUE);
+}
+
+INLINE void qspBindLocalVar(QSPVar *var, int nameId)
+{
+    /* The new variable hides the previous local variable with the same name */
+    QSPVarName *varName = qspVarNames + nameId;
+    var->NameId = nameId;
+    var->ShadowedVar = varName->LocalVar;
+    varName->LocalVar = var;
+}
+
+INLINE void qspUnbindLocalVar(QSPVar *var)
+{
+    /* Variables of hidden scopes aren't bound, so we skip them */
+    QSPVarName *varName = qspVarNames + var->NameId;
+    if (varName->LocalVar == var)
+        varName->LocalVar = var->ShadowedVar;
+}
+
+INLINE void qspBindLocalVarsScopes(QSPVarsScopeChunk *chunk)
+{
+    /* Bind variables in the order they were created, starting the outermost scope */
+    int i, j;
+    QSPVarsScope *scope;
+    if (!chunk) return;
+    qspBindLocalVarsScopes(chunk->ParentChunk);
+    scope = chunk->Slots;
+    for (i = chunk->SlotsCount; i > 0; --i, ++scope)
+    {
+        if (scope->IsCallFrame)
+        {
+            qspBindLocalVar(&scope->FrameArgs, qspArgsVarNameId);
+            qspBindLocalVar(&scope->FrameResult, qspResultVarNameId);
+        }
+        for (j = 0; j < scope->VarsCount; ++j)
+            qspBindLocalVar(scope->Vars[j], scope->Vars[j]->NameId);
+    }
+}
+
+INLINE void qspUnbindLocalVarsScopes(QSPVarsScopeChunk *chunk)
+{
+    /* Unbind variables in the reverse order, starting the innermost scope */
+    int i, j;
+    QSPVarsScope *scope;
+    while (chunk)
+    {
+        scope = chunk->Slots + chunk->SlotsCount - 1;
+        for (i = chunk->SlotsCount; i > 0; --i, --scope)
+        {
+            for (j = scope->VarsCount - 1; j >= 0; --j)
+                qspUnbindLocalVar(scope->Vars[j]);
+            if (scope->IsCallFrame)
+            {
+                qspUnbindLocalVar(&scope->FrameResult);
+                qspUnbindLocalVar(&scope->FrameArgs);
+            }
+        }
+        chunk = chunk->ParentChunk;
+    }
+}
 
-    return nameHash;
+INLINE int qspIndStringsCompare(const void *ind1, const void *ind2)
+{
+    return qspStrsCompare(((QSPVarIndex *)ind1)->Str, ((QSPVarIndex *)ind2)->Str);
+}
+
+INLINE int qspValuePositionsAscCompare(const void *arg1, const void *arg2)
+{
+    return qspVariantsCompare(*(QSPVariant **)arg1, *(QSPVariant **)arg2); /* base types of values should be the same */
+}
+
+INLINE int qspValuePositionsDescCompare(const void *arg1, const void *arg2)
+{
+    return qspVariantsCompare(*(QSPVariant **)arg2, *(QSPVariant **)arg1); /* base types of values should be the same */
 }
 
 QSPVarsScopeChunk *qspAllocateVarsScopeChunk(QSPVarsScopeChunk *parentChunk)
@@ -105,8 +276,11 @@ QSPVarsScopeChunk *qspAllocateVarsScopeChunk(QSPVarsScopeChunk *parentChunk)
     for (i = 0; i < QSP_VARSSCOPECHUNKSIZE; ++i, ++scope)
     {
         /* We don't initialize the allocated scopes */
-        scope->Buckets = 0;
-        scope->BucketsCount = 0;
+        scope->Entries = 0;
+        scope->EntriesCapacity = 0;
+        scope->Vars = 0;
+        scope->VarsCount = scope->VarsAllocated = scope->VarsCapacity = 0;
+        scope->IsCallFrame = QSP_FALSE;
     }
 
     return chunk;
@@ -121,52 +295,77 @@ void qspClearVarsScopeChunk(QSPVarsScopeChunk *chunk)
     free(chunk);
 }
 
-void qspInitVarsScope(QSPVarsScope *scope, int buckets)
+void qspInitVarsScope(QSPVarsScope *scope, int capacity)
 {
     int i;
-    QSPVarsBucket *bucket;
-    scope->BucketsCount = buckets;
-    bucket = scope->Buckets = (QSPVarsBucket *)malloc(scope->BucketsCount * sizeof(QSPVarsBucket));
-    for (i = scope->BucketsCount; i > 0; --i, ++bucket)
-    {
-        bucket->Vars = 0;
-        bucket->Capacity = bucket->VarsCount = 0;
-    }
+    QSPVarsEntry *entry;
+    scope->EntriesCapacity = capacity; /* has to be a power of 2 */
+    entry = scope->Entries = (QSPVarsEntry *)malloc(capacity * sizeof(QSPVarsEntry));
+    for (i = capacity; i > 0; --i, ++entry)
+        entry->Var = 0;
+    scope->Vars = 0;
+    scope->VarsCount = scope->VarsAllocated = scope->VarsCapacity = 0;
 }
 
 void qspClearVarsScope(QSPVarsScope *scope)
 {
     int i;
-    QSPVarsBucket *bucket = scope->Buckets;
-    if (bucket)
+    QSPVar **var = scope->Vars;
+    if (var)
     {
-        for (i = scope->BucketsCount; i > 0; --i, ++bucket)
-        {
-            if (bucket->Vars) free(bucket->Vars);
-        }
-        free(scope->Buckets);
+        /* Variables have been removed already, we release the allocated buffers */
+        for (i = scope->VarsAllocated; i > 0; --i, ++var)
+            free(*var);
+        free(scope->Vars);
     }
+    if (scope->Entries) free(scope->Entries);
 }
 
 void qspClearVars(QSPVarsScope *scope)
 {
-    /* Remove all variables & keep the buckets */
-    int i, j;
-    QSPVar *var;
-    QSPVarsBucket *bucket = scope->Buckets;
-    for (i = scope->BucketsCount; i > 0; --i, ++bucket)
+    /* Remove all variables & keep the allocated buffers */
+    int i;
+    QSPVar **var;
+    QSPVarsEntry *entry;
+    if (scope->VarsCount)
     {
-        var = bucket->Vars;
-        if (var)
+        QSP_BOOL isGlobalScope = (scope == &qspGlobalVars);
+        if (!isGlobalScope && scope->VarsCount * 4 <= scope->EntriesCapacity)
         {
-            /* Remove vars & keep the allocated vars buffer */
-            for (j = bucket->VarsCount; j > 0; --j, ++var)
+            /* A few local variables, it's cheaper to release their entries than to clear the whole table */
+            unsigned int pos, mask = (unsigned int)scope->EntriesCapacity - 1;
+            var = scope->Vars;
+            for (i = scope->VarsCount; i > 0; --i, ++var)
             {
-                qspFreeString(&var->Name);
-                qspEmptyVar(var);
+                pos = qspVarNames[(*var)->NameId].Hash & mask;
+                while (scope->Entries[pos].Var != *var)
+                    pos = (pos + 1) & mask;
+                scope->Entries[pos].Var = 0;
             }
-            bucket->VarsCount = 0;
         }
+        else
+        {
+            entry = scope->Entries;
+            for (i = scope->EntriesCapacity; i > 0; --i, ++entry)
+                entry->Var = 0;
+        }
+        var = scope->Vars;
+        for (i = scope->VarsCount; i > 0; --i, ++var)
+        {
+            if (!isGlobalScope) qspUnbindLocalVar(*var);
+            qspFreeString(&(*var)->Name);
+            qspEmptyVar(*var);
+        }
+        scope->VarsCount = 0;
+        if (isGlobalScope) ++qspGlobalVarsGeneration; /* resolved global variables can't be used anymore */
+    }
+    if (scope->IsCallFrame)
+    {
+        qspUnbindLocalVar(&scope->FrameResult);
+        qspEmptyVar(&scope->FrameResult);
+        qspUnbindLocalVar(&scope->FrameArgs);
+        qspEmptyVar(&scope->FrameArgs);
+        scope->IsCallFrame = QSP_FALSE;
     }
 }
 
@@ -177,8 +376,9 @@ void qspClearLocalVarsScopes(QSPVarsScopeChunk *chunk)
     QSPVarsScopeChunk *parentChunk;
     while (chunk)
     {
-        scope = chunk->Slots;
-        for (i = chunk->SlotsCount; i > 0; --i, ++scope)
+        /* Release scopes starting the innermost one */
+        scope = chunk->Slots + chunk->SlotsCount - 1;
+        for (i = chunk->SlotsCount; i > 0; --i, --scope)
             qspClearVars(scope);
 
         parentChunk = chunk->ParentChunk;
@@ -199,81 +399,119 @@ void qspClearAllVars(QSP_BOOL toInit)
     qspCurrentLocalVars = 0;
 }
 
-INLINE QSPVar *qspCreateNewVar(QSPVarsBucket *bucket, QSPString name, int capacityIncrement)
+INLINE void qspExpandVarsEntries(QSPVarsScope *scope)
+{
+    int i, capacity;
+    unsigned int pos, mask;
+    QSPVar **var;
+    QSPVarsEntry *entry;
+    capacity = scope->EntriesCapacity * 2;
+    mask = (unsigned int)capacity - 1;
+    free(scope->Entries);
+    entry = scope->Entries = (QSPVarsEntry *)malloc(capacity * sizeof(QSPVarsEntry));
+    for (i = capacity; i > 0; --i, ++entry)
+        entry->Var = 0;
+    scope->EntriesCapacity = capacity;
+    /* Rebuild the table, names of variables are unique here */
+    var = scope->Vars;
+    for (i = scope->VarsCount; i > 0; --i, ++var)
+    {
+        unsigned int nameHash = qspGetNameHash((*var)->Name);
+        pos = nameHash & mask;
+        while (scope->Entries[pos].Var)
+            pos = (pos + 1) & mask;
+        entry = scope->Entries + pos;
+        entry->Var = *var;
+        entry->Hash = nameHash;
+    }
+}
+
+INLINE QSPVar *qspCreateNewVar(QSPVarsScope *scope, QSPString name, unsigned int nameHash)
 {
     QSPVar *var;
-    if (bucket->VarsCount >= bucket->Capacity)
+    QSPVarsEntry *entry;
+    unsigned int pos, mask;
+    /* Keep the load factor of the table below 1/2 */
+    if (scope->VarsCount * 2 >= scope->EntriesCapacity)
+        qspExpandVarsEntries(scope);
+    if (scope->VarsCount >= scope->VarsAllocated)
     {
-        bucket->Capacity = bucket->VarsCount + capacityIncrement;
-        bucket->Vars = (QSPVar *)realloc(bucket->Vars, bucket->Capacity * sizeof(QSPVar));
+        if (scope->VarsAllocated >= scope->VarsCapacity)
+        {
+            scope->VarsCapacity = (scope->VarsCapacity ? scope->VarsCapacity * 2 : 8);
+            scope->Vars = (QSPVar **)realloc(scope->Vars, scope->VarsCapacity * sizeof(QSPVar *));
+        }
+        scope->Vars[scope->VarsAllocated++] = (QSPVar *)malloc(sizeof(QSPVar));
     }
-    var = bucket->Vars + bucket->VarsCount;
+    var = scope->Vars[scope->VarsCount++];
     var->Name = qspCopyToNewText(name);
+    var->NameId = -1;
+    var->ShadowedVar = 0;
     qspInitVarData(var);
-
-    bucket->VarsCount++;
+    /* Use the first free entry */
+    mask = (unsigned int)scope->EntriesCapacity - 1;
+    pos = nameHash & mask;
+    while (scope->Entries[pos].Var)
+        pos = (pos + 1) & mask;
+    entry = scope->Entries + pos;
+    entry->Var = var;
+    entry->Hash = nameHash;
     return var;
 }
 
-INLINE QSPVar *qspGetVar(QSPVarsBucket *bucket, QSPString name)
+INLINE QSPVar *qspGetVar(QSPVarsScope *scope, QSPString name, unsigned int nameHash)
 {
-    int i;
-    QSPVar *var = bucket->Vars;
-    for (i = bucket->VarsCount; i > 0; --i)
+    QSPVarsEntry *entry;
+    unsigned int mask = (unsigned int)scope->EntriesCapacity - 1;
+    unsigned int pos = nameHash & mask;
+    while ((entry = scope->Entries + pos)->Var)
     {
-        if (qspStrsEqual(var->Name, name)) return var;
-        ++var;
+        if (entry->Hash == nameHash && qspStrsEqual(entry->Var->Name, name)) return entry->Var;
+        pos = (pos + 1) & mask;
     }
     return 0;
 }
 
-INLINE QSPVar *qspAddVarToLocals(QSPString name)
+INLINE QSPVar *qspAddVarToLocals(QSPString name, int nameId)
 {
-    unsigned int nameHash;
     QSPVarsScope *scope;
-    QSPVarsBucket *bucket;
+    QSPVarName *varName;
     QSPVar *var;
-    if (qspIsEmpty(name))
+    if (nameId < 0)
     {
-        qspSetError(QSP_ERR_INCORRECTNAME);
-        return 0;
+        if (!qspPrepareVarName(&name))
+        {
+            qspSetError(QSP_ERR_INCORRECTNAME);
+            return 0;
+        }
+        nameId = qspFindVarNameId(name, qspGetNameHash(name), QSP_TRUE);
     }
+    varName = qspVarNames + nameId;
 
-    /* Ignore type prefix */
-    if (qspIsInClass(*name.Str, QSP_CHAR_TYPEPREFIX))
-        name.Str++;
-
-    if (qspIsEmpty(name) || qspIsInClass(*name.Str, QSP_CHAR_DIGIT) || qspStrCharClass(name, QSP_CHAR_DELIM))
+    scope = qspCurrentLocalVars->Slots + qspCurrentLocalVars->SlotsCount - 1;
+    if (scope->IsCallFrame)
     {
-        qspSetError(QSP_ERR_INCORRECTNAME);
-        return 0;
+        if (nameId == qspArgsVarNameId) return &scope->FrameArgs;
+        if (nameId == qspResultVarNameId) return &scope->FrameResult;
     }
-
-    nameHash = qspGetNameHash(name);
-    scope = qspCurrentLocalVars->Slots + qspCurrentLocalVars->SlotsCount - 1;
-    if (!scope->Buckets)
-        qspInitVarsScope(scope, QSP_VARSLOCALBUCKETS); /* init the scope the first time it's used */
+    if (!scope->Entries)
+        qspInitVarsScope(scope, QSP_VARSLOCALCAPACITY); /* init the scope the first time it's used */
 
     /* Check if the variable already exists in the current scope */
-    bucket = scope->Buckets + (nameHash % scope->BucketsCount);
-    var = qspGetVar(bucket, name);
+    var = qspGetVar(scope, varName->Name, varName->Hash);
     if (var) return var;
 
     /* It doesn't exist yet, so we have to add it */
-    if (bucket->VarsCount >= QSP_MAXVARSBUCKETSIZE)
-    {
-        qspSetError(QSP_ERR_TOOMANYVARS);
-        return 0;
-    }
-    return qspCreateNewVar(bucket, name, 8);
+    var = qspCreateNewVar(scope, varName->Name, varName->Hash);
+    qspBindLocalVar(var, nameId);
+    return var;
 }
 
-INLINE QSPVar *qspAddSpecialVarToScope(QSPVarsScope *scope, QSPString name)
+INLINE void qspInitFrameVar(QSPVar *var, int nameId)
 {
-    unsigned int nameHash = qspGetNameHash(name); /* we don't validate the name */
-    QSPVarsBucket *bucket = scope->Buckets + (nameHash % scope->BucketsCount);
-
-    return qspCreateNewVar(bucket, name, 2); /* small increment for special vars */
+    var->Name = qspNullString; /* it's never looked up by name */
+    qspInitVarData(var);
+    qspBindLocalVar(var, nameId);
 }
 
 INLINE void qspSetVarValuesByReference(QSPVar *var, QSPVariant *vals, int count, QSP_BOOL toMove)
@@ -298,15 +536,14 @@ INLINE void qspSetVarValuesByReference(QSPVar *var, QSPVariant *vals, int count,
 
 QSPVarsScope *qspAllocateLocalScopeWithArgs(QSPVariant *args, int count, QSP_BOOL toMove)
 {
-    QSPVar *varArgs;
+    /* The table of variables gets created only if the code declares local variables */
     QSPVarsScope *scope = qspAllocateLocalScope();
-    if (!scope->Buckets)
-        qspInitVarsScope(scope, QSP_VARSLOCALBUCKETS); /* init the uninitialized scope */
+    scope->IsCallFrame = QSP_TRUE;
 
-    varArgs = qspAddSpecialVarToScope(scope, QSP_STATIC_STR(QSP_VARARGS));
-    qspSetVarValuesByReference(varArgs, args, count, toMove);
+    qspInitFrameVar(&scope->FrameArgs, qspArgsVarNameId);
+    qspSetVarValuesByReference(&scope->FrameArgs, args, count, toMove);
 
-    qspAddSpecialVarToScope(scope, QSP_STATIC_STR(QSP_VARRES));
+    qspInitFrameVar(&scope->FrameResult, qspResultVarNameId);
 
     return scope;
 }
@@ -323,11 +560,19 @@ QSP_BOOL qspSetArgs(QSPVariant *args, int count, QSP_BOOL toMove)
 
 QSP_BOOL qspApplyResult(QSPVariant *res)
 {
-    QSPVar *varRes = qspVarReference(QSP_STATIC_STR(QSP_VARRES), QSP_FALSE);
-    if (!varRes) return QSP_FALSE;
+    QSPVariant *resValue;
+    QSPVar *varRes;
+    QSPVarsScopeChunk *chunk = qspCurrentLocalVars;
+    if (chunk && chunk->Slots[chunk->SlotsCount - 1].IsCallFrame)
+        varRes = &chunk->Slots[chunk->SlotsCount - 1].FrameResult; /* the scope of the finished call */
+    else
+    {
+        varRes = qspVarReference(QSP_STATIC_STR(QSP_VARRES), QSP_FALSE);
+        if (!varRes) return QSP_FALSE;
+    }
 
-    if (varRes->ValsCount)
-        qspCopyToNewVariant(res, varRes->Values);
+    if ((resValue = qspGetVarItem(varRes, 0)))
+        qspShareToNewVariant(res, resValue);
     else
         qspInitVariant(res, QSP_TYPE_UNDEF);
     return QSP_TRUE;
@@ -336,6 +581,7 @@ QSP_BOOL qspApplyResult(QSPVariant *res)
 QSPVarsScopeChunk *qspSaveLocalVarsAndRestoreGlobals(void)
 {
     QSPVarsScopeChunk *previousVarsChunk = qspCurrentLocalVars;
+    qspUnbindLocalVarsScopes(previousVarsChunk); /* local variables get hidden */
     qspCurrentLocalVars = 0;
     return previousVarsChunk;
 }
@@ -344,153 +590,480 @@ void qspRestoreSavedLocalVars(QSPVarsScopeChunk *chunk)
 {
     qspClearLocalVarsScopes(qspCurrentLocalVars);
     qspCurrentLocalVars = chunk;
+    qspBindLocalVarsScopes(chunk); /* local variables are visible again */
 }
 
 QSPVar *qspVarReference(QSPString name, QSP_BOOL toCreate)
 {
-    int i;
+    int nameId;
     unsigned int nameHash;
-    QSPVarsScopeChunk *chunk;
-    QSPVarsScope *scope;
-    QSPVarsBucket *bucket;
     QSPVar *var;
-    if (qspIsEmpty(name))
+    if (!qspPrepareVarName(&name))
     {
         qspSetError(QSP_ERR_INCORRECTNAME);
         return 0;
     }
+    nameHash = qspGetNameHash(name);
+    nameId = qspFindVarNameId(name, nameHash, QSP_FALSE);
+    if (nameId >= 0) return qspVarReferenceById(nameId, toCreate);
 
-    /* Ignore type prefix */
-    if (qspIsInClass(*name.Str, QSP_CHAR_TYPEPREFIX))
-        name.Str++;
+    /* Local variables always have interned names, so we check the global scope only */
+    var = qspGetVar(&qspGlobalVars, name, nameHash);
+    if (var) return var;
+
+    if (toCreate) /* create it in the global scope */
+        return qspCreateNewVar(&qspGlobalVars, name, nameHash);
+
+    return &qspNullVar;
+}
+
+QSPVar *qspVarReferenceById(int nameId, QSP_BOOL toCreate)
+{
+    /* The name is interned already, so we don't have to validate it */
+    QSPVar *var;
+    QSPVarName *varName = qspVarNames + nameId;
+    if (varName->LocalVar) /* the innermost local variable hides everything else */
+        return varName->LocalVar;
 
-    if (qspIsEmpty(name) || qspIsInClass(*name.Str, QSP_CHAR_DIGIT) || qspStrCharClass(name, QSP_CHAR_DELIM))
+    if (varName->GlobalVarGeneration == qspGlobalVarsGeneration)
+        return varName->GlobalVar;
+
+    var = qspGetVar(&qspGlobalVars, varName->Name, varName->Hash);
+    if (!var)
     {
-        qspSetError(QSP_ERR_INCORRECTNAME);
+        /* We don't keep missing variables since they can be created later */
+        if (!toCreate) return &qspNullVar;
+        var = qspCreateNewVar(&qspGlobalVars, varName->Name, varName->Hash);
+    }
+    varName->GlobalVar = var;
+    varName->GlobalVarGeneration = qspGlobalVarsGeneration;
+    return var;
+}
+
+INLINE QSPVar *qspVarReferenceWithId(QSPString name, int nameId, QSP_BOOL toCreate)
+{
+    if (nameId >= 0)
+        return qspVarReferenceById(nameId, toCreate);
+
+    return qspVarReference(name, toCreate);
+}
+
+QSPVar *qspAddVarToScope(QSPVarsScope *scope, QSPString name)
+{
+    /* We don't validate the name here */
+    unsigned int nameHash = qspGetNameHash(name);
+    QSPVar *var = qspGetVar(scope, name, nameHash);
+    if (var) return var;
+
+    return qspCreateNewVar(scope, name, nameHash);
+}
+
+void qspBuildVarIndicesTable(QSPVar *var)
+{
+    int i, capacity;
+    unsigned int pos, mask;
+    QSPVarIndex *ind;
+    if (var->IndsTable) free(var->IndsTable);
+    if (!var->IndsCount)
+    {
+        var->IndsTable = 0;
+        var->IndsTableCapacity = 0;
+        return;
+    }
+    /* Keep the load factor of the table below 1/2 */
+    capacity = 16;
+    while (capacity <= var->IndsCount * 2)
+        capacity *= 2;
+    mask = (unsigned int)capacity - 1;
+    var->IndsTable = (int *)malloc(capacity * sizeof(int));
+    var->IndsTableCapacity = capacity;
+    for (i = 0; i < capacity; ++i)
+        var->IndsTable[i] = -1;
+    ind = var->Indices;
+    for (i = 0; i < var->IndsCount; ++i, ++ind)
+    {
+        pos = ind->Hash & mask;
+        while (var->IndsTable[pos] >= 0)
+            pos = (pos + 1) & mask;
+        var->IndsTable[pos] = i;
+    }
+}
+
+void qspSortVarIndices(QSPVar *var)
+{
+    /* Saved games keep indices ordered */
+    if (var->IndsCount > 1)
+    {
+        qsort(var->Indices, var->IndsCount, sizeof(QSPVarIndex), qspIndStringsCompare);
+        qspBuildVarIndicesTable(var);
+    }
+}
+
+INLINE QSPVarIndex *qspGetVarIndexItem(QSPVar *var, QSPString str, unsigned int strHash)
+{
+    int itemPos;
+    QSPVarIndex *ind;
+    unsigned int pos, mask;
+    if (!var->IndsTable) return 0;
+    mask = (unsigned int)var->IndsTableCapacity - 1;
+    pos = strHash & mask;
+    while ((itemPos = var->IndsTable[pos]) >= 0)
+    {
+        ind = var->Indices + itemPos;
+        if (ind->Hash == strHash && qspStrsEqual(ind->Str, str)) return ind;
+        pos = (pos + 1) & mask;
+    }
+    return 0;
+}
+
+INLINE void qspAddVarIndexItem(QSPVar *var, QSPString str, unsigned int strHash, int index)
+{
+    QSPVarIndex *ind;
+    unsigned int pos, mask;
+    int itemPos = var->IndsCount;
+    if (itemPos >= var->IndsCapacity)
+    {
+        var->IndsCapacity = (var->IndsCapacity ? var->IndsCapacity * 2 : 8);
+        var->Indices = (QSPVarIndex *)realloc(var->Indices, var->IndsCapacity * sizeof(QSPVarIndex));
+    }
+    ind = var->Indices + itemPos;
+    ind->Index = index;
+    ind->Str = str;
+    ind->Hash = strHash;
+    var->IndsCount++;
+    if (var->IndsCount * 2 > var->IndsTableCapacity)
+    {
+        qspBuildVarIndicesTable(var); /* includes the new item */
+        return;
+    }
+    mask = (unsigned int)var->IndsTableCapacity - 1;
+    pos = strHash & mask;
+    while (var->IndsTable[pos] >= 0)
+        pos = (pos + 1) & mask;
+    var->IndsTable[pos] = itemPos;
+}
+
+QSPVariant *qspGetVarItemsRange(QSPVar *var, int ind, int *count)
+{
+    /* Returns the stored items starting at ind or 0 if they aren't stored, count receives the length of the range */
+    int itemsCount;
+    if (ind < 0 || ind >= var->ValsCount)
+    {
+        *count = 0;
         return 0;
     }
+    itemsCount = var->ValsCount - ind;
+    if (var->Blocks)
+    {
+        int offset;
+        QSPVariant *segment;
+        QSPVarBlock *block = var->Blocks[ind / QSP_VARBLOCKSIZE];
+        if (!block)
+        {
+            offset = ind % QSP_VARBLOCKSIZE;
+            if (itemsCount > QSP_VARBLOCKSIZE - offset) itemsCount = QSP_VARBLOCKSIZE - offset;
+            *count = itemsCount;
+            return 0;
+        }
+        offset = ind % QSP_VARSEGMENTSIZE;
+        if (itemsCount > QSP_VARSEGMENTSIZE - offset) itemsCount = QSP_VARSEGMENTSIZE - offset;
+        *count = itemsCount;
+        segment = block->Segments[(ind % QSP_VARBLOCKSIZE) / QSP_VARSEGMENTSIZE];
+        return (segment ? segment + offset : 0);
+    }
+    *count = itemsCount;
+    return var->Values + ind;
+}
 
-    /* Check all local scopes starting the latest */
-    nameHash = qspGetNameHash(name);
-    chunk = qspCurrentLocalVars;
-    while (chunk)
+INLINE void qspExpandVarBlocks(QSPVar *var, int ind)
+{
+    int blocksCount = ind / QSP_VARBLOCKSIZE + 1;
+    if (blocksCount > var->BlocksCount)
     {
-        scope = chunk->Slots + chunk->SlotsCount - 1;
-        for (i = chunk->SlotsCount; i > 0; --i, --scope)
+        int i;
+        var->Blocks = (QSPVarBlock **)realloc(var->Blocks, blocksCount * sizeof(QSPVarBlock *));
+        for (i = var->BlocksCount; i < blocksCount; ++i)
+            var->Blocks[i] = 0;
+        var->BlocksCount = blocksCount;
+    }
+}
+
+INLINE QSPVariant *qspAllocateDenseVarItem(QSPVar *var, int ind)
+{
+    int oldCount = var->ValsCount;
+    if (ind >= oldCount)
+    {
+        QSPVariant *curValue;
+        if (ind >= var->ValsCapacity)
         {
-            if (scope->Buckets)
-            {
-                bucket = scope->Buckets + (nameHash % scope->BucketsCount);
-                var = qspGetVar(bucket, name);
-                if (var) return var;
-            }
+            if (ind > 0)
+                var->ValsCapacity = ind + 4;
+            else
+                var->ValsCapacity = 1; /* allocate only 1 item for the first value */
+            var->Values = (QSPVariant *)realloc(var->Values, var->ValsCapacity * sizeof(QSPVariant));
         }
-        chunk = chunk->ParentChunk;
+        var->ValsCount = ind + 1;
+        /* Init new values */
+        for (curValue = var->Values + oldCount; oldCount <= ind; ++curValue, ++oldCount)
+            qspInitVariant(curValue, QSP_TYPE_UNDEF);
     }
+    return var->Values + ind;
+}
 
-    /* Check the global scope */
-    bucket = qspGlobalVars.Buckets + (nameHash % qspGlobalVars.BucketsCount);
-    var = qspGetVar(bucket, name);
-    if (var) return var;
+INLINE QSPVariant *qspAllocateSparseVarItem(QSPVar *var, int ind)
+{
+    QSPVariant **segment;
+    QSPVarBlock *block;
+    qspExpandVarBlocks(var, ind);
+    block = var->Blocks[ind / QSP_VARBLOCKSIZE];
+    if (!block)
+    {
+        int i;
+        block = (QSPVarBlock *)malloc(sizeof(QSPVarBlock));
+        for (i = 0; i < QSP_VARBLOCKSEGMENTS; ++i)
+            block->Segments[i] = 0;
+        var->Blocks[ind / QSP_VARBLOCKSIZE] = block;
+    }
+    segment = block->Segments + (ind % QSP_VARBLOCKSIZE) / QSP_VARSEGMENTSIZE;
+    if (!*segment)
+    {
+        int i;
+        QSPVariant *curValue = (QSPVariant *)malloc(QSP_VARSEGMENTSIZE * sizeof(QSPVariant));
+        *segment = curValue;
+        for (i = 0; i < QSP_VARSEGMENTSIZE; ++i, ++curValue)
+            qspInitVariant(curValue, QSP_TYPE_UNDEF);
+        var->SegmentsCount++;
+    }
+    if (ind >= var->ValsCount) var->ValsCount = ind + 1;
+    return *segment + ind % QSP_VARSEGMENTSIZE;
+}
 
-    if (toCreate)
+INLINE void qspConvertVarToSparse(QSPVar *var)
+{
+    int i, valsCount = var->ValsCount;
+    QSPVariant *values = var->Values, *curValue = values;
+    var->Values = 0;
+    var->ValsCount = var->ValsCapacity = 0;
+    /* Undefined items don't get stored */
+    for (i = 0; i < valsCount; ++i, ++curValue)
+    {
+        if (QSP_ISDEF(curValue->Type))
+            qspMoveToNewVariant(qspAllocateSparseVarItem(var, i), curValue);
+    }
+    if (values) free(values);
+    if (valsCount)
     {
-        /* Create it in the global scope */
-        if (bucket->VarsCount >= QSP_MAXVARSBUCKETSIZE)
+        qspExpandVarBlocks(var, valsCount - 1);
+        var->ValsCount = valsCount;
+    }
+}
+
+INLINE void qspConvertVarToDense(QSPVar *var)
+{
+    QSPVarBlock **blocks = var->Blocks;
+    int i, j, k, itemsCount, blocksCount = var->BlocksCount, valsCount = var->ValsCount;
+    var->Blocks = 0;
+    var->BlocksCount = var->SegmentsCount = 0;
+    var->ValsCount = 0;
+    if (valsCount) qspAllocateDenseVarItem(var, valsCount - 1);
+    for (i = 0; i < blocksCount; ++i)
+    {
+        QSPVarBlock *block = blocks[i];
+        if (!block) continue;
+        for (j = 0; j < QSP_VARBLOCKSEGMENTS; ++j)
         {
-            qspSetError(QSP_ERR_TOOMANYVARS);
-            return 0;
+            QSPVariant *segment = block->Segments[j];
+            if (!segment) continue;
+            itemsCount = valsCount - (i * QSP_VARBLOCKSIZE + j * QSP_VARSEGMENTSIZE);
+            if (itemsCount > QSP_VARSEGMENTSIZE) itemsCount = QSP_VARSEGMENTSIZE;
+            /* Items beyond the end of the array are undefined, we don't have to free them */
+            for (k = 0; k < itemsCount; ++k)
+                qspMoveToNewVariant(var->Values + i * QSP_VARBLOCKSIZE + j * QSP_VARSEGMENTSIZE + k, segment + k);
+            free(segment);
         }
-        return qspCreateNewVar(bucket, name, 8);
+        free(block);
     }
-    return &qspNullVar;
+    if (blocks) free(blocks);
+}
+
+QSPVariant *qspAllocateVarItem(QSPVar *var, int ind)
+{
+    /* Returns the item at ind, missing items get created as undefined ones */
+    if (var->Blocks)
+    {
+        int newCount;
+        QSPVariant *item = qspGetVarItem(var, ind);
+        if (item) return item;
+        newCount = (ind >= var->ValsCount ? ind + 1 : var->ValsCount);
+        if ((var->SegmentsCount + 1) * QSP_VARSEGMENTSIZE * 2 < newCount)
+            return qspAllocateSparseVarItem(var, ind);
+        /* Stored segments cover half of the array, so it's cheaper to keep it dense */
+        qspConvertVarToDense(var);
+    }
+    else if (ind >= var->ValsCount && ind >= QSP_VARSPARSEMINSIZE && ind / 4 > var->ValsCount)
+    {
+        /* Most items of the array would be undefined */
+        qspConvertVarToSparse(var);
+        return qspAllocateSparseVarItem(var, ind);
+    }
+    return qspAllocateDenseVarItem(var, ind);
+}
+
+QSPTuple qspArrayItemsToNewTuple(QSPVar *var, int start, int count)
+{
+    int i, itemsCount;
+    QSPTuple tuple;
+    QSPVariant *curValue, *newItem;
+    if (!var->Blocks) return qspCopyToNewTuple(var->Values + start, count);
+    tuple.Vals = newItem = (QSPVariant *)malloc(count * sizeof(QSPVariant));
+    tuple.ValsCount = count;
+    i = 0;
+    while (i < count)
+    {
+        curValue = qspGetVarItemsRange(var, start + i, &itemsCount);
+        if (itemsCount > count - i) itemsCount = count - i;
+        i += itemsCount;
+        if (curValue)
+        {
+            for (; itemsCount > 0; --itemsCount, ++curValue, ++newItem)
+                qspShareToNewVariant(newItem, curValue);
+        }
+        else
+        {
+            for (; itemsCount > 0; --itemsCount, ++newItem)
+                qspInitVariant(newItem, QSP_TYPE_UNDEF);
+        }
+    }
+    return tuple;
 }
 
 INLINE void qspRemoveArrayItem(QSPVar *var, int index)
 {
-    int i;
-    QSP_BOOL toRemove;
-    QSPVarIndex *ind;
+    int i, indsCount;
+    QSPVarIndex *ind, *destInd;
     if (index < 0 || index >= var->ValsCount) return;
-    qspFreeVariant(var->Values + index);
-    var->ValsCount--;
-    i = index;
-    while (i < var->ValsCount)
+    if (var->Blocks)
+    {
+        /* Move the stored items to the new storage, we skip the removed item */
+        QSPVar oldItems;
+        QSPVariant *curValue;
+        int itemsCount, valsCount = var->ValsCount;
+        qspInitVarData(&oldItems);
+        oldItems.Blocks = var->Blocks;
+        oldItems.BlocksCount = var->BlocksCount;
+        oldItems.SegmentsCount = var->SegmentsCount;
+        oldItems.ValsCount = valsCount;
+        var->Blocks = 0;
+        var->BlocksCount = var->SegmentsCount = 0;
+        var->ValsCount = 0;
+        i = 0;
+        while (i < valsCount)
+        {
+            curValue = qspGetVarItemsRange(&oldItems, i, &itemsCount);
+            if (curValue)
+            {
+                for (; itemsCount > 0; --itemsCount, ++curValue, ++i)
+                {
+                    if (i != index && QSP_ISDEF(curValue->Type))
+                        qspMoveToNewVariant(qspAllocateVarItem(var, (i > index ? i - 1 : i)), curValue);
+                }
+            }
+            else
+                i += itemsCount;
+        }
+        if (valsCount - 1 > var->ValsCount) qspAllocateVarItem(var, valsCount - 2);
+        qspEmptyVar(&oldItems);
+    }
+    else
     {
-        var->Values[i] = var->Values[i + 1];
-        ++i;
+        qspFreeVariant(var->Values + index);
+        var->ValsCount--;
+        i = index;
+        while (i < var->ValsCount)
+        {
+            var->Values[i] = var->Values[i + 1];
+            ++i;
+        }
     }
-    toRemove = QSP_FALSE;
-    ind = var->Indices;
-    for (i = 0; i < var->IndsCount; ++i)
+    /* Remove indices of the item & shift positions of the next items */
+    indsCount = var->IndsCount;
+    ind = destInd = var->Indices;
+    for (i = 0; i < indsCount; ++i, ++ind)
     {
         if (ind->Index == index)
         {
             qspFreeString(&ind->Str);
-            var->IndsCount--;
-            if (i == var->IndsCount) break;
-            toRemove = QSP_TRUE;
+            continue;
         }
-        if (toRemove) *ind = *(ind + 1);
         if (ind->Index > index) ind->Index--;
-        ++ind;
+        if (destInd != ind) *destInd = *ind;
+        ++destInd;
     }
+    var->IndsCount = (int)(destInd - var->Indices);
+    if (var->IndsCount != indsCount)
+        qspBuildVarIndicesTable(var);
+}
+
+INLINE unsigned int qspPrepareIndexStrKey(QSP_CHAR *buf, QSPString str)
+{
+    /* Produces the same key as qspGetVariantAsIndexString & qspUpperStr, returns its hash */
+    QSP_CHAR *pos, *dest = buf;
+    *dest = QSP_STRTYPE_CHAR; /* type id */
+    for (pos = str.Str; pos < str.End; ++pos)
+        *(++dest) = (QSP_CHAR)QSP_CHRUPR(*pos);
+    return qspStrHash(qspStringFromPair(buf, dest + 1));
 }
 
 int qspGetVarIndex(QSPVar *var, QSPVariant index, QSP_BOOL toCreate)
 {
-    int indsCount;
     QSPString uStr;
+    QSPVarIndex *ind;
+    unsigned int strHash;
     if (QSP_ISNUM(index.Type)) return QSP_TOINT(QSP_NUM(index));
-    uStr = qspGetVariantAsIndexString(&index);
-    qspUpperStr(&uStr);
-    indsCount = var->IndsCount;
-    if (indsCount > 0)
+    if (QSP_ISSTR(index.Type))
     {
-        QSPVarIndex *ind = (QSPVarIndex *)bsearch(&uStr, var->Indices, indsCount, sizeof(QSPVarIndex), qspIndStringCompare);
-        if (ind)
+        int keyLen = qspStrLen(QSP_STR(index)) + 1;
+        if (keyLen * (int)sizeof(QSP_CHAR) <= QSP_ALLOCCHUNKSIZE)
         {
-            qspFreeString(&uStr);
-            return ind->Index;
+            /* Prepare the key using the stack allocator, we allocate it only for new items */
+            int itemIndex;
+            QSP_CHAR *keyBuf = (QSP_CHAR *)qspAllocateMemory(keyLen * sizeof(QSP_CHAR));
+            strHash = qspPrepareIndexStrKey(keyBuf, QSP_STR(index));
+            uStr = qspStringFromLen(keyBuf, keyLen);
+            ind = qspGetVarIndexItem(var, uStr, strHash);
+            if (ind)
+                itemIndex = ind->Index;
+            else if (toCreate)
+            {
+                itemIndex = var->ValsCount; /* point to the new array item */
+                qspAddVarIndexItem(var, qspCopyToNewText(uStr), strHash, itemIndex);
+            }
+            else
+                itemIndex = -1;
+            qspReleaseMemory(keyBuf);
+            return itemIndex;
         }
     }
+    uStr = qspGetVariantAsIndexString(&index);
+    qspUpperStr(&uStr);
+    strHash = qspGetNameHash(uStr);
+    ind = qspGetVarIndexItem(var, uStr, strHash);
+    if (ind)
+    {
+        qspFreeString(&uStr);
+        return ind->Index;
+    }
     if (toCreate)
     {
-        /* Find the first item that's smaller than uStr */
-        int floorItem = indsCount - 1;
-        if (indsCount > 0)
-        {
-            QSPVarIndex *lastItem = var->Indices + floorItem;
-            if (qspStrsCompare(uStr, lastItem->Str) < 0)
-            {
-                QSPVarIndex *ind = (QSPVarIndex *)bsearch(&uStr, var->Indices, floorItem, sizeof(QSPVarIndex), qspIndStringFloorCompare);
-                floorItem = (ind ? (int)(ind - var->Indices) : -1);
-            }
-        }
-        /* Prepare buffer & shift existing items to allocate extra space */
-        if (indsCount >= var->IndsCapacity)
-        {
-            var->IndsCapacity = indsCount + 8;
-            var->Indices = (QSPVarIndex *)realloc(var->Indices, var->IndsCapacity * sizeof(QSPVarIndex));
-        }
-        ++floorItem;
-        while (indsCount > floorItem)
-        {
-            var->Indices[indsCount] = var->Indices[indsCount - 1];
-            --indsCount;
-        }
-        /* Add new index item */
-        indsCount = var->ValsCount; /* point to the new array item */
-        var->Indices[floorItem].Str = uStr;
-        var->Indices[floorItem].Index = indsCount;
-        var->IndsCount++;
-        return indsCount;
+        int newIndex = var->ValsCount; /* point to the new array item */
+        qspAddVarIndexItem(var, uStr, strHash, newIndex);
+        return newIndex;
     }
     qspFreeString(&uStr);
     return -1;
 }
 
-INLINE QSPVar *qspGetVarData(QSPString s, int *index, QSP_BOOL isSetOperation)
+INLINE QSPVar *qspGetVarData(QSPString s, int nameId, int *index, QSP_BOOL isSetOperation)
 {
     QSP_CHAR *nameEnd = qspStrCharClass(s, QSP_CHAR_DELIM);
     if (nameEnd)
@@ -507,7 +1080,7 @@ INLINE QSPVar *qspGetVarData(QSPString s, int *index, QSP_BOOL isSetOperation)
                 qspSetError(QSP_ERR_BRACKETNOTFOUND);
                 return 0;
             }
-            var = qspVarReference(qspStringFromPair(startPos, nameEnd), isSetOperation);
+            var = qspVarReferenceWithId(qspStringFromPair(startPos, nameEnd), nameId, isSetOperation);
             if (!var) return 0;
             s.Str += QSP_CHAR_LEN;
             qspSkipSpaces(&s);
@@ -536,17 +1109,48 @@ INLINE QSPVar *qspGetVarData(QSPString s, int *index, QSP_BOOL isSetOperation)
         }
     }
     *index = 0;
-    return qspVarReference(s, isSetOperation);
+    return qspVarReferenceWithId(s, nameId, isSetOperation);
+}
+
+INLINE QSPVar *qspGetTargetVarData(QSPString s, QSPAssignTarget *target, int *index)
+{
+    QSPVar *var;
+    QSPVariant ind;
+    int oldLocationState;
+    QSPString name = qspStringFromPair(s.Str + target->StartPos, s.Str + target->NameEndPos);
+    switch (target->Type)
+    {
+    case qspTargetVar:
+        *index = 0;
+        return qspVarReferenceWithId(name, target->NameId, QSP_TRUE);
+    case qspTargetNewItem:
+        var = qspVarReferenceWithId(name, target->NameId, QSP_TRUE);
+        if (!var) return 0;
+        *index = var->ValsCount; /* new item */
+        return var;
+    case qspTargetItem:
+        var = qspVarReferenceWithId(name, target->NameId, QSP_TRUE);
+        if (!var) return 0;
+        oldLocationState = qspLocationState;
+        ind = qspCalculateArgValue(s, &target->Index);
+        if (qspLocationState != oldLocationState) return 0;
+        *index = qspGetVarIndex(var, ind, QSP_TRUE);
+        qspFreeVariant(&ind);
+        return var;
+    default:
+        return qspGetVarData(qspStringFromPair(name.Str, s.Str + target->EndPos), target->NameId, index, QSP_TRUE);
+    }
 }
 
 INLINE QSP_BOOL qspGetVarValueByReference(QSPVar *var, int ind, QSP_TINYINT baseType, QSPVariant *res)
 {
-    if (ind >= 0 && ind < var->ValsCount)
+    QSPVariant *curValue = qspGetVarItem(var, ind);
+    if (curValue)
     {
-        QSP_TINYINT varType = var->Values[ind].Type;
+        QSP_TINYINT varType = curValue->Type;
         if (QSP_ISDEF(varType) && QSP_BASETYPE(varType) == baseType)
         {
-            qspCopyToNewVariant(res, var->Values + ind);
+            qspShareToNewVariant(res, curValue);
             return QSP_TRUE;
         }
     }
@@ -554,31 +1158,31 @@ INLINE QSP_BOOL qspGetVarValueByReference(QSPVar *var, int ind, QSP_TINYINT base
     return QSP_TRUE;
 }
 
-QSP_BOOL qspGetVarValueByIndex(QSPString varName, QSPVariant index, QSPVariant *res)
+QSP_BOOL qspGetVarValueByIndex(QSPString varName, int nameId, QSPVariant index, QSPVariant *res)
 {
     int arrIndex;
     QSP_TINYINT varType;
-    QSPVar *var = qspVarReference(varName, QSP_FALSE);
+    QSPVar *var = qspVarReferenceWithId(varName, nameId, QSP_FALSE);
     if (!var) return QSP_FALSE;
     arrIndex = qspGetVarIndex(var, index, QSP_FALSE);
     varType = qspGetVarType(varName);
     return qspGetVarValueByReference(var, arrIndex, varType, res);
 }
 
-QSP_BOOL qspGetFirstVarValue(QSPString varName, QSPVariant *res)
+QSP_BOOL qspGetFirstVarValue(QSPString varName, int nameId, QSPVariant *res)
 {
     QSP_TINYINT varType;
-    QSPVar *var = qspVarReference(varName, QSP_FALSE);
+    QSPVar *var = qspVarReferenceWithId(varName, nameId, QSP_FALSE);
     if (!var) return QSP_FALSE;
     varType = qspGetVarType(varName);
     return qspGetVarValueByReference(var, 0, varType, res);
 }
 
-QSP_BOOL qspGetLastVarValue(QSPString varName, QSPVariant *res)
+QSP_BOOL qspGetLastVarValue(QSPString varName, int nameId, QSPVariant *res)
 {
     int arrIndex;
     QSP_TINYINT varType;
-    QSPVar *var = qspVarReference(varName, QSP_FALSE);
+    QSPVar *var = qspVarReferenceWithId(varName, nameId, QSP_FALSE);
     if (!var) return QSP_FALSE;
     arrIndex = var->ValsCount - 1;
     varType = qspGetVarType(varName);
@@ -591,8 +1195,9 @@ QSPString qspGetVarStrValue(QSPString name)
     QSPVar *var = qspVarReference(name, QSP_FALSE);
     if (var)
     {
-        if (var->ValsCount && QSP_ISSTR(var->Values[0].Type))
-            return QSP_STR(var->Values[0]);
+        QSPVariant *curValue = qspGetVarItem(var, 0);
+        if (curValue && QSP_ISSTR(curValue->Type))
+            return QSP_PSTR(curValue);
     }
     else
     {
@@ -609,8 +1214,9 @@ QSP_BIGINT qspGetVarNumValue(QSPString name)
     QSPVar *var = qspVarReference(name, QSP_FALSE);
     if (var)
     {
-        if (var->ValsCount && QSP_ISNUM(var->Values[0].Type))
-            return QSP_NUM(var->Values[0]);
+        QSPVariant *curValue = qspGetVarItem(var, 0);
+        if (curValue && QSP_ISNUM(curValue->Type))
+            return QSP_PNUM(curValue);
     }
     else
     {
@@ -621,14 +1227,14 @@ QSP_BIGINT qspGetVarNumValue(QSPString name)
     return 0;
 }
 
-INLINE void qspResetVar(QSPString varName)
+INLINE void qspResetVar(QSPString s, QSPAssignTarget *target)
 {
     int index;
-    QSPVar *var = qspGetVarData(varName, &index, QSP_TRUE);
+    QSPVariant *curValue;
+    QSPVar *var = qspGetTargetVarData(s, target, &index);
     if (!var) return;
-    if (index >= 0 && index < var->ValsCount)
+    if ((curValue = qspGetVarItem(var, index)))
     {
-        QSPVariant *curValue = var->Values + index;
         if (QSP_ISDEF(curValue->Type))
         {
             qspFreeVariant(curValue);
@@ -639,41 +1245,16 @@ INLINE void qspResetVar(QSPString varName)
 
 INLINE void qspSetVarValueByReference(QSPVar *var, int ind, QSP_TINYINT baseType, QSPVariant *val)
 {
-    int oldCount = var->ValsCount;
-    if (ind >= oldCount)
-    {
-        /* A new item */
-        QSPVariant *curValue;
-        if (!qspConvertVariantTo(val, baseType))
-        {
-            qspSetError(QSP_ERR_TYPEMISMATCH);
-            return;
-        }
-        if (ind >= var->ValsCapacity)
-        {
-            if (ind > 0)
-                var->ValsCapacity = ind + 4;
-            else
-                var->ValsCapacity = 1; /* allocate only 1 item for the first value */
-            var->Values = (QSPVariant *)realloc(var->Values, var->ValsCapacity * sizeof(QSPVariant));
-        }
-        var->ValsCount = ind + 1;
-        /* Init new values */
-        for (curValue = var->Values + oldCount; oldCount < ind; ++curValue, ++oldCount)
-            qspInitVariant(curValue, QSP_TYPE_UNDEF);
-        qspMoveToNewVariant(var->Values + ind, val);
-    }
-    else if (ind >= 0)
+    QSPVariant *curValue;
+    if (ind < 0) return;
+    if (!qspConvertVariantTo(val, baseType))
     {
-        /* Replace an existing item */
-        if (!qspConvertVariantTo(val, baseType))
-        {
-            qspSetError(QSP_ERR_TYPEMISMATCH);
-            return;
-        }
-        qspFreeVariant(var->Values + ind);
-        qspMoveToNewVariant(var->Values + ind, val);
+        qspSetError(QSP_ERR_TYPEMISMATCH);
+        return;
     }
+    curValue = qspAllocateVarItem(var, ind);
+    qspFreeVariant(curValue);
+    qspMoveToNewVariant(curValue, val);
 }
 
 INLINE void qspSetVarValueByIndex(QSPString varName, QSPVariant index, QSPVariant *val)
@@ -696,15 +1277,29 @@ INLINE void qspSetFirstVarValue(QSPString varName, QSPVariant *val)
     qspSetVarValueByReference(var, 0, varType, val);
 }
 
-INLINE void qspSetVarValue(QSPString varName, QSPVariant *val, QSP_CHAR op)
+INLINE void qspSetVarValue(QSPString s, QSPAssignTarget *target, QSPVariant *val, QSP_CHAR op)
 {
     int index;
     QSP_TINYINT varType;
-    QSPVar *var = qspGetVarData(varName, &index, QSP_TRUE);
+    QSPVar *var = qspGetTargetVarData(s, target, &index);
     if (!var) return;
-    varType = qspGetVarType(varName);
+    varType = qspGetVarType(qspStringFromPair(s.Str + target->StartPos, s.Str + target->NameEndPos));
     if (op == QSP_EQUAL_CHAR)
         qspSetVarValueByReference(var, index, varType, val);
+    else if (op == QSP_ADD_CHAR && varType == QSP_TYPE_STR && QSP_ISSTR(val->Type))
+    {
+        /* Strings get appended in place */
+        QSPVariant *curValue;
+        if (index < 0) return;
+        curValue = qspAllocateVarItem(var, index);
+        if (!QSP_ISDEF(curValue->Type) || QSP_BASETYPE(curValue->Type) != QSP_TYPE_STR)
+        {
+            qspFreeVariant(curValue);
+            qspInitVariant(curValue, QSP_TYPE_STR);
+        }
+        curValue->Type = QSP_TYPE_STR;
+        qspAppendToText(&QSP_PSTR(curValue), QSP_PSTR(val));
+    }
     else if (qspIsInClass(op, QSP_CHAR_SIMPLEOP))
     {
         QSPVariant oldVal, res;
@@ -746,6 +1341,7 @@ INLINE void qspMoveTupleToArray(QSPVar *dest, QSPTuple *src, int start, int coun
 INLINE void qspCopyArray(QSPVar *dest, QSPVar *src, int start, int count)
 {
     int i, itemsToCopy, newInd;
+    QSPVariant *curValue;
     /* Clear the dest array anyway */
     qspEmptyVar(dest);
     /* Validate parameters */
@@ -755,13 +1351,35 @@ INLINE void qspCopyArray(QSPVar *dest, QSPVar *src, int start, int count)
     if (itemsToCopy <= 0) return;
     if (count < itemsToCopy) itemsToCopy = count;
     /* Copy array values */
-    dest->ValsCapacity = dest->ValsCount = itemsToCopy;
-    dest->Values = (QSPVariant *)malloc(itemsToCopy * sizeof(QSPVariant));
-    for (i = 0; i < itemsToCopy; ++i)
-        qspCopyToNewVariant(dest->Values + i, src->Values + start + i);
+    if (src->Blocks)
+    {
+        /* Copy only the stored items of the sparse array */
+        i = 0;
+        while (i < itemsToCopy)
+        {
+            curValue = qspGetVarItemsRange(src, start + i, &count);
+            if (count > itemsToCopy - i) count = itemsToCopy - i;
+            if (curValue)
+            {
+                for (; count > 0; --count, ++curValue, ++i)
+                {
+                    if (QSP_ISDEF(curValue->Type))
+                        qspShareToNewVariant(qspAllocateVarItem(dest, i), curValue);
+                }
+            }
+            else
+                i += count;
+        }
+        if (itemsToCopy > dest->ValsCount) qspAllocateVarItem(dest, itemsToCopy - 1);
+    }
+    else
+    {
+        dest->ValsCapacity = dest->ValsCount = itemsToCopy;
+        dest->Values = (QSPVariant *)malloc(itemsToCopy * sizeof(QSPVariant));
+        for (i = 0; i < itemsToCopy; ++i)
+            qspShareToNewVariant(dest->Values + i, src->Values + start + i);
+    }
     /* Copy array indices */
-    dest->IndsCapacity = 0;
-    dest->Indices = 0;
     count = 0;
     for (i = 0; i < src->IndsCount; ++i)
     {
@@ -775,52 +1393,235 @@ INLINE void qspCopyArray(QSPVar *dest, QSPVar *src, int start, int count)
             }
             dest->Indices[count].Index = newInd;
             dest->Indices[count].Str = qspCopyToNewText(src->Indices[i].Str);
+            dest->Indices[count].Hash = src->Indices[i].Hash;
             ++count;
         }
     }
     dest->IndsCount = count;
+    qspBuildVarIndicesTable(dest);
+}
+
+INLINE void qspSortNumArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending)
+{
+    QSP_SORTKEY key;
+    QSPSortNumItem *items, *srcItems, *destItems, *tempItems;
+    int i, digit, offset, pass, counts[QSP_SORTKEYBYTES][256];
+    memset(counts, 0, sizeof(counts));
+    items = (QSPSortNumItem *)malloc(count * 2 * sizeof(QSPSortNumItem));
+    for (i = 0; i < count; ++i)
+    {
+        /* Flip the sign bit, so negative numbers go first */
+        key = (QSP_SORTKEY)QSP_NUM(values[i]) ^ ((QSP_SORTKEY)1 << (sizeof(QSP_SORTKEY) * 8 - 1));
+        if (!isAscending) key = ~key;
+        items[i].Key = key;
+        items[i].Position = i;
+        for (pass = 0; pass < QSP_SORTKEYBYTES; ++pass)
+            ++counts[pass][(key >> (pass * 8)) & 0xFF];
+    }
+    /* Stable radix sort by bytes starting from the lowest one */
+    srcItems = items;
+    destItems = items + count;
+    for (pass = 0; pass < QSP_SORTKEYBYTES; ++pass)
+    {
+        /* Skip the byte if it's the same for all numbers */
+        if (counts[pass][(srcItems->Key >> (pass * 8)) & 0xFF] == count) continue;
+        offset = 0;
+        for (digit = 0; digit < 256; ++digit)
+        {
+            i = counts[pass][digit];
+            counts[pass][digit] = offset;
+            offset += i;
+        }
+        for (i = 0; i < count; ++i)
+            destItems[counts[pass][(srcItems[i].Key >> (pass * 8)) & 0xFF]++] = srcItems[i];
+        tempItems = srcItems;
+        srcItems = destItems;
+        destItems = tempItems;
+    }
+    for (i = 0; i < count; ++i)
+        order[i] = srcItems[i].Position;
+    free(items);
+}
+
+INLINE int qspSortStrItemsCompare(QSPSortStrItem *item1, QSPSortStrItem *item2, QSPVariant *values, int prefixStart)
+{
+    int i, delta, len = (item1->PrefixLen < item2->PrefixLen ? item1->PrefixLen : item2->PrefixLen);
+    for (i = 0; i < len; ++i)
+    {
+        if ((delta = (int)item1->Prefix[i] - item2->Prefix[i])) return delta;
+    }
+    if (len == QSP_SORTPREFIXLEN)
+    {
+        /* Both strings can be longer than their prefixes */
+        QSPString str1 = QSP_STR(values[item1->Position]), str2 = QSP_STR(values[item2->Position]);
+        str1.Str += prefixStart + len;
+        str2.Str += prefixStart + len;
+        return qspStrsCompare(str1, str2);
+    }
+    return item1->PrefixLen - item2->PrefixLen;
+}
+
+INLINE void qspSortStrArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending)
+{
+    QSPString str, firstStr;
+    QSPSortStrItem *items, *srcItems, *destItems, *tempItems, curItem;
+    int i, j, k, len, start, middle, end, runLen, prefixStart, direction = (isAscending ? 1 : -1);
+    /* Strings often have the same beginning, so we cache characters that follow it */
+    firstStr = QSP_STR(values[0]);
+    prefixStart = qspStrLen(firstStr);
+    for (i = 1; i < count && prefixStart > 0; ++i)
+    {
+        str = QSP_STR(values[i]);
+        len = qspStrLen(str);
+        if (len < prefixStart) prefixStart = len;
+        for (j = 0; j < prefixStart; ++j)
+        {
+            if (str.Str[j] != firstStr.Str[j])
+            {
+                prefixStart = j;
+                break;
+            }
+        }
+    }
+    items = (QSPSortStrItem *)malloc(count * 2 * sizeof(QSPSortStrItem));
+    for (i = 0; i < count; ++i)
+    {
+        str = QSP_STR(values[i]);
+        str.Str += prefixStart;
+        len = qspStrLen(str);
+        if (len > QSP_SORTPREFIXLEN) len = QSP_SORTPREFIXLEN;
+        for (j = 0; j < len; ++j)
+            items[i].Prefix[j] = str.Str[j];
+        items[i].PrefixLen = len;
+        items[i].Position = i;
+    }
+    /* Sort short runs by insertion */
+    for (start = 0; start < count; start += QSP_SORTRUNLEN)
+    {
+        end = (start + QSP_SORTRUNLEN < count ? start + QSP_SORTRUNLEN : count);
+        for (i = start + 1; i < end; ++i)
+        {
+            curItem = items[i];
+            for (j = i; j > start && direction * qspSortStrItemsCompare(items + j - 1, &curItem, values, prefixStart) > 0; --j)
+                items[j] = items[j - 1];
+            items[j] = curItem;
+        }
+    }
+    /* Merge the runs, the merge keeps equal strings in place */
+    srcItems = items;
+    destItems = items + count;
+    for (runLen = QSP_SORTRUNLEN; runLen < count; runLen *= 2)
+    {
+        for (start = 0; start < count; start += runLen * 2)
+        {
+            middle = (start + runLen < count ? start + runLen : count);
+            end = (middle + runLen < count ? middle + runLen : count);
+            i = start;
+            j = middle;
+            k = start;
+            while (i < middle && j < end)
+            {
+                if (direction * qspSortStrItemsCompare(srcItems + j, srcItems + i, values, prefixStart) < 0)
+                    destItems[k++] = srcItems[j++];
+                else
+                    destItems[k++] = srcItems[i++];
+            }
+            while (i < middle) destItems[k++] = srcItems[i++];
+            while (j < end) destItems[k++] = srcItems[j++];
+        }
+        tempItems = srcItems;
+        srcItems = destItems;
+        destItems = tempItems;
+    }
+    for (i = 0; i < count; ++i)
+        order[i] = srcItems[i].Position;
+    free(items);
+}
+
+INLINE void qspSortArrayItems(QSPVariant *values, int count, int *order, QSP_BOOL isAscending)
+{
+    int i;
+    QSPVariant **valuePositions = (QSPVariant **)malloc(count * sizeof(QSPVariant *));
+    for (i = 0; i < count; ++i)
+        valuePositions[i] = values + i;
+    if (isAscending)
+        qsort(valuePositions, count, sizeof(QSPVariant *), qspValuePositionsAscCompare);
+    else
+        qsort(valuePositions, count, sizeof(QSPVariant *), qspValuePositionsDescCompare);
+    for (i = 0; i < count; ++i)
+        order[i] = (int)(valuePositions[i] - values);
+    free(valuePositions);
+}
+
+INLINE void qspReorderArrayItems(QSPVar *var, int *order)
+{
+    QSPVariant *sortedValues;
+    int i, *indexMapping, valsCount = var->ValsCount, indsCount = var->IndsCount;
+    sortedValues = (QSPVariant *)malloc(valsCount * sizeof(QSPVariant));
+    if (indsCount)
+    {
+        /* Move values & map old positions to new positions in one pass */
+        indexMapping = (int *)malloc(valsCount * sizeof(int));
+        for (i = 0; i < valsCount; ++i)
+        {
+            qspMoveToNewVariant(sortedValues + i, var->Values + order[i]);
+            indexMapping[order[i]] = i;
+        }
+        for (i = 0; i < indsCount; ++i)
+            var->Indices[i].Index = indexMapping[var->Indices[i].Index];
+        free(indexMapping);
+    }
+    else
+    {
+        for (i = 0; i < valsCount; ++i)
+            qspMoveToNewVariant(sortedValues + i, var->Values + order[i]);
+    }
+    free(var->Values);
+    var->Values = sortedValues;
+    var->ValsCapacity = valsCount;
 }
 
 INLINE void qspSortArray(QSPVar *var, QSP_TINYINT baseValType, QSP_BOOL isAscending)
 {
-    QSPVariant *curValue, *sortedValues, **valuePositions;
-    int i, *indexMapping, indsCount, valsCount;
+    QSPVariant *curValue;
+    int i, *order, valsCount;
     valsCount = var->ValsCount;
     if (valsCount < 2) return;
-    valuePositions = (QSPVariant **)malloc(valsCount * sizeof(QSPVariant *));
+    if (var->Blocks)
+    {
+        if (QSP_BASETYPE(QSP_TYPE_UNDEF) != baseValType && var->SegmentsCount * QSP_VARSEGMENTSIZE < valsCount)
+        {
+            /* Items that aren't stored are undefined */
+            qspSetError(QSP_ERR_TYPEMISMATCH);
+            return;
+        }
+        qspConvertVarToDense(var);
+    }
     curValue = var->Values;
     for (i = 0; i < valsCount; ++i, ++curValue)
     {
         if (QSP_BASETYPE(curValue->Type) != baseValType)
         {
             qspSetError(QSP_ERR_TYPEMISMATCH);
-            free(valuePositions);
             return;
         }
-        valuePositions[i] = curValue;
     }
     /* Sort positions of values by comparing values */
-    if (isAscending)
-        qsort(valuePositions, valsCount, sizeof(QSPVariant *), qspValuePositionsAscCompare);
-    else
-        qsort(valuePositions, valsCount, sizeof(QSPVariant *), qspValuePositionsDescCompare);
-    /* Create mapping from old positions to new positions */
-    indexMapping = (int *)malloc(valsCount * sizeof(int));
-    for (i = 0; i < valsCount; ++i)
-        indexMapping[valuePositions[i] - var->Values] = i;
-    /* Reorder indices */
-    indsCount = var->IndsCount;
-    for (i = 0; i < indsCount; ++i)
-        var->Indices[i].Index = indexMapping[var->Indices[i].Index];
-    free(indexMapping);
-    /* Reorder values */
-    sortedValues = (QSPVariant *)malloc(valsCount * sizeof(QSPVariant));
-    curValue = sortedValues;
-    for (i = 0; i < valsCount; ++i, ++curValue)
-        qspMoveToNewVariant(curValue, valuePositions[i]);
-    free(valuePositions);
-    free(var->Values);
-    var->Values = sortedValues;
+    order = (int *)malloc(valsCount * sizeof(int));
+    switch (baseValType)
+    {
+    case QSP_TYPE_NUM:
+        qspSortNumArrayItems(var->Values, valsCount, order, isAscending);
+        break;
+    case QSP_TYPE_STR:
+        qspSortStrArrayItems(var->Values, valsCount, order, isAscending);
+        break;
+    default:
+        qspSortArrayItems(var->Values, valsCount, order, isAscending);
+        break;
+    }
+    qspReorderArrayItems(var, order);
+    free(order);
 }
 
 int qspArraySize(QSPString varName)
@@ -832,6 +1633,7 @@ int qspArraySize(QSPString varName)
 
 int qspArrayPos(QSPString varName, QSPVariant *val, int ind)
 {
+    int itemsCount;
     QSP_TINYINT varType;
     QSPVariant defaultValue, *curValue;
     QSPVar *var = qspVarReference(varName, QSP_FALSE);
@@ -846,17 +1648,29 @@ int qspArrayPos(QSPString varName, QSPVariant *val, int ind)
     if (ind < 0) ind = 0;
     while (ind < var->ValsCount)
     {
-        curValue = var->Values + ind;
-        if (!QSP_ISDEF(curValue->Type)) curValue = &defaultValue; /* check undefined values */
-        if (qspVariantsEqual(val, curValue)) return ind;
-        ++ind;
+        curValue = qspGetVarItemsRange(var, ind, &itemsCount);
+        if (curValue)
+        {
+            for (; itemsCount > 0; --itemsCount, ++curValue, ++ind)
+            {
+                /* Check undefined values */
+                if (qspVariantsEqual(val, (QSP_ISDEF(curValue->Type) ? curValue : &defaultValue))) return ind;
+            }
+        }
+        else
+        {
+            /* Items that aren't stored are undefined */
+            if (qspVariantsEqual(val, &defaultValue)) return ind;
+            ind += itemsCount;
+        }
     }
     return -1;
 }
 
 int qspArrayPosRegExp(QSPString varName, QSPString regExpStr, int ind)
 {
-    QSPVariant defaultValue, *curValue;
+    int itemsCount;
+    QSPVariant defaultValue, *curValue, *checkedValue;
     QSPRegExp *regExp;
     QSPVar *var = qspVarReference(varName, QSP_FALSE);
     if (!var) return -1;
@@ -866,68 +1680,90 @@ int qspArrayPosRegExp(QSPString varName, QSPString regExpStr, int ind)
     if (ind < 0) ind = 0;
     while (ind < var->ValsCount)
     {
-        curValue = var->Values + ind;
-        if (!QSP_ISDEF(curValue->Type)) curValue = &defaultValue; /* check undefined values */
-        if (QSP_ISSTR(curValue->Type) && qspRegExpStrMatch(regExp, QSP_PSTR(curValue))) return ind;
-        ++ind;
+        curValue = qspGetVarItemsRange(var, ind, &itemsCount);
+        if (curValue)
+        {
+            for (; itemsCount > 0; --itemsCount, ++curValue, ++ind)
+            {
+                checkedValue = (QSP_ISDEF(curValue->Type) ? curValue : &defaultValue); /* check undefined values */
+                if (QSP_ISSTR(checkedValue->Type) && qspRegExpStrMatch(regExp, QSP_PSTR(checkedValue))) return ind;
+            }
+        }
+        else
+        {
+            /* Items that aren't stored are undefined */
+            if (qspRegExpStrMatch(regExp, QSP_STR(defaultValue))) return ind;
+            ind += itemsCount;
+        }
     }
     return -1;
 }
 
 QSPVariant qspArrayMinMaxItem(QSPString varName, QSP_BOOL isMin)
 {
-    int i;
-    QSPVariant resultValue, *bestValue, *curValue;
+    int i, itemsCount;
+    QSPVariant resultValue, *bestValue, *curValue, *rangeValue;
     QSP_TINYINT varType;
     QSPVar *var = qspVarReference(varName, QSP_FALSE);
     if (!var) return qspGetEmptyVariant(QSP_TYPE_UNDEF);
     varType = qspGetVarType(varName);
     resultValue = qspGetEmptyVariant(varType);
     bestValue = 0;
-    for (i = 0; i < var->ValsCount; ++i)
+    i = 0;
+    while (i < var->ValsCount)
     {
-        curValue = var->Values + i;
-        if (!QSP_ISDEF(curValue->Type)) curValue = &resultValue; /* check undefined values */
-        if (QSP_BASETYPE(curValue->Type) == varType)
+        rangeValue = qspGetVarItemsRange(var, i, &itemsCount);
+        i += itemsCount;
+        if (!rangeValue)
+        {
+            /* Items that aren't stored are undefined, so we check the default value once */
+            rangeValue = &resultValue;
+            itemsCount = 1;
+        }
+        for (; itemsCount > 0; --itemsCount, ++rangeValue)
         {
-            if (bestValue)
+            curValue = (QSP_ISDEF(rangeValue->Type) ? rangeValue : &resultValue); /* check undefined values */
+            if (QSP_BASETYPE(curValue->Type) == varType)
             {
-                switch (varType)
+                if (bestValue)
                 {
-                case QSP_TYPE_TUPLE:
-                    if (isMin)
+                    switch (varType)
                     {
-                        if (qspTuplesCompare(QSP_PTUPLE(curValue), QSP_PTUPLE(bestValue)) < 0)
+                    case QSP_TYPE_TUPLE:
+                        if (isMin)
+                        {
+                            if (qspTuplesCompare(QSP_PTUPLE(curValue), QSP_PTUPLE(bestValue)) < 0)
+                                bestValue = curValue;
+                        }
+                        else if (qspTuplesCompare(QSP_PTUPLE(curValue), QSP_PTUPLE(bestValue)) > 0)
                             bestValue = curValue;
-                    }
-                    else if (qspTuplesCompare(QSP_PTUPLE(curValue), QSP_PTUPLE(bestValue)) > 0)
-                        bestValue = curValue;
-                    break;
-                case QSP_TYPE_STR:
-                    if (isMin)
-                    {
-                        if (qspStrsCompare(QSP_PSTR(curValue), QSP_PSTR(bestValue)) < 0)
+                        break;
+                    case QSP_TYPE_STR:
+                        if (isMin)
+                        {
+                            if (qspStrsCompare(QSP_PSTR(curValue), QSP_PSTR(bestValue)) < 0)
+                                bestValue = curValue;
+                        }
+                        else if (qspStrsCompare(QSP_PSTR(curValue), QSP_PSTR(bestValue)) > 0)
                             bestValue = curValue;
-                    }
-                    else if (qspStrsCompare(QSP_PSTR(curValue), QSP_PSTR(bestValue)) > 0)
-                        bestValue = curValue;
-                    break;
-                case QSP_TYPE_NUM:
-                    if (isMin)
-                    {
-                        if (QSP_PNUM(curValue) < QSP_PNUM(bestValue))
+                        break;
+                    case QSP_TYPE_NUM:
+                        if (isMin)
+                        {
+                            if (QSP_PNUM(curValue) < QSP_PNUM(bestValue))
+                                bestValue = curValue;
+                        }
+                        else if (QSP_PNUM(curValue) > QSP_PNUM(bestValue))
                             bestValue = curValue;
+                        break;
                     }
-                    else if (QSP_PNUM(curValue) > QSP_PNUM(bestValue))
-                        bestValue = curValue;
-                    break;
                 }
+                else
+                    bestValue = curValue;
             }
-            else
-                bestValue = curValue;
         }
     }
-    if (bestValue) qspCopyToNewVariant(&resultValue, bestValue);
+    if (bestValue) qspShareToNewVariant(&resultValue, bestValue);
     return resultValue;
 }
 
@@ -965,12 +1801,31 @@ INLINE int qspGetVarsNames(QSPString str, QSPString *varNames, int maxNames)
     return count;
 }
 
-INLINE void qspSetVarsValues(QSPString *varNames, int varsCount, QSPVariant *v, QSP_CHAR op)
+INLINE int qspGetRawTargets(QSPString s, QSPCachedArg *namesArg, QSPAssignTarget *targets)
+{
+    /* The statement couldn't be pre-parsed, so we parse its text the usual way to report errors */
+    int i, count;
+    QSP_CHAR *nameEnd;
+    QSPString names[QSP_MAXSETVARS];
+    count = qspGetVarsNames(qspStringFromPair(s.Str + namesArg->StartPos, s.Str + namesArg->EndPos), names, QSP_MAXSETVARS);
+    for (i = 0; i < count; ++i, ++targets)
+    {
+        nameEnd = qspStrCharClass(names[i], QSP_CHAR_DELIM);
+        targets->StartPos = (int)(names[i].Str - s.Str);
+        targets->NameEndPos = (int)((nameEnd ? nameEnd : names[i].End) - s.Str);
+        targets->EndPos = (int)(names[i].End - s.Str);
+        targets->NameId = -1;
+        targets->Type = qspTargetRaw;
+    }
+    return count;
+}
+
+INLINE void qspSetVarsValues(QSPString s, QSPAssignTarget *targets, int varsCount, QSPVariant *v, QSP_CHAR op)
 {
     int i, oldLocationState;
     if (varsCount == 1)
     {
-        qspSetVarValue(varNames[0], v, op);
+        qspSetVarValue(s, targets, v, op);
         return;
     }
     /* Examples:
@@ -993,13 +1848,13 @@ INLINE void qspSetVarsValues(QSPString *varNames, int varsCount, QSPVariant *v,
                 int lastVarIndex = varsCount - 1;
                 for (i = 0; i < lastVarIndex; ++i)
                 {
-                    qspSetVarValue(varNames[i], QSP_PTUPLE(v).Vals + i, op);
+                    qspSetVarValue(s, targets + i, QSP_PTUPLE(v).Vals + i, op);
                     if (qspLocationState != oldLocationState)
                         return;
                 }
                 /* Only 1 variable left, fill it with a tuple containing all the values left */
                 v2 = qspTupleVariant(qspMoveToNewTuple(QSP_PTUPLE(v).Vals + i, QSP_PTUPLE(v).ValsCount - i));
-                qspSetVarValue(varNames[lastVarIndex], &v2, op);
+                qspSetVarValue(s, targets + lastVarIndex, &v2, op);
                 qspFreeVariant(&v2);
             }
             else
@@ -1007,14 +1862,14 @@ INLINE void qspSetVarsValues(QSPString *varNames, int varsCount, QSPVariant *v,
                 /* Assign all values to the variables */
                 for (i = 0; i < valuesCount; ++i)
                 {
-                    qspSetVarValue(varNames[i], QSP_PTUPLE(v).Vals + i, op);
+                    qspSetVarValue(s, targets + i, QSP_PTUPLE(v).Vals + i, op);
                     if (qspLocationState != oldLocationState)
                         return;
                 }
                 /* No values left, reset the rest of vars with default values */
                 while (i < varsCount)
                 {
-                    qspResetVar(varNames[i]);
+                    qspResetVar(s, targets + i);
                     if (qspLocationState != oldLocationState)
                         return;
                     ++i;
@@ -1025,12 +1880,12 @@ INLINE void qspSetVarsValues(QSPString *varNames, int varsCount, QSPVariant *v,
     case QSP_TYPE_NUM:
     case QSP_TYPE_STR:
         /* Consider it a tuple with 1 item */
-        qspSetVarValue(varNames[0], v, op);
+        qspSetVarValue(s, targets, v, op);
         if (qspLocationState != oldLocationState)
             return;
         for (i = 1; i < varsCount; ++i)
         {
-            qspResetVar(varNames[i]);
+            qspResetVar(s, targets + i);
             if (qspLocationState != oldLocationState)
                 return;
         }
@@ -1042,8 +1897,8 @@ void qspStatementSetVarsValues(QSPString s, QSPCachedStat *stat)
 {
     QSP_CHAR op;
     QSPVariant v;
-    QSPString names[QSP_MAXSETVARS];
-    int namesCount, oldLocationState;
+    QSPAssignTarget rawTargets[QSP_MAXSETVARS], *targets;
+    int targetsCount, oldLocationState;
     if (stat->ErrorCode)
     {
         qspSetError(stat->ErrorCode);
@@ -1055,31 +1910,33 @@ void qspStatementSetVarsValues(QSPString s, QSPCachedStat *stat)
         return;
     }
     oldLocationState = qspLocationState;
-    v = qspCalculateExprValue(qspStringFromPair(s.Str + stat->Args[2].StartPos, s.Str + stat->Args[2].EndPos));
+    v = qspCalculateArgValue(s, stat->Args + 2);
     if (qspLocationState != oldLocationState) return;
-    namesCount = qspGetVarsNames(qspStringFromPair(s.Str + stat->Args[0].StartPos, s.Str + stat->Args[0].EndPos), names, QSP_MAXSETVARS);
-    if (!namesCount)
+    if (stat->Targets)
     {
-        qspFreeVariant(&v);
-        return;
+        targets = stat->Targets;
+        targetsCount = stat->TargetsCount;
+    }
+    else
+    {
+        targets = rawTargets;
+        targetsCount = qspGetRawTargets(s, stat->Args, rawTargets);
+        if (!targetsCount)
+        {
+            qspFreeVariant(&v);
+            return;
+        }
     }
     op = *(s.Str + stat->Args[1].StartPos); /* contains one of QSP_CHAR_SIMPLEOP characters */
-    qspSetVarsValues(names, namesCount, &v, op);
+    qspSetVarsValues(s, targets, targetsCount, &v, op);
     qspFreeVariant(&v);
 }
 
-INLINE QSPString qspGetVarNameOnly(QSPString s)
-{
-    QSP_CHAR *nameEnd = qspStrCharClass(s, QSP_CHAR_DELIM);
-    if (nameEnd) s.End = nameEnd;
-    return s;
-}
-
 void qspStatementLocal(QSPString s, QSPCachedStat *stat)
 {
     QSPVariant v;
-    QSPString varName, names[QSP_MAXSETVARS];
-    int i, namesCount;
+    QSPAssignTarget rawTargets[QSP_MAXSETVARS], *targets;
+    int i, targetsCount;
     if (stat->ErrorCode)
     {
         qspSetError(stat->ErrorCode);
@@ -1094,21 +1951,30 @@ void qspStatementLocal(QSPString s, QSPCachedStat *stat)
             return;
         }
         /* We have to evaluate expression before allocation of local vars */
-        v = qspCalculateExprValue(qspStringFromPair(s.Str + stat->Args[2].StartPos, s.Str + stat->Args[2].EndPos));
+        v = qspCalculateArgValue(s, stat->Args + 2);
         if (qspLocationState != oldLocationState) return;
     }
     else
         v = qspGetEmptyVariant(QSP_TYPE_UNDEF);
-    namesCount = qspGetVarsNames(qspStringFromPair(s.Str + stat->Args[0].StartPos, s.Str + stat->Args[0].EndPos), names, QSP_MAXSETVARS);
-    if (!namesCount)
+    if (stat->Targets)
     {
-        qspFreeVariant(&v);
-        return;
+        targets = stat->Targets;
+        targetsCount = stat->TargetsCount;
+    }
+    else
+    {
+        targets = rawTargets;
+        targetsCount = qspGetRawTargets(s, stat->Args, rawTargets);
+        if (!targetsCount)
+        {
+            qspFreeVariant(&v);
+            return;
+        }
     }
-    for (i = 0; i < namesCount; ++i)
+    for (i = 0; i < targetsCount; ++i)
     {
-        varName = qspGetVarNameOnly(names[i]);
-        if (!qspAddVarToLocals(varName))
+        QSPString varName = qspStringFromPair(s.Str + targets[i].StartPos, s.Str + targets[i].NameEndPos);
+        if (!qspAddVarToLocals(varName, targets[i].NameId))
         {
             qspFreeVariant(&v);
             return;
@@ -1116,7 +1982,7 @@ void qspStatementLocal(QSPString s, QSPCachedStat *stat)
     }
     if (stat->ArgsCount > 1)
     {
-        qspSetVarsValues(names, namesCount, &v, QSP_EQUAL_CHAR);
+        qspSetVarsValues(s, targets, targetsCount, &v, QSP_EQUAL_CHAR);
         qspFreeVariant(&v);
     }
 }
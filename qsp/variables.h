@@ -14,10 +14,16 @@
     #define QSP_VARSDEFINES
 
     #define QSP_MAXSETVARS 20
-    #define QSP_VARSGLOBALBUCKETS 512
-    #define QSP_VARSLOCALBUCKETS 16
-    #define QSP_MAXVARSBUCKETSIZE 32
+    #define QSP_VARSGLOBALCAPACITY 1024
+    #define QSP_VARSLOCALCAPACITY 16
+    #define QSP_VARNAMESCAPACITY 1024
+    #define QSP_VARSEGMENTSIZE 64 /* items of a sparse array are stored in segments */
+    #define QSP_VARBLOCKSEGMENTS 1024
+    #define QSP_VARBLOCKSIZE (QSP_VARSEGMENTSIZE * QSP_VARBLOCKSEGMENTS)
+    #define QSP_VARSPARSEMINSIZE 4096 /* smaller arrays are always dense */
     #define QSP_VARSSCOPECHUNKSIZE 128
+    #define QSP_SORTPREFIXLEN 8 /* strings get compared by their cached prefixes first */
+    #define QSP_SORTRUNLEN 16 /* short runs get sorted by insertion before merging */
     #define QSP_VARARGS QSP_FMT("ARGS")
     #define QSP_VARRES QSP_FMT("RESULT")
 
@@ -25,30 +31,80 @@
     {
         int Index;
         QSPString Str;
+        unsigned int Hash;
     } QSPVarIndex;
 
     typedef struct
+    {
+        QSPVariant *Segments[QSP_VARBLOCKSEGMENTS]; /* missing segments contain only undefined items */
+    } QSPVarBlock;
+
+    #ifdef QSP_USE_BIGINT
+        typedef unsigned long long QSP_SORTKEY;
+    #else
+        typedef unsigned int QSP_SORTKEY;
+    #endif
+    #define QSP_SORTKEYBYTES ((int)sizeof(QSP_SORTKEY)) /* number of radix sort passes */
+
+    typedef struct
+    {
+        QSP_SORTKEY Key; /* keeps the order of numbers when compared as unsigned */
+        int Position;
+    } QSPSortNumItem;
+
+    typedef struct
+    {
+        QSP_CHAR Prefix[QSP_SORTPREFIXLEN];
+        int PrefixLen;
+        int Position;
+    } QSPSortStrItem;
+
+    typedef struct QSPVar_s QSPVar;
+
+    typedef struct QSPVar_s
     {
         QSPString Name;
-        QSPVariant *Values;
-        int ValsCount;
+        int NameId; /* interned name, only local variables have it */
+        QSPVar *ShadowedVar; /* the local variable that is hidden by this one */
+        QSPVariant *Values; /* items of a dense array */
+        int ValsCount; /* size of the array, it doesn't depend on the representation */
         int ValsCapacity;
-        QSPVarIndex *Indices;
+        QSPVarBlock **Blocks; /* items of a sparse array, dense arrays don't have blocks */
+        int BlocksCount;
+        int SegmentsCount;
+        QSPVarIndex *Indices; /* string indices aren't ordered */
         int IndsCount;
         int IndsCapacity;
+        int *IndsTable; /* open addressing table of positions in Indices, its capacity is always a power of 2 */
+        int IndsTableCapacity;
     } QSPVar;
 
     typedef struct
     {
-        QSPVar *Vars;
-        int VarsCount;
-        int Capacity;
-    } QSPVarsBucket;
+        QSPVar *Var;
+        unsigned int Hash;
+    } QSPVarsEntry;
+
+    typedef struct
+    {
+        QSPString Name; /* name without the type prefix */
+        unsigned int Hash;
+        QSPVar *LocalVar; /* the innermost local variable with this name */
+        QSPVar *GlobalVar; /* the last resolved global variable */
+        unsigned int GlobalVarGeneration; /* the global variable is valid while it matches qspGlobalVarsGeneration */
+    } QSPVarName;
 
     typedef struct
     {
-        QSPVarsBucket *Buckets;
-        int BucketsCount;
+        QSPVarsEntry *Entries; /* open addressing table, its capacity is always a power of 2 */
+        int EntriesCapacity;
+        QSPVar **Vars; /* every variable is allocated separately, so references to variables stay valid */
+        int VarsCount;
+        int VarsAllocated; /* allocated variables get reused after the scope is cleared */
+        int VarsCapacity;
+        QSP_BOOL IsCallFrame; /* scopes of calls keep ARGS & RESULT in fixed slots outside of the table */
+        QSPVar FrameArgs;
+        QSPVar FrameResult;
     } QSPVarsScope;
 
     typedef struct QSPVarsScopeChunk_s QSPVarsScopeChunk;
@@ -64,13 +120,19 @@
     extern QSPVarsScope qspGlobalVars; /* there's only one global scope, we don't recreate it */
     extern QSPVarsScopeChunk *qspCurrentLocalVars; /* local scopes can be recreated */
 
+    extern QSPVarName *qspVarNames; /* interned names, they are kept till the end of the runtime */
+    extern int qspVarNamesCount;
+
     extern QSP_TINYINT qspSpecToBaseTypeTable[128];
 
     /* External functions */
     void qspInitVarTypes(void);
+    void qspInitVarNames(void);
+    void qspTerminateVarNames(void);
+    int qspGetVarNameId(QSPString name);
     QSPVarsScopeChunk *qspAllocateVarsScopeChunk(QSPVarsScopeChunk *parentChunk);
     void qspClearVarsScopeChunk(QSPVarsScopeChunk *chunk);
-    void qspInitVarsScope(QSPVarsScope *scope, int buckets);
+    void qspInitVarsScope(QSPVarsScope *scope, int capacity);
     void qspClearVarsScope(QSPVarsScope *scope);
     void qspClearVars(QSPVarsScope *scope);
     void qspClearLocalVarsScopes(QSPVarsScopeChunk *chunk);
@@ -81,10 +143,17 @@
     QSPVarsScopeChunk *qspSaveLocalVarsAndRestoreGlobals(void);
     void qspRestoreSavedLocalVars(QSPVarsScopeChunk *chunk);
     QSPVar *qspVarReference(QSPString name, QSP_BOOL toCreate);
+    QSPVar *qspVarReferenceById(int nameId, QSP_BOOL toCreate);
+    QSPVar *qspAddVarToScope(QSPVarsScope *scope, QSPString name);
+    void qspBuildVarIndicesTable(QSPVar *var);
+    void qspSortVarIndices(QSPVar *var);
+    QSPVariant *qspGetVarItemsRange(QSPVar *var, int ind, int *count);
+    QSPVariant *qspAllocateVarItem(QSPVar *var, int ind);
+    QSPTuple qspArrayItemsToNewTuple(QSPVar *var, int start, int count);
     int qspGetVarIndex(QSPVar *var, QSPVariant index, QSP_BOOL toCreate);
-    QSP_BOOL qspGetVarValueByIndex(QSPString varName, QSPVariant index, QSPVariant *res);
-    QSP_BOOL qspGetFirstVarValue(QSPString varName, QSPVariant *res);
-    QSP_BOOL qspGetLastVarValue(QSPString varName, QSPVariant *res);
+    QSP_BOOL qspGetVarValueByIndex(QSPString varName, int nameId, QSPVariant index, QSPVariant *res);
+    QSP_BOOL qspGetFirstVarValue(QSPString varName, int nameId, QSPVariant *res);
+    QSP_BOOL qspGetLastVarValue(QSPString varName, int nameId, QSPVariant *res);
     QSPString qspGetVarStrValue(QSPString name);
     QSP_BIGINT qspGetVarNumValue(QSPString name);
     int qspArraySize(QSPString varName);
@@ -101,6 +170,11 @@
     void qspStatementScanStr(QSPVariant *args, QSP_TINYINT count, QSP_TINYINT extArg);
     void qspStatementKillVar(QSPVariant *args, QSP_TINYINT count, QSP_TINYINT extArg);
 
+    INLINE unsigned int qspGetNameHash(QSPString name)
+    {
+        return qspStrHash(name);
+    }
+
     INLINE QSP_TINYINT qspGetVarType(QSPString str)
     {
         QSP_CHAR specSymbol = *str.Str;
@@ -116,9 +190,14 @@
         var->Values = 0;
         var->ValsCount = 0;
         var->ValsCapacity = 0;
+        var->Blocks = 0;
+        var->BlocksCount = 0;
+        var->SegmentsCount = 0;
         var->Indices = 0;
         var->IndsCount = 0;
         var->IndsCapacity = 0;
+        var->IndsTable = 0;
+        var->IndsTableCapacity = 0;
     }
 
     INLINE void qspMoveVar(QSPVar *dest, QSPVar *src)
@@ -127,9 +206,14 @@
         dest->Values = src->Values;
         dest->ValsCount = src->ValsCount;
         dest->ValsCapacity = src->ValsCapacity;
+        dest->Blocks = src->Blocks;
+        dest->BlocksCount = src->BlocksCount;
+        dest->SegmentsCount = src->SegmentsCount;
         dest->Indices = src->Indices;
         dest->IndsCount = src->IndsCount;
         dest->IndsCapacity = src->IndsCapacity;
+        dest->IndsTable = src->IndsTable;
+        dest->IndsTableCapacity = src->IndsTableCapacity;
         qspInitVarData(src);
     }
 
@@ -141,6 +225,27 @@
             qspFreeVariants(var->Values, var->ValsCount);
             free(var->Values);
         }
+        if (var->Blocks)
+        {
+            int i, j;
+            QSPVarBlock *block;
+            for (i = 0; i < var->BlocksCount; ++i)
+            {
+                if ((block = var->Blocks[i]))
+                {
+                    for (j = 0; j < QSP_VARBLOCKSEGMENTS; ++j)
+                    {
+                        if (block->Segments[j])
+                        {
+                            qspFreeVariants(block->Segments[j], QSP_VARSEGMENTSIZE);
+                            free(block->Segments[j]);
+                        }
+                    }
+                    free(block);
+                }
+            }
+            free(var->Blocks);
+        }
         if (var->Indices)
         {
             QSPVarIndex *curIndex;
@@ -149,13 +254,31 @@
                 qspFreeString(&curIndex->Str);
             free(var->Indices);
         }
+        if (var->IndsTable) free(var->IndsTable);
         qspInitVarData(var);
     }
 
+    INLINE QSPVariant *qspGetVarItem(QSPVar *var, int ind)
+    {
+        /* Returns 0 for items that aren't stored */
+        if (ind < 0 || ind >= var->ValsCount) return 0;
+        if (var->Blocks)
+        {
+            QSPVariant *segment;
+            QSPVarBlock *block = var->Blocks[ind / QSP_VARBLOCKSIZE];
+            if (!block) return 0;
+            segment = block->Segments[(ind % QSP_VARBLOCKSIZE) / QSP_VARSEGMENTSIZE];
+            return (segment ? segment + ind % QSP_VARSEGMENTSIZE : 0);
+        }
+        return var->Values + ind;
+    }
+
     INLINE QSPVar qspGetUnknownVar(void)
     {
         QSPVar var;
         var.Name = qspNullString;
+        var.NameId = -1;
+        var.ShadowedVar = 0;
         qspInitVarData(&var);
         return var;
     }
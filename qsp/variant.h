@@ -100,6 +100,23 @@
         }
     }
 
+    INLINE void qspShareToNewVariant(QSPVariant *dest, QSPVariant *src)
+    {
+        /* Strings of the source have to be allocated texts, e.g. values of variables */
+        switch (QSP_BASETYPE(dest->Type = src->Type))
+        {
+        case QSP_TYPE_TUPLE:
+            QSP_PTUPLE(dest) = qspCopyToNewTuple(QSP_PTUPLE(src).Vals, QSP_PTUPLE(src).ValsCount);
+            break;
+        case QSP_TYPE_NUM:
+            QSP_PNUM(dest) = QSP_PNUM(src);
+            break;
+        case QSP_TYPE_STR:
+            QSP_PSTR(dest) = qspShareText(QSP_PSTR(src));
+            break;
+        }
+    }
+
     INLINE void qspMoveToNewVariant(QSPVariant *dest, QSPVariant *src)
     {
         dest->Val = src->Val;